@@ -10,25 +10,188 @@
 #include <assert.h>
 #include <locale.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include "LinkedList.h"
 
 #define localhost "127.0.0.1"
 #define UINT_MAX 4294967295 // Maximum value for an unsigned int
 
+#define INDEX_INITIAL_CAPACITY 64   // Initial number of slots of the alias index
+#define INDEX_MIGRATE_STEP 64       // Slots of the old index migrated by every register/unregister
+
+#define SMALL_CHUNK_SIZE 512        // Bytes of the first arena chunk of a message list (fits any message)
+#define LARGE_CHUNK_SIZE 8192       // Bytes of the following arena chunks of a message list
+
+// Users and pending messages are allocated from slabs instead of one malloc() each
+SlabPool user_pool = SLAB_POOL_INITIALIZER("users", UserEntry);
+SlabPool message_list_pool = SLAB_POOL_INITIALIZER("message lists", MessageList);
+SlabPool small_chunk_pool = SLAB_POOL_INITIALIZER_SIZE("small message chunks", SMALL_CHUNK_SIZE);
+SlabPool large_chunk_pool = SLAB_POOL_INITIALIZER_SIZE("large message chunks", LARGE_CHUNK_SIZE);
+
+/**
+ * @brief Create an alias with one reference.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the alias.
+ */
+Alias *create_alias(const char *alias) {
+    size_t length = strnlen(alias, 255);
+    Alias *new_alias = (Alias *)malloc(sizeof(Alias) + length + 1);
+    if (new_alias == NULL) {
+        return NULL;
+    }
+    new_alias->refs = 1;
+    new_alias->length = length;
+    memcpy(new_alias->str, alias, length);
+    new_alias->str[length] = '\0';
+    return new_alias;
+}
+
+/**
+ * @brief Add a reference to an alias.
+ */
+void alias_ref(Alias *alias) {
+    __atomic_add_fetch(&alias->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drop a reference to an alias, freeing it when it was the last one.
+ */
+void alias_unref(Alias *alias) {
+    if (__atomic_sub_fetch(&alias->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(alias);
+    }
+}
+
+/**
+ * @brief Hash an alias (64-bit FNV-1a).
+ */
+uint64_t hash_alias(const char *alias) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)alias; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Find the slot of the index that holds the user with the given alias.
+ * @return NULL if the alias is not in the index. Otherwise, return a pointer to the slot.
+ */
+IndexSlot *index_find(AliasIndex *index, const char *alias, uint64_t hash) {
+    if (index->capacity == 0) {
+        return NULL;
+    }
+    size_t mask = index->capacity - 1;
+    for (size_t pos = hash & mask; ; pos = (pos + 1) & mask) {
+        IndexSlot *slot = &index->slots[pos];
+        if (slot->user == NULL) {
+            return NULL;
+        }
+        if (slot->hash == hash && slot->user != INDEX_TOMBSTONE && strcmp(slot->user->alias->str, alias) == 0) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * @brief Insert a user in the first free slot of its probe sequence. The index must have room for it.
+ */
+void index_insert(AliasIndex *index, UserEntry *user) {
+    size_t mask = index->capacity - 1;
+    size_t pos = user->hash & mask;
+    while (index->slots[pos].user != NULL && index->slots[pos].user != INDEX_TOMBSTONE) {
+        pos = (pos + 1) & mask;
+    }
+    if (index->slots[pos].user == NULL) {
+        index->used++;
+    }
+    index->slots[pos].hash = user->hash;
+    index->slots[pos].user = user;
+}
+
+/**
+ * @brief Move up to steps slots of the old index to the current one. The old index is freed once it is empty.
+ */
+void index_migrate(UserList *list, size_t steps) {
+    while (steps > 0 && list->migrate_pos < list->old_index.capacity) {
+        UserEntry *current = list->old_index.slots[list->migrate_pos++].user;
+        if (current != NULL && current != INDEX_TOMBSTONE) {
+            index_insert(&list->index, current);
+        }
+        steps--;
+    }
+    if (list->old_index.capacity > 0 && list->migrate_pos == list->old_index.capacity) {
+        free(list->old_index.slots);
+        list->old_index.slots = NULL;
+        list->old_index.capacity = 0;
+        list->old_index.used = 0;
+        list->migrate_pos = 0;
+    }
+}
+
+/**
+ * @brief Make room in the index for one more user.
+ * When the index is 3/4 full, a new index is allocated and the users are moved to it a few at a time
+ * by the following registers/unregisters, so no single insert has to rehash the whole list.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t index_reserve(UserList *list) {
+    if ((list->index.used + 1) * 4 <= list->index.capacity * 3) {
+        return 0;
+    }
+
+    // A resize is only started after the previous one has finished
+    index_migrate(list, SIZE_MAX);
+
+    size_t capacity = INDEX_INITIAL_CAPACITY;
+    while (capacity < ((size_t)list->size + 1) * 2) {
+        capacity *= 2;
+    }
+    IndexSlot *slots = (IndexSlot *)calloc(capacity, sizeof(IndexSlot));
+    if (slots == NULL) {
+        return 1;
+    }
+
+    list->old_index = list->index;
+    list->migrate_pos = 0;
+    list->index.slots = slots;
+    list->index.capacity = capacity;
+    list->index.used = 0;
+    return 0;
+}
+
+/**
+ * @brief Free both indexes of the list.
+ */
+void index_destroy(UserList *list) {
+    free(list->index.slots);
+    free(list->old_index.slots);
+    memset(&list->index, 0, sizeof(AliasIndex));
+    memset(&list->old_index, 0, sizeof(AliasIndex));
+    list->migrate_pos = 0;
+}
+
+/**
+ * @brief Find the slot of the user with the given alias in any of the indexes of the list.
+ * @return NULL if the alias does not exist in the list. Otherwise, return a pointer to the slot.
+ */
+IndexSlot *search_slot(UserList *list, const char *alias, uint64_t hash) {
+    IndexSlot *slot = index_find(&list->index, alias, hash);
+    if (slot == NULL) {
+        slot = index_find(&list->old_index, alias, hash);
+    }
+    return slot;
+}
+
 /**
  * @brief Search for a user with the given alias in the list.
+ * The lookup uses the alias index and does not modify the list, so it is safe for readers.
  * @return NULL if the alias does not exist in the list. Otherwise, return a pointer to the user entry.
  */
 UserEntry *search(UserList *list, char *alias) {
-  UserEntry *current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->alias, alias) == 0) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
+    IndexSlot *slot = search_slot(list, alias, hash_alias(alias));
+    return slot != NULL ? slot->user : NULL;
 }
 
 uint8_t validate_ip_port(char* ip, char *port) {
@@ -83,42 +246,143 @@ uint8_t register_user(UserList *list, char *ip, char *port, char *name, char *al
     }
 
     // Check if user already exists
-    UserEntry *existing = search(list, alias);
-    if (existing != NULL) {
+    uint64_t hash = hash_alias(alias);
+    if (search_slot(list, alias, hash) != NULL) {
         return 1;
     }
 
+    // Make room in the index for the new user
+    index_migrate(list, INDEX_MIGRATE_STEP);
+    if (index_reserve(list)) {
+        return 2;
+    }
+
     // Create a new user entry
-    UserEntry *new_user = (UserEntry *)malloc(sizeof(UserEntry));
+    UserEntry *new_user = (UserEntry *)slab_alloc(&user_pool);
     if (new_user == NULL) {
         return 2;
     }
 
-    strncpy(new_user->ip, ip, 16);
-    strncpy(new_user->port, port, 6);
-    strncpy(new_user->name, name, 256);
-    strncpy(new_user->alias, alias, 256);
-    strncpy(new_user->birth, birth, 11);
+    strncpy(new_user->ip, ip, 15);
+    new_user->ip[15] = '\0';
+    strncpy(new_user->port, port, 5);
+    new_user->port[5] = '\0';
+    new_user->name = strndup(name, 255);
+    new_user->alias = create_alias(alias);
+    strncpy(new_user->birth, birth, 10);
+    new_user->birth[10] = '\0';
     new_user->messageId = 0;                                // Initial message ID is 0
+    new_user->storedId = 0;                                 // No message stored yet
     new_user->status = 0;                                   // Initial status is disconnected (0)
+    new_user->hash = hash;
     new_user->pendingMessages = create_message_list();      // Create a new list of pending messages
+    new_user->inflight = NULL;
+    if (new_user->name == NULL || new_user->alias == NULL || new_user->pendingMessages == NULL) {
+        free(new_user->name);
+        if (new_user->alias != NULL) {
+            alias_unref(new_user->alias);
+        }
+        slab_free(&message_list_pool, new_user->pendingMessages);
+        slab_free(&user_pool, new_user);
+        return 2;
+    }
+    new_user->prev = list->tail;
     new_user->next = NULL;                                  // User is at the end of the list, so next is NULL
 
-    // Add the user entry to the list
-    if (list->head == NULL) {
+    // Add the user entry to the end of the list and to the index
+    if (list->tail == NULL) {
         list->head = new_user;
     } else {
-        UserEntry *current = list->head;
-        while (current->next != NULL) {
-            current = current->next;
-        }
-        current->next = new_user;
+        list->tail->next = new_user;
     }
+    list->tail = new_user;
+    index_insert(&list->index, new_user);
 
     list->size++;
     return 0;
 }
 
+/**
+ * @brief Make room in the index of the list for users users, so adding them does not resize it.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t reserve_users(UserList *list, size_t users) {
+    if (users * 4 <= list->index.capacity * 3) {
+        return 0;
+    }
+
+    index_migrate(list, SIZE_MAX);
+    size_t capacity = INDEX_INITIAL_CAPACITY;
+    while (capacity < users * 2) {
+        capacity *= 2;
+    }
+    IndexSlot *slots = (IndexSlot *)calloc(capacity, sizeof(IndexSlot));
+    if (slots == NULL) {
+        return 1;
+    }
+
+    // The users already in the index are moved now: the list is usually empty
+    list->old_index = list->index;
+    list->migrate_pos = 0;
+    list->index.slots = slots;
+    list->index.capacity = capacity;
+    list->index.used = 0;
+    index_migrate(list, SIZE_MAX);
+    return 0;
+}
+
+/**
+ * @brief Add a user read from a snapshot, whose fields were validated when it registered.
+ * @return NULL if the user already exists or there is no memory. Otherwise, return a pointer to the user entry.
+ */
+UserEntry *restore_user(UserList *list, const char *ip, const char *port, const char *name, const char *alias,
+                        const char *birth, unsigned int messageId) {
+    uint64_t hash = hash_alias(alias);
+    if (search_slot(list, alias, hash) != NULL || index_reserve(list)) {
+        return NULL;
+    }
+
+    UserEntry *new_user = (UserEntry *)slab_alloc(&user_pool);
+    if (new_user == NULL) {
+        return NULL;
+    }
+    strncpy(new_user->ip, ip, 15);
+    new_user->ip[15] = '\0';
+    strncpy(new_user->port, port, 5);
+    new_user->port[5] = '\0';
+    new_user->name = strndup(name, 255);
+    new_user->alias = create_alias(alias);
+    strncpy(new_user->birth, birth, 10);
+    new_user->birth[10] = '\0';
+    new_user->messageId = messageId;
+    new_user->storedId = 0;
+    new_user->status = 0;
+    new_user->hash = hash;
+    new_user->pendingMessages = create_message_list();
+    new_user->inflight = NULL;
+    if (new_user->name == NULL || new_user->alias == NULL || new_user->pendingMessages == NULL) {
+        free(new_user->name);
+        if (new_user->alias != NULL) {
+            alias_unref(new_user->alias);
+        }
+        slab_free(&message_list_pool, new_user->pendingMessages);
+        slab_free(&user_pool, new_user);
+        return NULL;
+    }
+
+    new_user->prev = list->tail;
+    new_user->next = NULL;
+    if (list->tail == NULL) {
+        list->head = new_user;
+    } else {
+        list->tail->next = new_user;
+    }
+    list->tail = new_user;
+    index_insert(&list->index, new_user);
+    list->size++;
+    return new_user;
+}
+
 /**
  * @brief Delete a user from the list with the given alias.
  * 1. Search for the user with the given alias in the list. If does not exist, return 1.
@@ -128,30 +392,97 @@ uint8_t register_user(UserList *list, char *ip, char *port, char *name, char *al
  * @return 0 -> Success, 1 -> User not found, 2 -> Error
  */
 uint8_t unregister_user(UserList *list, char *alias) {
-    UserEntry *previous = NULL;
-    UserEntry *current = list->head;
+    IndexSlot *slot = search_slot(list, alias, hash_alias(alias));
+    if (slot == NULL) {
+        return 1;
+    }
+    UserEntry *current = slot->user;
 
-    while (current != NULL) {
-        if (strcmp(current->alias, alias) == 0) {
-            // Delete all pending messages
-            delete_pending_message_list(current->pendingMessages);
-
-            // Delete the user from the list
-            if (previous == NULL) {
-                list->head = current->next;
-            } else {
-                previous->next = current->next;
-            }
+    // Delete all pending messages
+    delete_pending_message_list(current->pendingMessages);
 
-            list->size--;
-            delete_user_entry(current);
-            return 0;
-        }
-        previous = current;
-        current = current->next;
+    // Delete the user from the index and from the list
+    slot->user = INDEX_TOMBSTONE;
+    if (current->prev == NULL) {
+        list->head = current->next;
+    } else {
+        current->prev->next = current->next;
+    }
+    if (current->next == NULL) {
+        list->tail = current->prev;
+    } else {
+        current->next->prev = current->prev;
     }
 
-    return 1;
+    list->size--;
+    delete_user_entry(current);
+    index_migrate(list, INDEX_MIGRATE_STEP);
+    return 0;
+}
+
+/**
+ * @brief Detach the pending messages of a user, replacing them with an empty list.
+ * The detached list is still linked to the user (inflight), for the snapshots, until finish_inflight().
+ * @return NULL if the user has no pending messages (or there is no memory). Otherwise, the detached list.
+ */
+MessageList *detach_messages(UserEntry *user) {
+    if (user->pendingMessages->size == 0) {
+        return NULL;
+    }
+    MessageList *mailbox = create_message_list();
+    if (mailbox == NULL) {
+        return NULL;
+    }
+    // The sequence numbers of the new messages continue after the detached ones
+    mailbox->first = user->pendingMessages->next;
+    mailbox->next = user->pendingMessages->next;
+    MessageList *detached = user->pendingMessages;
+    user->pendingMessages = mailbox;
+
+    // Link it after the lists of the user that are still being delivered
+    MessageList **link = &user->inflight;
+    while (*link != NULL) {
+        link = &(*link)->next_inflight;
+    }
+    detached->next_inflight = NULL;
+    *link = detached;
+    return detached;
+}
+
+/**
+ * @brief Forget a list detached from a user (see detach_messages()) once it has been delivered or given back.
+ */
+void finish_inflight(UserEntry *user, MessageList *detached) {
+    MessageList **link = &user->inflight;
+    while (*link != NULL && *link != detached) {
+        link = &(*link)->next_inflight;
+    }
+    if (*link != NULL) {
+        *link = detached->next_inflight;
+        detached->next_inflight = NULL;
+    }
+}
+
+/**
+ * @brief Forget a list detached from the user with the given alias, if the user still exists.
+ */
+void finish_delivery(UserList *list, char *alias, MessageList *detached) {
+    UserEntry *user = search(list, alias);
+    if (user != NULL) {
+        finish_inflight(user, detached);
+    }
+}
+
+/**
+ * @brief Detach the pending messages of a connected user, to deliver them without holding the lock of the list.
+ * @return NULL if the user does not exist, is not connected or has no pending messages. Otherwise, the detached list.
+ */
+MessageList *detach_pending_messages(UserList *list, char *alias) {
+    UserEntry *user = search(list, alias);
+    if (user == NULL || user->status == 0) {
+        return NULL;
+    }
+    return detach_messages(user);
 }
 
 /**
@@ -159,7 +490,7 @@ uint8_t unregister_user(UserList *list, char *alias) {
  * 1. Search for the user with the given alias in the list. If does not exist, return 1.
  * 2. If the user is already connected, return 2.
  * 3. If the user is not connected and exists, set the status to 1 (connected).
- * 4. Otherwise, return 3.
+ * 4. Detach the pending messages: the user gets an empty list and the caller delivers the detached one.
  * @return a struct ConnectionResult with error code 0 -> Success, 1 -> User not found, 2 -> User already connected, 3 -> Error
  */
 ConnectionResult connect_user(UserList *list, char* ip, char* port, char* alias) {
@@ -175,16 +506,14 @@ ConnectionResult connect_user(UserList *list, char* ip, char* port, char* alias)
         result.error_code = 2;
         return result;
     }
-    strncpy(user->ip, ip, 16);              // Update IP
-    strncpy(user->port, port, 6);           // Update port
+    strncpy(user->ip, ip, 15);              // Update IP
+    user->ip[15] = '\0';
+    strncpy(user->port, port, 5);           // Update port
+    user->port[5] = '\0';
     user->status = 1;                       // Set status to connected
 
-    // Check if there are any pending messages
-    if (user->pendingMessages->size > 0) {
-        result.pendingMessages = user->pendingMessages;
-    } else {
-        result.pendingMessages = NULL;
-    }
+    // Detach the pending messages, if any: the caller delivers them without holding the lock of the list
+    result.pendingMessages = detach_messages(user);
 
     return result;
 }
@@ -222,8 +551,7 @@ uint8_t disconnect_user(UserList *list, char* ip, char *alias) {
 ConnectedUsers connected_users(UserList *list, char *alias) {
     UserEntry *user = search(list, alias);
     ConnectedUsers result;
-    result.size = 0;
-    result.error_code = 0;
+    memset(&result, 0, sizeof(result));
 
     if (user == NULL) {
         result.error_code = 2;
@@ -236,33 +564,62 @@ ConnectedUsers connected_users(UserList *list, char *alias) {
 
     UserEntry *current = list->head;
     while (current != NULL) {
-        if (current->status == 1) {
-            result.alias[result.size] = current->alias;
-            result.alias[result.size][255] = '\0'; // Make sure the string is null-terminated
-            result.size++;
+        if (current->status == 1 && append_connected_user(&result, current->alias->str)) {
+            free(result.aliases);
+            memset(&result, 0, sizeof(result));
+            result.error_code = 3;
+            return result;
         }
         current = current->next;
     }
     return result;
 }
 
+/**
+ * @brief Append an alias to the aliases of result, growing the buffer if needed.
+ * @return 0 -> Success, 1 -> Error (no memory)
+ */
+uint8_t append_connected_user(ConnectedUsers *result, const char *alias) {
+    size_t length = strlen(alias) + 1;
+    if (result->length + length > result->capacity) {
+        size_t capacity = result->capacity == 0 ? 1024 : result->capacity * 2;
+        while (capacity < result->length + length) {
+            capacity *= 2;
+        }
+        char *aliases = (char *)realloc(result->aliases, capacity);
+        if (aliases == NULL) {
+            return 1;
+        }
+        result->aliases = aliases;
+        result->capacity = capacity;
+    }
+    memcpy(result->aliases + result->length, alias, length);
+    result->length += length;
+    result->size++;
+    return 0;
+}
+
 /**
  * @brief Send a message from a user to another user.
+ * The source and destination users may be in different lists (shards), or both lists may be the same.
  * 1. Validate the message length.
  * 2. Search for the source user in the list. If it does not exist, return 2.
  * 3. If the source user is not connected, return 3.
  * 4. Search for the destination user in the list. If it does not exist, return 1.
  * 5. Obtain the last message ID of the source user and increment it by 1 (taking into account the wrap-around to 0).
  * 6.a. If the destination user is connected, send the message to the destination user.
- * 6.b. If the destination user is not connected, store the message in the pending messages list of the destination user and local variable <stored> to 1.
- * @return a ReceiverMessage struct with error_code 0 -> Success, 1 -> Destination user not found, 2 -> Error
+ * 6.b. If the destination user is not connected, store the message in the pending messages list of the destination user and local variable <stored> to 1,
+ *      unless its mailbox is full (see quota.h): then return 3 and the message ID is not used.
+ *      If the message cannot be stored, return 2 and the message ID is not used either.
+ * @return a ReceiverMessage struct with error_code 0 -> Success, 1 -> Destination user not found, 2 -> Error, 3 -> Mailbox full
  */
-ReceiverMessage send_message(UserList *list, char *sourceAlias, char *destAlias, char *message) {
+ReceiverMessage send_message(UserList *source_list, UserList *dest_list, char *sourceAlias, char *destAlias, char *message) {
     ReceiverMessage result;
     strcpy(result.ip, "");
     strcpy(result.port, "");
     result.error_code = 0;
     result.msgId = 0;
+    result.id = 0;
     result.stored = 0;
     
     if (strlen(message) > 255) {
@@ -270,7 +627,7 @@ ReceiverMessage send_message(UserList *list, char *sourceAlias, char *destAlias,
         return result;
     }
 
-    UserEntry *source_user = search(list, sourceAlias);
+    UserEntry *source_user = search(source_list, sourceAlias);
     if (source_user == NULL) {
         result.error_code = 2;
         return result;
@@ -280,24 +637,39 @@ ReceiverMessage send_message(UserList *list, char *sourceAlias, char *destAlias,
         return result;
     }
 
-    UserEntry *dest_user = search(list, destAlias);
+    UserEntry *dest_user = search(dest_list, destAlias);
     if (dest_user == NULL) {
         result.error_code = 2;
         return result;
     }
 
-    source_user->messageId = (source_user->messageId + 1) % UINT_MAX;
+    if (dest_user->status == 0) {
+        unsigned int messages;
+        uint64_t bytes;
+        mailbox_usage(dest_user, &messages, &bytes);
+        if (quota_admit(messages, bytes, strlen(message)) != 0) {
+            result.error_code = SEND_MAILBOX_FULL;
+            return result;
+        }
+    }
+
+    unsigned int msgId = (source_user->messageId + 1) % UINT_MAX;
 
     if (dest_user->status == 1) {
         // Send the message to the destination user
         strcpy(result.ip, dest_user->ip);
         strcpy(result.port, dest_user->port);
     } else {
-        add_pending_message(dest_user, sourceAlias, source_user->messageId, message);
+        if (add_pending_message(dest_user, source_user->alias, msgId, message) != 0) {
+            result.error_code = 2;
+            return result;
+        }
+        result.id = dest_user->storedId;
         result.stored = 1;
     }
 
-    result.msgId = source_user->messageId;
+    source_user->messageId = msgId;
+    result.msgId = msgId;
 
     return result;
 }
@@ -311,8 +683,6 @@ uint8_t init(UserList *list) {
         return -1;
     }
     delete_user_list(list);
-    list->head = NULL;
-    list->size = 0;
     return 0;
 }
 
@@ -325,9 +695,10 @@ uint8_t delete_user_entry(UserEntry *user) {
         return 1;
     }
     // delete all the pending messages of the user
-    delete_pending_message_list(user->pendingMessages);
-    free(user->pendingMessages);
-    free(user);
+    destroy_message_list(user->pendingMessages);
+    free(user->name);
+    alias_unref(user->alias);
+    slab_free(&user_pool, user);
     return 0;
 }
 
@@ -343,19 +714,71 @@ uint8_t delete_user_list(UserList *list) {
         current = next;
     }
     list->head = NULL;
+    list->tail = NULL;
     list->size = 0;
+    index_destroy(list);
     return 0;
 }
 
 /**
- * @brief Delete a message entry.
+ * @brief Get the bytes of the arena taken by a message record: header, message and '\0', rounded up to 8 bytes.
+ */
+size_t message_record_size(size_t length) {
+    return (offsetof(MessageEntry, message) + length + 1 + 7) & ~(size_t)7;
+}
+
+/**
+ * @brief Free an arena chunk.
+ */
+void free_chunk(ArenaChunk *chunk) {
+    if (chunk->capacity == SMALL_CHUNK_SIZE - offsetof(ArenaChunk, data)) {
+        slab_free(&small_chunk_pool, chunk);
+    } else {
+        slab_free(&large_chunk_pool, chunk);
+    }
+}
+
+/**
+ * @brief Allocate an empty arena chunk from the given pool.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the chunk.
+ */
+ArenaChunk *create_chunk(SlabPool *pool, size_t size) {
+    ArenaChunk *chunk = (ArenaChunk *)slab_alloc(pool);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->capacity = size - offsetof(ArenaChunk, data);
+    chunk->used = 0;
+    chunk->live = 0;
+    return chunk;
+}
+
+/**
+ * @brief Delete a message entry of the list, once it has been removed from the ring.
+ * The chunk of the message is freed when none of its messages is pending any more.
  * @return 0 -> Success, 1 -> Error
  */
-uint8_t delete_message_entry(MessageEntry* message) {
+uint8_t delete_message_entry(MessageList *list, MessageEntry* message) {
     if (message == NULL) {
         return 1;
     }
-    free(message);
+    ArenaChunk *chunk = (ArenaChunk *)((char *)message - message->offset - offsetof(ArenaChunk, data));
+    alias_unref(message->source);
+    spill_track_memory(-(int64_t)message_record_size(message->length));
+
+    chunk->live--;
+    if (chunk->live == 0) {
+        if (chunk != list->chunk) {
+            free_chunk(chunk);
+        } else if (list->size == 0) {
+            // The list is empty: do not keep memory for it
+            free_chunk(chunk);
+            list->chunk = NULL;
+        } else {
+            // Messages are appended, so the current chunk can be reused from the beginning
+            chunk->used = 0;
+        }
+    }
     return 0;
 }
 
@@ -378,18 +801,114 @@ uint8_t delete_pending_messages(UserList *list, char *alias) {
  * @brief Delete the message list.
  */
 void delete_pending_message_list(MessageList *list) {
-    MessageEntry *current = list->head;
-    while (current != NULL) {
-        MessageEntry *next = current->next;
-        delete_message_entry(current);
-        current = next;
-    }
-    list->head = NULL;
+    quota_track(-(int64_t)pending_message_count(list), -(int64_t)list->bytes);
+    list->bytes = 0;
+    unsigned int first = list->first;
+    list->first = list->next;
     list->size = 0;
+    for (unsigned int num = first; num != list->next; num++) {
+        MessageEntry *message = list->ring[num & (list->capacity - 1)];
+        if (message != NULL) {
+            delete_message_entry(list, message);
+        }
+    }
+    if (list->chunk != NULL) {
+        free_chunk(list->chunk);
+        list->chunk = NULL;
+    }
+    spill_destroy(list->spill);
+    list->spill = NULL;
+    free(list->ring);
+    list->ring = NULL;
+    list->capacity = 0;
+}
+
+/**
+ * @brief Delete the messages of a list and free the list.
+ */
+void destroy_message_list(MessageList *list) {
+    delete_pending_message_list(list);
+    slab_free(&message_list_pool, list);
+}
+
+/**
+ * @brief Give back to a user the messages of a detached list (see connect_user()) that could not be delivered.
+ * They go before the messages received since the list was detached. The detached list is consumed: it becomes
+ * the list of the user, or it is freed.
+ * @return 0 -> Success, 1 -> User not found (the messages are dropped), 2 -> Error
+ */
+uint8_t reattach_pending_messages(UserList *list, char *alias, MessageList *detached) {
+    UserEntry *user = search(list, alias);
+    if (user == NULL) {
+        destroy_message_list(detached);
+        return 1;
+    }
+    finish_inflight(user, detached);
+
+    uint8_t error_code = 0;
+    MessageList *current = user->pendingMessages;
+    MessageEntry *message;
+    while ((message = pop_pending_message(current)) != NULL) {
+        if (enqueue_message(detached, message->source, message->msgId, message->id, message->message)) {
+            error_code = 2;
+        }
+        delete_message_entry(current, message);
+    }
+    destroy_message_list(current);
+    user->pendingMessages = detached;
+    return error_code;
+}
+
+/**
+ * @brief Get the pending message with the given sequence number.
+ * @return NULL if the message is not in the list. Otherwise, return a pointer to the message entry.
+ */
+MessageEntry *get_pending_message(MessageList *list, unsigned int num) {
+    // Unsigned arithmetic: also correct when the sequence numbers wrap around
+    if (num - list->first >= list->next - list->first) {
+        return NULL;
+    }
+    return list->ring[num & (list->capacity - 1)];
+}
+
+/**
+ * @brief Account for a message removed from a list (see quota.h).
+ */
+void forget_message(MessageList *list, MessageEntry *message) {
+    list->bytes -= message->length;
+    quota_track(-1, -(int64_t)message->length);
+}
+
+/**
+ * @brief Skip the deleted messages at the front of the list, so first is always a pending message.
+ */
+void skip_deleted_messages(MessageList *list) {
+    while (list->first != list->next && list->ring[list->first & (list->capacity - 1)] == NULL) {
+        list->first++;
+    }
+}
+
+/**
+ * @brief Remove the oldest message of the list. The caller owns the returned entry (see delete_message_entry()).
+ * When the ring becomes empty, the next spilled messages are read back.
+ * @return NULL if the list is empty. Otherwise, return a pointer to the message entry.
+ */
+MessageEntry *pop_pending_message(MessageList *list) {
+    if (list->size == 0) {
+        return NULL;
+    }
+    MessageEntry *message = list->ring[list->first & (list->capacity - 1)];
+    list->ring[list->first & (list->capacity - 1)] = NULL;
+    list->size--;
+    forget_message(list, message);
+    skip_deleted_messages(list);
+    refill_messages(list);
+    return message;
 }
 
 /**
  * @brief Delete message from user's pending messages list.
+ * @return 0 -> Success, 1 -> User or message not found
  */
 uint8_t delete_message(UserList *list, char *alias, unsigned int num) {
     UserEntry *user = search(list, alias);
@@ -397,61 +916,274 @@ uint8_t delete_message(UserList *list, char *alias, unsigned int num) {
         return 1;
     }
 
-    MessageEntry *previous = NULL;
-    MessageEntry *current = user->pendingMessages->head;
+    MessageList *messages = user->pendingMessages;
+    MessageEntry *message = get_pending_message(messages, num);
+    if (message == NULL) {
+        return 1;
+    }
+
+    // Delete the message from the list
+    messages->ring[num & (messages->capacity - 1)] = NULL;
+    messages->size--;
+    forget_message(messages, message);
+    skip_deleted_messages(messages);
+    delete_message_entry(messages, message);
+    refill_messages(messages);
+    return 0;
+}
 
-    while (current != NULL) {
-        if (current->num == num) {
-            // Delete the message from the list
-            if (previous == NULL) {
-                user->pendingMessages->head = current->next;
-            } else {
-                previous->next = current->next;
-            }
+/**
+ * @brief Delete the pending messages of a user with the identifiers first .. first + count - 1 (they were
+ * delivered, see the log). The messages still spilled to disk are not looked for.
+ * The log is replayed into a single list per user, where the delivered messages are usually the oldest ones, so
+ * they are looked for from its front.
+ * @return 0 -> Success, 1 -> User not found
+ */
+uint8_t drop_delivered_messages(UserList *list, char *alias, unsigned int first, unsigned int count) {
+    UserEntry *user = search(list, alias);
+    if (user == NULL) {
+        return 1;
+    }
 
-            user->pendingMessages->size--;
-            delete_message_entry(current);
-            return 0;
+    MessageList *messages = user->pendingMessages;
+    unsigned int dropped = 0;
+    for (unsigned int num = messages->first; dropped < count && num != messages->next; num++) {
+        // Unsigned arithmetic: also correct when the identifiers wrap around
+        MessageEntry *message = get_pending_message(messages, num);
+        if (message == NULL || message->id - first >= count) {
+            continue;
         }
-        previous = current;
-        current = current->next;
+        messages->ring[num & (messages->capacity - 1)] = NULL;
+        messages->size--;
+        forget_message(messages, message);
+        skip_deleted_messages(messages);
+        delete_message_entry(messages, message);
+        refill_messages(messages);
+        dropped++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Store again a message read from the log, with the identifier it had. The sender does not need to be
+ * connected, nor to exist any more; if it exists, its last message ID is brought up to msgId.
+ * @return 0 -> Success, 1 -> Destination user not found, 2 -> Error
+ */
+uint8_t restore_message(UserList *source_list, UserList *dest_list, char *sourceAlias, char *destAlias,
+                        unsigned int msgId, unsigned int id, char *message) {
+    UserEntry *dest_user = search(dest_list, destAlias);
+    if (dest_user == NULL) {
+        return 1;
     }
+    dest_user->storedId = id;
 
-    return 1;
+    UserEntry *source_user = search(source_list, sourceAlias);
+    if (source_user != NULL) {
+        if (msgId > source_user->messageId) {
+            source_user->messageId = msgId;
+        }
+        return enqueue_message(dest_user->pendingMessages, source_user->alias, msgId, id, message) == 0 ? 0 : 2;
+    }
+
+    Alias *source = create_alias(sourceAlias);
+    if (source == NULL) {
+        return 2;
+    }
+    uint8_t error_code = enqueue_message(dest_user->pendingMessages, source, msgId, id, message);
+    alias_unref(source);
+    return error_code == 0 ? 0 : 2;
+}
+
+/**
+ * @brief Double the capacity of the ring of the list, keeping every message in its sequence position.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t grow_message_list(MessageList *list) {
+    unsigned int capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+    MessageEntry **ring = (MessageEntry **)calloc(capacity, sizeof(MessageEntry *));
+    if (ring == NULL) {
+        return 1;
+    }
+    for (unsigned int num = list->first; num != list->next; num++) {
+        ring[num & (capacity - 1)] = list->ring[num & (list->capacity - 1)];
+    }
+    free(list->ring);
+    list->ring = ring;
+    list->capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Reserve room for a message record of size bytes at the end of the arena of the list.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the record.
+ */
+MessageEntry *arena_reserve(MessageList *list, size_t size) {
+    ArenaChunk *chunk = list->chunk;
+
+    if (chunk == NULL || chunk->capacity - chunk->used < size) {
+        if (chunk != NULL && chunk->live == 0) {
+            chunk->used = 0;
+        }
+        if (chunk == NULL || chunk->capacity - chunk->used < size) {
+            // The first chunk of a list is small: most mailboxes only hold a few messages
+            ArenaChunk *new_chunk = chunk == NULL ? create_chunk(&small_chunk_pool, SMALL_CHUNK_SIZE)
+                                                  : create_chunk(&large_chunk_pool, LARGE_CHUNK_SIZE);
+            if (new_chunk == NULL) {
+                return NULL;
+            }
+            if (chunk != NULL && chunk->live == 0) {
+                free_chunk(chunk);
+            }
+            list->chunk = chunk = new_chunk;
+        }
+    }
+
+    MessageEntry *record = (MessageEntry *)(chunk->data + chunk->used);
+    record->offset = chunk->used;
+    chunk->used += size;
+    chunk->live++;
+    return record;
 }
 
 /**
  * @brief Create a new message in the list with the given parameters.
- * 1. Search for the destination user in the list. If it does not exist, return NULL.
- * 2. Create a new message entry with the given parameters.
- * 3. Add the message entry to the list of pending messages of the destination user.
- * @return 0 -> Success, 1 -> Destination user not found, 2 -> Error
+ * 1. Create a new message record with the given parameters and the next identifier of the destination user in the
+ *    arena of the list.
+ * 2. Append the message entry to the list of pending messages of the destination user, with the next sequence number.
+ * @return 0 -> Success, 1 -> Error
  */
-uint8_t add_pending_message(UserEntry *dest_user, char *sourceAlias, unsigned int msgId, char *message) {
-    MessageEntry *new_message = (MessageEntry *)malloc(sizeof(MessageEntry));
-    if (new_message == NULL) {
+uint8_t add_pending_message(UserEntry *dest_user, Alias *source, unsigned int msgId, char *message) {
+    if (enqueue_message(dest_user->pendingMessages, source, msgId, dest_user->storedId + 1, message) != 0) {
         return 1;
     }
+    dest_user->storedId++;
+    return 0;
+}
 
-    new_message->num = dest_user->pendingMessages->size;
-    new_message->msgId = msgId;
-    strncpy(new_message->sourceAlias, sourceAlias, 255);
-    new_message->sourceAlias[255] = '\0';
-    strncpy(new_message->message, message, 255);
-    new_message->message[255] = '\0';
-    new_message->next = NULL;
-
-    if (dest_user->pendingMessages->head == NULL) {
-        dest_user->pendingMessages->head = new_message;
+/**
+ * @brief Append a message to a list of pending messages: to its spill file if the list already has spilled messages
+ * or does not fit in memory any more (see spill_needed()), to memory otherwise.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t enqueue_message(MessageList *messages, Alias *source, unsigned int msgId, unsigned int id, char *message) {
+    size_t length = strnlen(message, 255);
+
+    // The spilled messages are newer than the ones in memory: once a list spills, every new message follows them
+    // If there is no room on disk, the message is kept in memory rather than lost
+    uint8_t error_code;
+    if (messages->spill == NULL &&
+        (!spill_needed((unsigned int)messages->size) || (messages->spill = spill_create()) == NULL)) {
+        error_code = append_message(messages, source, msgId, id, message);
     } else {
-        MessageEntry *current = dest_user->pendingMessages->head;
-        while (current->next != NULL) {
-            current = current->next;
+        error_code = spill_append(messages->spill, source->str, msgId, id, message, length);
+    }
+
+    if (error_code == 0) {
+        messages->bytes += length;
+        quota_track(1, (int64_t)length);
+    }
+    return error_code;
+}
+
+// Messages read back from a spill file and the alias of the sender of the last one
+typedef struct
+{
+    MessageList *list;              // List where the messages are appended
+    Alias *source;                  // Alias of the sender of the previous message (NULL if none)
+    uint8_t error;                  // 1 -> A message could not be appended
+} RefillContext;
+
+/**
+ * @brief Append a message read back from a spill file to the memory of its list.
+ * Consecutive messages usually come from the same sender, so they share its alias.
+ */
+void refill_message(void *context, const char *source, unsigned int msgId, unsigned int id, const char *message) {
+    RefillContext *refill = (RefillContext *)context;
+    if (refill->source == NULL || strcmp(refill->source->str, source) != 0) {
+        if (refill->source != NULL) {
+            alias_unref(refill->source);
         }
-        current->next = new_message;
+        refill->source = create_alias(source);
     }
+    if (refill->source == NULL || append_message(refill->list, refill->source, msgId, id, (char *)message) != 0) {
+        refill->error = 1;
+    }
+}
+
+/**
+ * @brief Move the oldest spilled messages of a list back to memory if its ring is empty.
+ * @return 0 -> Success, 1 -> Error (the spill file cannot be read)
+ */
+uint8_t refill_messages(MessageList *list) {
+    if (list->size > 0 || list->spill == NULL) {
+        return 0;
+    }
+    RefillContext refill = {list, NULL, 0};
+    uint64_t head = list->spill->head;
+    int count = spill_read(list->spill, &head, SPILL_REFILL_MESSAGES, refill_message, &refill);
+    if (refill.source != NULL) {
+        alias_unref(refill.source);
+    }
+    if (count <= 0) {
+        return 1;
+    }
+    spill_consume(list->spill, head, (unsigned int)count);
+
+    // An empty spill file is closed: the disk is only used while a mailbox overflows
+    if (list->spill->count == 0) {
+        spill_destroy(list->spill);
+        list->spill = NULL;
+    }
+    return refill.error;
+}
+
+/**
+ * @brief Get the messages and bytes waiting for a user: its mailbox and the lists being delivered to it.
+ */
+void mailbox_usage(UserEntry *user, unsigned int *messages, uint64_t *bytes) {
+    *messages = pending_message_count(user->pendingMessages);
+    *bytes = user->pendingMessages->bytes;
+    for (MessageList *inflight = user->inflight; inflight != NULL; inflight = inflight->next_inflight) {
+        *messages += pending_message_count(inflight);
+        *bytes += inflight->bytes;
+    }
+}
+
+/**
+ * @brief Get the number of pending messages of a list, in memory and spilled.
+ */
+unsigned int pending_message_count(MessageList *list) {
+    return (unsigned int)list->size + (list->spill != NULL ? list->spill->count : 0);
+}
 
-    dest_user->pendingMessages->size++;
+/**
+ * @brief Append a message to a list of pending messages, with the next sequence number.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t append_message(MessageList *messages, Alias *source, unsigned int msgId, unsigned int id, char *message) {
+    if (messages->next - messages->first == messages->capacity && grow_message_list(messages)) {
+        return 1;
+    }
+
+    size_t length = strnlen(message, 255);
+    size_t size = message_record_size(length);
+    MessageEntry *new_message = arena_reserve(messages, size);
+    if (new_message == NULL) {
+        return 1;
+    }
+    spill_track_memory((int64_t)size);
+
+    new_message->num = messages->next++;
+    new_message->msgId = msgId;
+    new_message->id = id;
+    new_message->source = source;
+    alias_ref(source);
+    new_message->length = length;
+    memcpy(new_message->message, message, length);
+    new_message->message[length] = '\0';
+
+    messages->ring[new_message->num & (messages->capacity - 1)] = new_message;
+    messages->size++;
     return 0;
 }
 
@@ -492,11 +1224,23 @@ void display_users(UserList *list) {
     UserEntry *current = list->head;
     while (current != NULL) {
         printf("👤 Alias: %s, 🌐 IP: %s, 🚪 Port: %s, 📛 Name: %s, 🎂 Birth: %s, 🔌 Status: %s\n",
-               current->alias, current->ip, current->port, current->name, current->birth,
+               current->alias->str, current->ip, current->port, current->name, current->birth,
                current->status ? "Connected" : "Disconnected");
         current = current->next;
     }
 }
+/**
+ * @brief Display the slabs in use by the users and the pending messages.
+ */
+void display_slab_stats() {
+    SlabPool *pools[] = {&user_pool, &message_list_pool, &small_chunk_pool, &large_chunk_pool};
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        SlabStats stats = slab_stats(pools[i]);
+        printf("🧱 Slab %s: %zu slabs (%zu KiB), %zu objects of %zu bytes in use, %zu free\n",
+               stats.name, stats.slabs, stats.bytes / 1024, stats.objects_in_use, stats.object_size, stats.objects_free);
+    }
+}
+
 /**
  * @brief Display the list of pending messages of the user with the given alias.
  * 1. Search for the user with the given alias in the list. If it does not exist, return 1;
@@ -510,10 +1254,12 @@ uint8_t display_pending_messages(UserList *list, char *alias) {
         return 1;
     }
 
-    MessageEntry *current = user->pendingMessages->head;
-    while (current != NULL) {
-        printf("✉️ Message %u from %s: %s\n", current->msgId, current->sourceAlias, current->message);
-        current = current->next;
+    MessageList *messages = user->pendingMessages;
+    for (unsigned int num = messages->first; num != messages->next; num++) {
+        MessageEntry *current = get_pending_message(messages, num);
+        if (current != NULL) {
+            printf("✉️ Message %u from %s: %s\n", current->msgId, current->source->str, current->message);
+        }
     }
     return 0;
 }
@@ -522,11 +1268,12 @@ uint8_t display_pending_messages(UserList *list, char *alias) {
  * @brief Create a new linked list of users.
  */
 UserList *create_user_list() {
-    UserList *list = (UserList *)malloc(sizeof(UserList));
+    UserList *list = (UserList *)calloc(1, sizeof(UserList));
     if (list == NULL) {
         return NULL;
     }
     list->head = NULL;
+    list->tail = NULL;
     list->size = 0;
     return list;
 }
@@ -535,12 +1282,20 @@ UserList *create_user_list() {
  * @brief Create a new linked list of pending messages.
  */
 MessageList *create_message_list() {
-    MessageList *list = (MessageList *)malloc(sizeof(MessageList));
+    MessageList *list = (MessageList *)slab_alloc(&message_list_pool);
     if (list == NULL) {
         return NULL;
     }
-    list->head = NULL;
+    // The ring is allocated with the first message
+    list->ring = NULL;
+    list->capacity = 0;
+    list->first = 0;
+    list->next = 0;
     list->size = 0;
+    list->chunk = NULL;
+    list->spill = NULL;
+    list->bytes = 0;
+    list->next_inflight = NULL;
     return list;
 }
 
@@ -8,46 +8,109 @@
 #include <assert.h>
 #include <stdint.h>
 
-// Structure for the pending messages
+#include "slab.h"
+#include "spill.h"
+#include "quota.h"
+
+// Alias of a user, shared (not copied) by its user entry and by the pending messages it has sent
+typedef struct
+{
+    int refs;                   // Number of references: the user entry and its pending messages (atomic)
+    uint16_t length;            // Length of the alias
+    char str[];                 // Alias: length characters + '\0'
+} Alias;
+
+// Structure for the pending messages: a variable-size record stored in the arena of the message list
 typedef struct MessageEntry
 {
-    unsigned int num;           // Message number in the list of pending messages
+    unsigned int num;           // Sequence number in the list of pending messages (increasing, never reused)
     unsigned int msgId;         // Message ID sent by the sending user
-    char sourceAlias[256];      // Alias of the sending user: 255 characters + '\0'
-    char message[256];         // Message: 255 characters + '\0'
-    struct MessageEntry *next;  // Pointer to the next message in the list
+    unsigned int id;            // Identifier in the mailbox of the receiver (kept by the log, spill and snapshots)
+    Alias *source;              // Alias of the sending user
+    uint16_t length;            // Length of the message
+    uint16_t offset;            // Offset of the record in its arena chunk
+    char message[];             // Message: length characters + '\0'
 } MessageEntry;
 
-// Implement a linked list of MessageEntry
+// Chunk of the arena where the messages of a list are stored one after another
+// A chunk is freed when none of its messages is pending any more.
 typedef struct
 {
-    MessageEntry *head;        // Pointer to the first message in the list
+    uint32_t capacity;          // Bytes of data
+    uint32_t used;              // Bytes of data holding messages
+    uint32_t live;              // Number of messages of the chunk that are still pending
+    _Alignas(8) char data[];    // Message records, aligned to 8 bytes
+} ArenaChunk;
+
+// FIFO of MessageEntry stored in a circular buffer indexed by sequence number
+// The message with sequence number num is at ring[num & (capacity - 1)] if first <= num < next,
+// so enqueue, pop-front and delete-by-sequence are O(1).
+// The messages that do not fit in memory follow the ones of the ring in a spill file (see spill.h); they get
+// their sequence number when they are read back. The ring is never empty while the spill file has messages.
+typedef struct MessageList
+{
+    MessageEntry **ring;       // Circular buffer of messages, NULL -> message deleted
+    unsigned int capacity;     // Number of slots of the ring (power of two, 0 if not allocated)
+    unsigned int first;        // Sequence number of the oldest pending message (next if empty)
+    unsigned int next;         // Sequence number of the next message
     int size;                  // Number of pending messages
+    ArenaChunk *chunk;         // Chunk where the next messages are appended (NULL if none)
+    SpillFile *spill;          // Messages after the ones of the ring (NULL if none)
+    uint64_t bytes;            // Bytes of the pending messages, in memory and spilled (see quota.h)
+    struct MessageList *next_inflight;  // Next list detached from the same user and being delivered
 } MessageList;
 
 typedef struct UserEntry
 {
     char ip[16];                    // IP address of the user "255.255.255.255" + '\0'
     char port[6];                   // Port of the user "65535" + '\0'
-    char name[256];                 // Name of the user: 255 characters + '\0'
-    char alias[256];                // Alias of the user: 255 characters + '\0' <- IDENTIFIER
+    char *name;                     // Name of the user: up to 255 characters + '\0'
+    Alias *alias;                   // Alias of the user: up to 255 characters + '\0' <- IDENTIFIER
     char birth[11];                 // Birth of the user: "DD/MM/AAAA" + '\0'
     unsigned int messageId;         // Last ID of the message sent by the user
+    unsigned int storedId;          // Identifier of the last message stored for the user
     uint8_t status;                 // Status of the user: 0 -> Disconnected, 1 -> Connected
+    uint64_t hash;                  // Hash of the alias, used by the index of the list
     MessageList *pendingMessages;   // List of pending messages
+    MessageList *inflight;          // Lists detached by a CONNECT and still being delivered, oldest first
+    struct UserEntry *prev;         // Pointer to the previous user in the list
     struct UserEntry *next;         // Pointer to the next user in the list
 } UserEntry;
 
+// Slot of the alias index: the hash is kept next to the pointer so probing does not touch the users
+typedef struct
+{
+    uint64_t hash;                  // Hash of the alias of the user
+    UserEntry *user;                // NULL -> Empty slot, INDEX_TOMBSTONE -> Deleted user
+} IndexSlot;
+
+// Open-addressing (linear probing) hash table of users indexed by alias
+typedef struct
+{
+    IndexSlot *slots;               // Slots of the table
+    size_t capacity;                // Number of slots (power of two, 0 if not allocated)
+    size_t used;                    // Number of slots that are not empty (users + tombstones)
+} AliasIndex;
+
+// Value of the slots of the index whose user has been deleted
+#define INDEX_TOMBSTONE ((UserEntry *)(uintptr_t)1)
+
 // Implement a linked list of UserEntry
 typedef struct
 {
     UserEntry *head;
+    UserEntry *tail;                // Pointer to the last user, so users are appended in O(1)
     int size;
+    AliasIndex index;               // Index where new users are inserted
+    AliasIndex old_index;           // Index being migrated to index after a resize (capacity 0 if none)
+    size_t migrate_pos;             // Next slot of old_index to migrate
 } UserList;
 
 typedef struct
 {
-    char* alias[256];               // Array of aliases of the connected users
+    char *aliases;                  // Aliases of the connected users one after another, each ending in '\0' (free() it)
+    size_t length;                  // Bytes of aliases in use
+    size_t capacity;                // Bytes allocated for aliases
     unsigned int size;              // Number of connected users
     uint8_t error_code;             // Error code: 0 -> Success, 1 -> User not connected, 2 -> User not found, 3 -> Error
 } ConnectedUsers;
@@ -57,13 +120,14 @@ typedef struct
     char ip[16];                    // IP address of the receiver
     char port[6];                   // Port of the receiver
     unsigned int msgId;             // Message ID sent by the sending user
+    unsigned int id;                // Identifier of the message in the mailbox of the receiver (if stored)
     uint8_t stored;                 // 0 -> Message not stored, 1 -> Message stored
-    uint8_t error_code;             // Error code: 0 -> Success, 1 -> User not found, 2 -> Error
+    uint8_t error_code;             // Error code: 0 -> Success, 1 -> User not found, 2 -> Error, 3 -> Mailbox full
 } ReceiverMessage;
 
 typedef struct
 {
-    MessageList *pendingMessages;   // List of pending messages
+    MessageList *pendingMessages;   // Detached list of pending messages, owned by the caller (NULL if none)
     uint8_t error_code;             // Error code: 0 -> Success, 1 -> User not found, 2 -> Error
 } ConnectionResult;
 
@@ -74,8 +138,36 @@ typedef struct
     uint8_t error_code;             // Error code: 0 -> Success (User connected), 1 -> User not found, 2 -> Error
 } ConnectionStatus;
 
+// Slab pools of the entries of the lists (see slab.h)
+extern SlabPool user_pool;              // UserEntry
+extern SlabPool message_list_pool;      // MessageList
+extern SlabPool small_chunk_pool;       // First ArenaChunk of a message list
+extern SlabPool large_chunk_pool;       // Following ArenaChunk of a message list
+
+/**
+ * @brief Create an alias with one reference.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the alias.
+ */
+Alias *create_alias(const char *alias);
+
+/**
+ * @brief Add a reference to an alias.
+ */
+void alias_ref(Alias *alias);
+
+/**
+ * @brief Drop a reference to an alias, freeing it when it was the last one.
+ */
+void alias_unref(Alias *alias);
+
+/**
+ * @brief Hash an alias (64-bit FNV-1a).
+ */
+uint64_t hash_alias(const char *alias);
+
 /**
  * @brief Search for a user with the given alias in the list.
+ * The lookup uses the alias index and does not modify the list, so it is safe for readers.
  * @return NULL if the alias does not exist in the list. Otherwise, return a pointer to the user entry.
  */
 UserEntry *search(UserList *list, char *alias);
@@ -105,7 +197,7 @@ uint8_t unregister_user(UserList *list, char *alias);
  * 1. Search for the user with the given alias in the list. If does not exist, return 1.
  * 2. If the user is already connected, return 2.
  * 3. If the user is not connected and exists, set the status to 1 (connected).
- * 4. Otherwise, return 3.
+ * 4. Detach the pending messages: the user gets an empty list and the caller delivers the detached one.
  * @return a struct ConnectionResult with error code 0 -> Success, 1 -> User not found, 2 -> User already connected, 3 -> Error
  */
 ConnectionResult connect_user(UserList *list, char *ip, char *port, char *alias);
@@ -129,24 +221,26 @@ uint8_t disconnect_user(UserList *list, char* ip,  char *alias);
  */
 ConnectedUsers connected_users(UserList *list, char *alias);
 
+/**
+ * @brief Append an alias to the aliases of result, growing the buffer if needed.
+ * @return 0 -> Success, 1 -> Error (no memory)
+ */
+uint8_t append_connected_user(ConnectedUsers *result, const char *alias);
+
 /**
  * @brief Send a message from a user to another user.
+ * The source and destination users may be in different lists (shards), or both lists may be the same.
  * 1. Validate the message length.
  * 2. Search for the source user in the list. If it does not exist, return 2.
  * 3. If the source user is not connected, return 3.
  * 4. Search for the destination user in the list. If it does not exist, return 1.
  * 5. Obtain the last message ID of the source user and increment it by 1 (taking into account the wrap-around to 0).
  * 6.a. If the destination user is connected, send the message to the destination user.
- * 6.b. If the destination user is not connected, store the message in the pending messages list of the destination user and local variable <stored> to 1.
- * @return a ReceiverMessage struct with error_code 0 -> Success, 1 -> Destination user not found, 2 -> Error
- */
-ReceiverMessage send_message(UserList *list, char *sourceAlias, char *destAlias, char *message);
-
-/**
- * @brief Create a socket and connect it to the client.
- * 
+ * 6.b. If the destination user is not connected, store the message in the pending messages list of the destination user and local variable <stored> to 1,
+ *      unless its mailbox is full (see quota.h): then return 3 and the message ID is not used.
+ * @return a ReceiverMessage struct with error_code 0 -> Success, 1 -> Destination user not found, 2 -> Error, 3 -> Mailbox full
  */
-int create_and_connect_socket();
+ReceiverMessage send_message(UserList *source_list, UserList *dest_list, char *sourceAlias, char *destAlias, char *message);
 
 /**
  * @brief Initialise service and destroys all stored users and pending messages of those users.
@@ -167,10 +261,10 @@ uint8_t delete_user_entry(UserEntry* user);
 uint8_t delete_user_list(UserList *list);
 
 /**
- * @brief Delete a message entry.
+ * @brief Delete a message entry of the list, once it has been removed from the ring.
  * @return 0 -> Success, 1 -> Error
  */
-uint8_t delete_message_entry(MessageEntry* message);
+uint8_t delete_message_entry(MessageList *list, MessageEntry* message);
 
 /**
  * @brief Delete all pending messages of the user with the given alias.
@@ -187,17 +281,124 @@ void delete_pending_message_list(MessageList *list);
 
 /**
  * @brief Delete message from user's pending messages list.
+ * @return 0 -> Success, 1 -> User or message not found
  */
 uint8_t delete_message(UserList *list, char *alias, unsigned int num);
 
 /**
- * @brief Create a new message in the list with the given parameters.
- * 1. Search for the destination user in the list. If it does not exist, return NULL.
- * 2. Create a new message entry with the given parameters.
- * 3. Add the message entry to the list of pending messages of the destination user.
+ * @brief Make room in the index of the list for users users, so adding them does not resize it.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t reserve_users(UserList *list, size_t users);
+
+/**
+ * @brief Add a user read from a snapshot, whose fields were validated when it registered.
+ * @return NULL if the user already exists or there is no memory. Otherwise, return a pointer to the user entry.
+ */
+UserEntry *restore_user(UserList *list, const char *ip, const char *port, const char *name, const char *alias,
+                        const char *birth, unsigned int messageId);
+
+/**
+ * @brief Delete the pending messages of a user with the identifiers first .. first + count - 1 (they were
+ * delivered, see the log). The messages still spilled to disk are not looked for.
+ * @return 0 -> Success, 1 -> User not found
+ */
+uint8_t drop_delivered_messages(UserList *list, char *alias, unsigned int first, unsigned int count);
+
+/**
+ * @brief Store again a message read from the log, with the identifier it had. The sender does not need to be
+ * connected, nor to exist any more; if it exists, its last message ID is brought up to msgId.
  * @return 0 -> Success, 1 -> Destination user not found, 2 -> Error
  */
-uint8_t add_pending_message(UserEntry *dest_user, char *sourceAlias, unsigned int msgId, char *message);
+uint8_t restore_message(UserList *source_list, UserList *dest_list, char *sourceAlias, char *destAlias,
+                        unsigned int msgId, unsigned int id, char *message);
+
+/**
+ * @brief Delete the messages of a list and free the list.
+ */
+void destroy_message_list(MessageList *list);
+
+/**
+ * @brief Detach the pending messages of a user, replacing them with an empty list.
+ * The detached list is still linked to the user (inflight), for the snapshots, until finish_inflight().
+ * @return NULL if the user has no pending messages (or there is no memory). Otherwise, the detached list.
+ */
+MessageList *detach_messages(UserEntry *user);
+
+/**
+ * @brief Forget a list detached from a user (see detach_messages()) once it has been delivered or given back.
+ */
+void finish_inflight(UserEntry *user, MessageList *detached);
+
+/**
+ * @brief Forget a list detached from the user with the given alias, if the user still exists.
+ */
+void finish_delivery(UserList *list, char *alias, MessageList *detached);
+
+/**
+ * @brief Detach the pending messages of a connected user, to deliver them without holding the lock of the list.
+ * @return NULL if the user does not exist, is not connected or has no pending messages. Otherwise, the detached list.
+ */
+MessageList *detach_pending_messages(UserList *list, char *alias);
+
+/**
+ * @brief Give back to a user the messages of a detached list (see connect_user()) that could not be delivered.
+ * They go before the messages received since the list was detached. The detached list is consumed: it becomes
+ * the list of the user, or it is freed.
+ * @return 0 -> Success, 1 -> User not found (the messages are dropped), 2 -> Error
+ */
+uint8_t reattach_pending_messages(UserList *list, char *alias, MessageList *detached);
+
+/**
+ * @brief Get the number of pending messages of a list, in memory and spilled.
+ */
+unsigned int pending_message_count(MessageList *list);
+
+/**
+ * @brief Get the messages and bytes waiting for a user: its mailbox and the lists being delivered to it.
+ */
+void mailbox_usage(UserEntry *user, unsigned int *messages, uint64_t *bytes);
+
+/**
+ * @brief Move the oldest spilled messages of a list back to memory if its ring is empty.
+ * @return 0 -> Success, 1 -> Error (the spill file cannot be read)
+ */
+uint8_t refill_messages(MessageList *list);
+
+/**
+ * @brief Get the pending message with the given sequence number.
+ * Only the messages in memory have a sequence number.
+ * @return NULL if the message is not in the list. Otherwise, return a pointer to the message entry.
+ */
+MessageEntry *get_pending_message(MessageList *list, unsigned int num);
+
+/**
+ * @brief Remove the oldest message of the list. The entry is valid until it is deleted with delete_message_entry().
+ * When the ring becomes empty, the next spilled messages are read back.
+ * @return NULL if the list is empty. Otherwise, return a pointer to the message entry.
+ */
+MessageEntry *pop_pending_message(MessageList *list);
+
+/**
+ * @brief Create a new message in the list with the given parameters.
+ * 1. Create a new message entry with the given parameters and the next identifier of the destination user.
+ * 2. Append the message entry to the list of pending messages of the destination user, with the next sequence number.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t add_pending_message(UserEntry *dest_user, Alias *source, unsigned int msgId, char *message);
+
+/**
+ * @brief Append a message to a list of pending messages: to its spill file if the list already has spilled messages
+ * or does not fit in memory any more (see spill_needed()), to memory otherwise.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t enqueue_message(MessageList *messages, Alias *source, unsigned int msgId, unsigned int id, char *message);
+
+/**
+ * @brief Append a message to the memory of a list of pending messages, with the next sequence number.
+ * @return 0 -> Success, 1 -> Error
+ */
+uint8_t append_message(MessageList *messages, Alias *source, unsigned int msgId, unsigned int id, char *message);
 
 /*
  * @brief Get connection status of the user with the given alias.
@@ -209,6 +410,11 @@ ConnectionStatus get_connection_status(UserList *list, char *alias);
  */
 void display_users(UserList *list);
 
+/**
+ * @brief Display the slabs in use by the users and the pending messages.
+ */
+void display_slab_stats();
+
 /**
  * @brief Display the list of pending messages of the user with the given alias.
  * 1. Search for the user with the given alias in the list. If it does not exist, return 1;
@@ -0,0 +1,201 @@
+/*
+ * File: ack.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ack.h"
+#include "lines.h"
+#include "delivery.h"
+#include "logger.h"
+#include "util.h"
+
+AckBatch *ack_buckets[ACK_BUCKETS];                         // Batches being filled, by sender
+AckBatch *oldest_batch = NULL;                              // Batches in order of deadline
+AckBatch *newest_batch = NULL;
+
+pthread_mutex_t ack_mutex = PTHREAD_MUTEX_INITIALIZER;      // Mutex protecting the batches
+pthread_cond_t ack_cond;                                    // Signaled when the first batch is created
+pthread_t ack_thread;
+int ack_stopping = 0;                                       // 1 -> The flusher sends every batch and exits
+
+/**
+ * @brief Get the bucket of a sender (by the IP and port of its listener).
+ */
+AckBatch **ack_bucket(const char *ip, const char *port) {
+    return &ack_buckets[listener_hash(ip, port) & (ACK_BUCKETS - 1)];
+}
+
+/**
+ * @brief Remove a batch from the table and from the deadline list. The mutex must be locked.
+ */
+void detach_batch(AckBatch *batch) {
+    AckBatch **link = ack_bucket(batch->ip, batch->port);
+    while (*link != batch) {
+        link = &(*link)->next;
+    }
+    *link = batch->next;
+
+    if (batch->older != NULL) {
+        batch->older->newer = batch->newer;
+    } else {
+        oldest_batch = batch->newer;
+    }
+    if (batch->newer != NULL) {
+        batch->newer->older = batch->older;
+    } else {
+        newest_batch = batch->older;
+    }
+}
+
+/**
+ * @brief Queue the frame of a detached batch for delivery and free the batch.
+ */
+void send_batch(AckBatch *batch) {
+    LineWriter frame;
+    writer_init(&frame, -1);
+    char msgId[11];
+
+    if (batch->count == 1) {
+        // Plain frame: also understood by the clients that do not know the batches
+        writer_append_string(&frame, "SEND_MESS_ACK");
+    } else {
+        writer_append_string(&frame, "SEND_MESS_ACK_BATCH");
+        sprintf(msgId, "%u", batch->count);
+        writer_append_string(&frame, msgId);
+    }
+    for (unsigned int i = 0; i < batch->count; i++) {
+        sprintf(msgId, "%u", batch->ids[i]);
+        writer_append_string(&frame, msgId);
+    }
+
+    if (delivery_enqueue_data(batch->ip, batch->port, frame.data, frame.len) != 0) {
+        logger_write(LOG_WARN, "s> Error queueing %u ACKs for %s:%s\n", batch->count, batch->ip, batch->port);
+    }
+    writer_destroy(&frame);
+    free(batch);
+}
+
+/**
+ * @brief Thread that sends the batches whose delay has expired, and every batch once ack_stop() is called
+ * @return NULL
+ */
+void *ack_flusher(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&ack_mutex);
+    for (;;) {
+        if (oldest_batch == NULL) {
+            if (ack_stopping) {
+                break;
+            }
+            pthread_cond_wait(&ack_cond, &ack_mutex);
+            continue;
+        }
+
+        uint64_t now = now_ns();
+        if (oldest_batch->deadline_ns > now && !ack_stopping) {
+            struct timespec deadline;
+            deadline.tv_sec = oldest_batch->deadline_ns / 1000000000ULL;
+            deadline.tv_nsec = oldest_batch->deadline_ns % 1000000000ULL;
+            pthread_cond_timedwait(&ack_cond, &ack_mutex, &deadline);
+            continue;
+        }
+
+        AckBatch *batch = oldest_batch;
+        detach_batch(batch);
+        pthread_mutex_unlock(&ack_mutex);
+        send_batch(batch);
+        pthread_mutex_lock(&ack_mutex);
+    }
+    pthread_mutex_unlock(&ack_mutex);
+    return NULL;
+}
+
+/**
+ * @brief Start the thread that sends the batches whose delay has expired.
+ * @return 0 -> Success, -1 -> Error
+ */
+int ack_start() {
+    // The deadlines are monotonic times
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ack_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&ack_thread, NULL, ack_flusher, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send every batch without waiting for its delay and stop the thread. No ACK may be added from now on.
+ */
+void ack_stop() {
+    pthread_mutex_lock(&ack_mutex);
+    ack_stopping = 1;
+    pthread_cond_signal(&ack_cond);
+    pthread_mutex_unlock(&ack_mutex);
+    pthread_join(ack_thread, NULL);
+}
+
+/**
+ * @brief Queue the ACK of a message for the listener of its sender. The ACK is sent when the batch of the sender
+ * is full or after ACK_FLUSH_DELAY_MS.
+ * @return 0 -> Success, -1 -> Error (no memory)
+ */
+int ack_add(const char *ip, const char *port, unsigned int msgId) {
+    AckBatch **bucket = ack_bucket(ip, port);
+
+    pthread_mutex_lock(&ack_mutex);
+    AckBatch *batch = *bucket;
+    while (batch != NULL && (strcmp(batch->ip, ip) != 0 || strcmp(batch->port, port) != 0)) {
+        batch = batch->next;
+    }
+
+    if (batch == NULL) {
+        batch = (AckBatch *)malloc(sizeof(AckBatch));
+        if (batch == NULL) {
+            pthread_mutex_unlock(&ack_mutex);
+            return -1;
+        }
+        strncpy(batch->ip, ip, sizeof(batch->ip) - 1);
+        batch->ip[sizeof(batch->ip) - 1] = '\0';
+        strncpy(batch->port, port, sizeof(batch->port) - 1);
+        batch->port[sizeof(batch->port) - 1] = '\0';
+        batch->count = 0;
+        batch->deadline_ns = now_ns() + ACK_FLUSH_DELAY_MS * 1000000ULL;
+
+        batch->next = *bucket;
+        *bucket = batch;
+        // Every batch has the same delay, so the newest batch has the latest deadline
+        batch->newer = NULL;
+        batch->older = newest_batch;
+        if (newest_batch != NULL) {
+            newest_batch->newer = batch;
+        } else {
+            oldest_batch = batch;
+            pthread_cond_signal(&ack_cond);
+        }
+        newest_batch = batch;
+    }
+
+    batch->ids[batch->count++] = msgId;
+    if (batch->count < ACK_BATCH_MAX) {
+        pthread_mutex_unlock(&ack_mutex);
+        return 0;
+    }
+
+    // * The batch is full: send it now
+    detach_batch(batch);
+    pthread_mutex_unlock(&ack_mutex);
+    send_batch(batch);
+    return 0;
+}
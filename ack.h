@@ -0,0 +1,47 @@
+/*
+ * File: ack.h
+ * Authors: 100451339 & 100451170
+ */
+
+#ifndef ACK_H
+#define ACK_H
+
+#include <stdint.h>
+
+#define ACK_BATCH_MAX 256           // msgIds after which the ACKs for a sender are sent at once
+#define ACK_FLUSH_DELAY_MS 5        // Time the first ACK for a sender may wait for more ACKs
+#define ACK_BUCKETS 256             // Buckets of the table of senders (power of two)
+
+// ACKs waiting to be sent to the listener of a sender, as one SEND_MESS_ACK_BATCH frame:
+// "SEND_MESS_ACK_BATCH" <count> <msgId> ... (a single ACK is sent as a plain SEND_MESS_ACK frame)
+typedef struct AckBatch
+{
+    char ip[16];                        // IP address of the listener of the sender
+    char port[6];                       // Port of the listener of the sender
+    uint64_t deadline_ns;               // Monotonic time when the batch must be sent
+    unsigned int count;                 // Number of msgIds
+    unsigned int ids[ACK_BATCH_MAX];    // msgIds to acknowledge, in order
+    struct AckBatch *next;              // Next batch of the bucket
+    struct AckBatch *older;             // Previous batch in order of deadline
+    struct AckBatch *newer;             // Next batch in order of deadline
+} AckBatch;
+
+/**
+ * @brief Start the thread that sends the batches whose delay has expired.
+ * @return 0 -> Success, -1 -> Error
+ */
+int ack_start();
+
+/**
+ * @brief Send every batch without waiting for its delay and stop the thread. No ACK may be added from now on.
+ */
+void ack_stop();
+
+/**
+ * @brief Queue the ACK of a message for the listener of its sender. The ACK is sent when the batch of the sender
+ * is full or after ACK_FLUSH_DELAY_MS.
+ * @return 0 -> Success, -1 -> Error (no memory)
+ */
+int ack_add(const char *ip, const char *port, unsigned int msgId);
+
+#endif
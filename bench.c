@@ -0,0 +1,635 @@
+/*
+ * File: bench.c
+ * Authors: 100451339 & 100451170
+ *
+ * Load generator of the server. It registers and connects users, each one with a real listening socket that
+ * receives its messages, and then several threads send a mix of SEND and CONNECTEDUSERS requests over their own
+ * sessions at a target rate. At the end it prints the throughput and the latency percentiles of each operation.
+ *
+ * The requests of a thread are scheduled at fixed intervals, and a latency is measured from the time its request
+ * was due rather than from the time it was sent, so a server that falls behind is not hidden by the load
+ * generator waiting for it (without -r, each thread sends its next request as soon as it gets the reply).
+ *
+ * Usage: ./bench -p <port> [-h <host>] [-u <users>] [-c <threads>] [-r <requests/s>] [-d <seconds>]
+ *                [-x <percentage of SEND>] [-b <message bytes>] [-P text|v2]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "request.h"  /* For the operations and the protocols */
+#include "lines.h"    /* For the buffered reader and writer of the sessions */
+#include "stats.h"    /* For the latency histograms */
+#include "util.h"     /* For the monotonic clock */
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_USERS 100           // Users registered and connected when -u is not given
+#define DEFAULT_THREADS 4           // Sending threads when -c is not given
+#define DEFAULT_SECONDS 10          // Duration of the measurement when -d is not given
+#define DEFAULT_SEND_PERCENT 90     // Percentage of SEND requests (the rest are CONNECTEDUSERS) when -x is not given
+#define DEFAULT_MESSAGE_SIZE 32     // Bytes of each message when -b is not given
+#define MAX_THREADS 1024
+#define MAX_MESSAGE_SIZE 255
+#define MAX_EVENTS 64
+#define DRAIN_SECONDS 1             // Time the listeners keep receiving after the last request
+#define LISTENER_FIELD_SIZE 16      // Bytes of a field kept to recognise the SEND_MESSAGE frames
+
+// Options of the benchmark
+typedef struct
+{
+    const char *host;               // Address of the server
+    int port;                       // Port of the server
+    int users;                      // Users registered and connected
+    int threads;                    // Sending threads, each one with its own session
+    double rate;                    // Requests per second over all the threads, 0 -> As fast as possible
+    int seconds;                    // Duration of the measurement
+    int send_percent;               // Percentage of SEND requests
+    int message_size;               // Bytes of each message
+    int protocol;                   // PROTOCOL_TEXT or PROTOCOL_V2
+} BenchConfig;
+
+// Session with the server
+typedef struct
+{
+    int sd;                         // Socket descriptor, -1 -> Not connected
+    LineReader reader;              // Replies received
+    LineWriter writer;              // Request being built
+    uint32_t request_id;            // Request id of the next request (v2)
+} BenchSession;
+
+// Socket of a listener: a listening socket or a connection accepted from the server
+typedef struct
+{
+    int fd;                         // Socket descriptor
+    int listening;                  // 1 -> Listening socket, 0 -> Connection from the server
+    size_t field_length;            // Bytes of the current field kept in field (at most LISTENER_FIELD_SIZE)
+    char field[LISTENER_FIELD_SIZE];
+} ListenerSocket;
+
+BenchConfig config = {DEFAULT_HOST, -1, DEFAULT_USERS, DEFAULT_THREADS, 0, DEFAULT_SECONDS, DEFAULT_SEND_PERCENT,
+                      DEFAULT_MESSAGE_SIZE, PROTOCOL_TEXT};
+struct sockaddr_in server_addr;     // Address of the server, resolved once
+char (*aliases)[16];                // Aliases of the users
+int *listener_ports;                // Listening port of each user
+volatile int listening = 1;         // 0 -> The listener thread must stop
+uint64_t delivered = 0;             // SEND_MESSAGE frames received by the listeners (listener thread only)
+uint64_t end_ns;                    // Time the sending threads stop
+int failed_threads = 0;             // Threads that lost their session (atomic)
+
+/**
+ * @brief Open a session with the server (the v2 magic byte is sent first with -P v2).
+ * @return 0 -> Success, -1 -> Error
+ */
+int session_open(BenchSession *session) {
+    session->sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (session->sd == -1) {
+        return -1;
+    }
+    if (connect(session->sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        close(session->sd);
+        session->sd = -1;
+        return -1;
+    }
+    int optval = 1;
+    setsockopt(session->sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    reader_init(&session->reader, session->sd);
+    writer_init(&session->writer, session->sd);
+    session->request_id = 1;
+    if (config.protocol == PROTOCOL_V2) {
+        char magic = (char)PROTOCOL_V2_MAGIC;
+        if (sendMessage(session->sd, &magic, 1) == -1) {
+            close(session->sd);
+            session->sd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Close a session with the server.
+ */
+void session_close(BenchSession *session) {
+    if (session->sd != -1) {
+        close(session->sd);
+        session->sd = -1;
+    }
+    writer_destroy(&session->writer);
+}
+
+/**
+ * @brief Get the next len bytes of the replies (len must fit in the reader), receiving them if needed.
+ * @return 0 -> Success, -1 -> The session was closed or failed
+ */
+int session_bytes(BenchSession *session, size_t len, char **bytes) {
+    while (!reader_next_bytes(&session->reader, len, bytes)) {
+        if (reader_fill(&session->reader) <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the next '\0' terminated field of the replies, receiving it if needed.
+ * @return 0 -> Success, -1 -> The session was closed or failed
+ */
+int session_field(BenchSession *session, char **field) {
+    size_t len;
+    while (!reader_next_field(&session->reader, field, &len)) {
+        if (reader_fill(&session->reader) <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Skip the next len bytes of the replies, which may not fit in the reader.
+ * @return 0 -> Success, -1 -> The session was closed or failed
+ */
+int session_skip(BenchSession *session, size_t len) {
+    while (len > 0) {
+        size_t available = session->reader.end - session->reader.cursor;
+        if (available == 0) {
+            reader_release(&session->reader);
+            if (reader_fill(&session->reader) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+        size_t skipped = available < len ? available : len;
+        session->reader.cursor += skipped;
+        len -= skipped;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send a request and wait for its reply.
+ * @return the error code of the reply, -1 -> The session was closed or failed
+ */
+int session_request(BenchSession *session, OPERATION operation, const char **fields, int count) {
+    LineWriter *writer = &session->writer;
+    if (config.protocol == PROTOCOL_V2) {
+        char header[V2_HEADER_SIZE] = {0};
+        writer_append(writer, header, sizeof(header));
+        for (int i = 0; i < count; i++) {
+            uint16_t length = htons((uint16_t)strlen(fields[i]));
+            writer_append(writer, &length, sizeof(length));
+            writer_append(writer, fields[i], strlen(fields[i]));
+        }
+        uint32_t request_id = htonl(session->request_id++);
+        uint32_t payload = htonl((uint32_t)(writer->len - V2_HEADER_SIZE));
+        writer->data[0] = (char)operation;
+        memcpy(writer->data + 1, &request_id, sizeof(request_id));
+        memcpy(writer->data + 5, &payload, sizeof(payload));
+    } else {
+        writer_append_string(writer, OPERATION_NAMES[operation]);
+        for (int i = 0; i < count; i++) {
+            writer_append_string(writer, fields[i]);
+        }
+    }
+    if (writer_flush(writer) == -1) {
+        return -1;
+    }
+
+    char *bytes;
+    int error_code;
+    if (config.protocol == PROTOCOL_V2) {
+        // * Only the error code of the payload is needed
+        if (session_bytes(session, V2_HEADER_SIZE, &bytes) == -1) {
+            return -1;
+        }
+        uint32_t payload;
+        memcpy(&payload, bytes + 5, sizeof(payload));
+        payload = ntohl(payload);
+        if (payload == 0 || session_bytes(session, 1, &bytes) == -1) {
+            return -1;
+        }
+        error_code = (uint8_t)bytes[0];
+        if (session_skip(session, payload - 1) == -1) {
+            return -1;
+        }
+    } else {
+        if (session_bytes(session, 1, &bytes) == -1) {
+            return -1;
+        }
+        error_code = (uint8_t)bytes[0];
+        char *field;
+        if (error_code == 0 && operation == SEND && session_field(session, &field) == -1) {
+            return -1;
+        }
+        if (error_code == 0 && operation == CONNECTEDUSERS) {
+            if (session_field(session, &field) == -1) {
+                return -1;
+            }
+            unsigned long users = strtoul(field, NULL, 10);
+            for (unsigned long i = 0; i < users; i++) {
+                reader_release(&session->reader);
+                if (session_field(session, &field) == -1) {
+                    return -1;
+                }
+            }
+        }
+    }
+    reader_release(&session->reader);
+    return error_code;
+}
+
+/**
+ * @brief Send a request, opening the session again once if the server closed it (e.g. servidor -t 0).
+ * @return the error code of the reply, -1 -> The session could not be used
+ */
+int bench_request(BenchSession *session, OPERATION operation, const char **fields, int count) {
+    int error_code = session->sd == -1 ? -1 : session_request(session, operation, fields, count);
+    if (error_code == -1) {
+        session_close(session);
+        if (session_open(session) == -1) {
+            return -1;
+        }
+        error_code = session_request(session, operation, fields, count);
+    }
+    return error_code;
+}
+
+/**
+ * @brief Count the SEND_MESSAGE frames among the bytes received from the server by a listener.
+ */
+void listener_scan(ListenerSocket *listener, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\0') {
+            if (listener->field_length < LISTENER_FIELD_SIZE) {
+                listener->field[listener->field_length] = data[i];
+            }
+            listener->field_length++;
+            continue;
+        }
+        if (listener->field_length == strlen("SEND_MESSAGE") &&
+            memcmp(listener->field, "SEND_MESSAGE", listener->field_length) == 0) {
+            delivered++;
+        }
+        listener->field_length = 0;
+    }
+}
+
+/**
+ * @brief Thread that accepts the connections of the server to the listeners and receives their messages
+ * @param arg epoll instance of the listening sockets
+ * @return NULL
+ */
+void *listener_thread(void *arg) {
+    int epfd = (int)(intptr_t)arg;
+    struct epoll_event events[MAX_EVENTS];
+    char buffer[65536];
+    while (listening) {
+        int ready = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < ready; i++) {
+            ListenerSocket *listener = (ListenerSocket *)events[i].data.ptr;
+            if (listener->listening) {
+                int fd = accept(listener->fd, NULL, NULL);
+                if (fd == -1) {
+                    continue;
+                }
+                ListenerSocket *connection = (ListenerSocket *)calloc(1, sizeof(ListenerSocket));
+                if (connection == NULL) {
+                    close(fd);
+                    continue;
+                }
+                connection->fd = fd;
+                struct epoll_event event = {0};
+                event.events = EPOLLIN;
+                event.data.ptr = connection;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+                continue;
+            }
+
+            ssize_t received = recv(listener->fd, buffer, sizeof(buffer), 0);
+            if (received > 0) {
+                listener_scan(listener, buffer, (size_t)received);
+            } else if (received == 0 || (errno != EINTR && errno != EAGAIN)) {
+                // The server closed its connection (or reset it): it opens a new one for the next message
+                epoll_ctl(epfd, EPOLL_CTL_DEL, listener->fd, NULL);
+                close(listener->fd);
+                free(listener);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Open a listening socket for every user and register them in the epoll instance.
+ * @return 0 -> Success, -1 -> Error
+ */
+int open_listeners(int epfd) {
+    for (int i = 0; i < config.users; i++) {
+        ListenerSocket *listener = (ListenerSocket *)calloc(1, sizeof(ListenerSocket));
+        if (listener == NULL) {
+            return -1;
+        }
+        listener->listening = 1;
+        listener->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        socklen_t addr_len = sizeof(addr);
+        if (listener->fd == -1 || bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(listener->fd, SOMAXCONN) == -1 ||
+            getsockname(listener->fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+            return -1;
+        }
+        listener_ports[i] = ntohs(addr.sin_port);
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = listener;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener->fd, &event) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Register and connect every user. A user that already exists is reused.
+ * @return 0 -> Success, -1 -> Error
+ */
+int setup_users() {
+    BenchSession session;
+    writer_init(&session.writer, -1);
+    if (session_open(&session) == -1) {
+        return -1;
+    }
+    char port[8];
+    for (int i = 0; i < config.users; i++) {
+        const char *registration[] = {aliases[i], aliases[i], "01/01/2000"};
+        int error_code = bench_request(&session, REGISTER, registration, 3);
+        if (error_code != 0 && error_code != 1) {
+            printf("Error registering %s (error code %d)\n", aliases[i], error_code);
+            session_close(&session);
+            return -1;
+        }
+        sprintf(port, "%d", listener_ports[i]);
+        const char *connection[] = {aliases[i], port};
+        error_code = bench_request(&session, CONNECT, connection, 2);
+        if (error_code != 0) {
+            printf("Error connecting %s (error code %d)\n", aliases[i], error_code);
+            session_close(&session);
+            return -1;
+        }
+    }
+    session_close(&session);
+    return 0;
+}
+
+/**
+ * @brief Disconnect and unregister every user, so the server is left as it was.
+ */
+void teardown_users() {
+    BenchSession session;
+    writer_init(&session.writer, -1);
+    if (session_open(&session) == -1) {
+        return;
+    }
+    for (int i = 0; i < config.users; i++) {
+        const char *fields[] = {aliases[i]};
+        bench_request(&session, DISCONNECT, fields, 1);
+        bench_request(&session, UNREGISTER, fields, 1);
+    }
+    session_close(&session);
+}
+
+/**
+ * @brief Thread that sends requests over its own session until end_ns, recording their latencies
+ * @param arg number of the thread
+ * @return NULL
+ */
+void *send_worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned int seed = 12345 + id;
+    char message[MAX_MESSAGE_SIZE + 1];
+    memset(message, 'x', config.message_size);
+    message[config.message_size] = '\0';
+
+    BenchSession session;
+    writer_init(&session.writer, -1);
+    if (session_open(&session) == -1) {
+        __atomic_fetch_add(&failed_threads, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    // * Every thread sends rate / threads requests per second, the threads shifted within an interval
+    uint64_t interval = config.rate > 0 ? (uint64_t)(config.threads * 1e9 / config.rate) : 0;
+    uint64_t due = now_ns() + interval * id / config.threads;
+    while (due < end_ns) {
+        if (interval > 0) {
+            struct timespec wakeup = {(time_t)(due / 1000000000ULL), (long)(due % 1000000000ULL)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR) {
+            }
+        } else {
+            due = now_ns();
+        }
+
+        seed = seed * 1103515245 + 12345;
+        int source = (int)((seed >> 8) % config.users);
+        seed = seed * 1103515245 + 12345;
+        int dest = (int)((seed >> 8) % config.users);
+        seed = seed * 1103515245 + 12345;
+        OPERATION operation = (int)((seed >> 8) % 100) < config.send_percent ? SEND : CONNECTEDUSERS;
+
+        int error_code;
+        if (operation == SEND) {
+            const char *fields[] = {aliases[source], aliases[dest], message};
+            error_code = bench_request(&session, SEND, fields, 3);
+        } else {
+            const char *fields[] = {aliases[source]};
+            error_code = bench_request(&session, CONNECTEDUSERS, fields, 1);
+        }
+        if (error_code == -1) {
+            __atomic_fetch_add(&failed_threads, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        stats_record(operation, (uint8_t)error_code, now_ns() - due);
+        due += interval;
+    }
+    session_close(&session);
+    return NULL;
+}
+
+/**
+ * @brief Print the requests, errors, throughput and latency percentiles of an operation.
+ */
+void print_operation(const char *name, const OperationStats *operation, double seconds) {
+    uint64_t errors = operation->count - operation->errors[0];
+    printf("%-16s %10lu %8lu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, (unsigned long)operation->count,
+           (unsigned long)errors, operation->count / seconds,
+           operation->count > 0 ? operation->latency_ns / 1000.0 / operation->count : 0.0,
+           stats_percentile(operation, 0.50) / 1000.0, stats_percentile(operation, 0.99) / 1000.0,
+           stats_percentile(operation, 0.999) / 1000.0, operation->max_ns / 1000.0);
+}
+
+/**
+ * @brief Get the options of the benchmark from the user
+ */
+void process_arguments(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:h:u:c:r:d:x:b:P:")) != -1) {
+        switch (opt) {
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'h':
+            config.host = optarg;
+            break;
+        case 'u':
+            config.users = atoi(optarg);
+            break;
+        case 'c':
+            config.threads = atoi(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'd':
+            config.seconds = atoi(optarg);
+            break;
+        case 'x':
+            config.send_percent = atoi(optarg);
+            break;
+        case 'b':
+            config.message_size = atoi(optarg);
+            break;
+        case 'P':
+            config.protocol = strcmp(optarg, "v2") == 0 ? PROTOCOL_V2 : strcmp(optarg, "text") == 0 ? PROTOCOL_TEXT : -1;
+            break;
+        default:
+            config.port = -1;
+            break;
+        }
+    }
+    if (config.port < 1 || config.port > 65535 || config.users < 1 || config.threads < 1 ||
+        config.threads > MAX_THREADS || config.rate < 0 || config.seconds < 1 || config.send_percent < 0 ||
+        config.send_percent > 100 || config.message_size < 1 || config.message_size > MAX_MESSAGE_SIZE ||
+        config.protocol == -1 || optind != argc) {
+        printf("Usage: %s -p <port> [-h <host>] [-u <users>] [-c <threads>] [-r <requests/s>] [-d <seconds>] "
+               "[-x <percentage of SEND>] [-b <message bytes>] [-P text|v2]\n", argv[0]);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    process_arguments(argc, argv);
+
+    struct hostent *host = gethostbyname(config.host);
+    if (host == NULL) {
+        printf("Unknown host: %s\n", config.host);
+        return 1;
+    }
+    server_addr.sin_family = AF_INET;
+    memcpy(&server_addr.sin_addr, host->h_addr_list[0], host->h_length);
+    server_addr.sin_port = htons(config.port);
+
+    // Every user has a listening socket, plus the connections the server opens to it
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    aliases = calloc(config.users, sizeof(*aliases));
+    listener_ports = calloc(config.users, sizeof(int));
+    if (aliases == NULL || listener_ports == NULL) {
+        printf("Error allocating %d users\n", config.users);
+        return 1;
+    }
+    for (int i = 0; i < config.users; i++) {
+        sprintf(aliases[i], "bench%d", i);
+    }
+
+    int epfd = epoll_create1(0);
+    pthread_t listener;
+    if (epfd == -1 || open_listeners(epfd) == -1) {
+        perror("Error opening the listening sockets");
+        return 1;
+    }
+    if (pthread_create(&listener, NULL, listener_thread, (void *)(intptr_t)epfd) != 0) {
+        perror("Error creating the listener thread");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    if (setup_users() == -1) {
+        printf("Error registering the users in %s:%d\n", config.host, config.port);
+        return 1;
+    }
+    printf("Registered and connected %d users in %.1f ms\n", config.users, (now_ns() - start) / 1e6);
+
+    pthread_t workers[MAX_THREADS];
+    start = now_ns();
+    end_ns = start + (uint64_t)config.seconds * 1000000000ULL;
+    for (int i = 0; i < config.threads; i++) {
+        if (pthread_create(&workers[i], NULL, send_worker, (void *)(intptr_t)i) != 0) {
+            perror("Error creating the sending threads");
+            return 1;
+        }
+    }
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    // Give the server time to deliver the last messages before counting them
+    sleep(DRAIN_SECONDS);
+    listening = 0;
+    pthread_join(listener, NULL);
+    teardown_users();
+
+    OperationStats merged[STATS_OPERATIONS];
+    stats_merge(merged);
+    OperationStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < STATS_OPERATIONS; i++) {
+        total.count += merged[i].count;
+        total.latency_ns += merged[i].latency_ns;
+        total.max_ns = merged[i].max_ns > total.max_ns ? merged[i].max_ns : total.max_ns;
+        for (int j = 0; j < STATS_ERROR_CODES; j++) {
+            total.errors[j] += merged[i].errors[j];
+        }
+        for (int j = 0; j < STATS_BUCKETS; j++) {
+            total.buckets[j] += merged[i].buckets[j];
+        }
+    }
+
+    printf("\n%d users, %d threads, %s protocol, %d%% SEND of %d bytes, ", config.users, config.threads,
+           config.protocol == PROTOCOL_V2 ? "v2" : "text", config.send_percent, config.message_size);
+    if (config.rate > 0) {
+        printf("target %.0f requests/s\n", config.rate);
+    } else {
+        printf("as fast as possible\n");
+    }
+    printf("%-16s %10s %8s %12s %9s %9s %9s %9s %9s\n", "operation", "requests", "errors", "requests/s", "avg_us",
+           "p50_us", "p99_us", "p999_us", "max_us");
+    print_operation("SEND", &merged[SEND], seconds);
+    print_operation("CONNECTEDUSERS", &merged[CONNECTEDUSERS], seconds);
+    print_operation("total", &total, seconds);
+    printf("\n%lu messages delivered to the listeners (%.0f/s)\n", (unsigned long)delivered, delivered / seconds);
+    if (failed_threads > 0) {
+        printf("%d threads lost their session with the server\n", failed_threads);
+        return 1;
+    }
+    return 0;
+}
@@ -4,6 +4,7 @@ import PySimpleGUI as sg
 from enum import Enum
 import argparse
 import socket
+import select
 import threading
 import zeep
 
@@ -26,6 +27,7 @@ class client :
     _date = None
     _listening_sock = None
     _listening_port = -1
+    _session_sock = None
     
     # Web service client attribute
     _web_host = "localhost:8000"
@@ -33,12 +35,32 @@ class client :
     # ******************** METHODS *******************
 
     # *
-    # * @return the socket to the server
+    # * @return the socket of the session with the server
+    # * The same connection is reused by every operation until the server closes it
     @staticmethod
     def create_socket_and_connect():
+        if client._session_sock is not None:
+            # A readable session socket with no pending reply means the server closed it (idle timeout)
+            readable, _, _ = select.select([client._session_sock], [], [], 0)
+            if not readable:
+                return client._session_sock
+            client.close_session()
+
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         sock.connect((client._server, client._port))
+        client._session_sock = sock
         return sock
+
+    # *
+    # * @brief Close the session with the server, the next operation opens a new one
+    @staticmethod
+    def close_session():
+        if client._session_sock is not None:
+            try:
+                client._session_sock.close()
+            except Exception as _:
+                pass
+            client._session_sock = None
     
     @staticmethod
     def readNumber(sock):
@@ -47,6 +69,9 @@ class client :
             msg = sock.recv(1)
             if (msg == b'\0'):
                 break;
+            if (msg == b''):
+                # The connection has been closed
+                raise ConnectionError("connection closed")
             a += msg.decode()
 
         return(int(a,10))
@@ -58,6 +83,9 @@ class client :
             msg = sock.recv(1)
             if (msg == b'\0'):
                 break;
+            if (msg == b''):
+                # The connection has been closed
+                raise ConnectionError("connection closed")
             a += msg.decode()
 
         return(a)
@@ -88,9 +116,6 @@ class client :
 
             # Receive the response from the server
             response = sock.recv(1)
-
-            # Close the socket
-            sock.close()
             
             if (response == b'\x00'):
                 window['_SERVER_'].print("s> REGISTER OK")
@@ -102,6 +127,7 @@ class client :
                 window['_SERVER_'].print("s> REGISTER FAIL")
                 return client.RC.ERROR
         except Exception as _:
+            client.close_session()
             window['_SERVER_'].print("s> REGISTER FAIL")
             return client.RC.ERROR
 
@@ -126,9 +152,6 @@ class client :
 
             # Receive the response from the server
             response = sock.recv(1)
-
-            # Close the socket
-            sock.close()
             
             if (response == b'\x00'):
                 window['_SERVER_'].print("s> UNREGISTER OK")
@@ -140,13 +163,14 @@ class client :
                 window['_SERVER_'].print("s> UNREGISTER FAIL")
                 return client.RC.ERROR
         except Exception as _:
+            client.close_session()
             window['_SERVER_'].print("s> UNREGISTER FAIL")
             return client.RC.ERROR
 
     @staticmethod
     def listen(sock, window):
         # Start listening for messages
-        sock.listen(1)
+        sock.listen(5)
 
         while True:
             try:
@@ -154,6 +178,21 @@ class client :
                 C_socket, C_address = sock.accept()
                 print(f"Connection from {C_address} has been established!")
 
+                # The server keeps its connections open to send several messages over each one
+                threading.Thread(target=client.receive, args=(C_socket, window), daemon=True).start()
+
+            except Exception as _:
+                sock.close()
+                return
+
+        # Close the listening socket
+        sock.close()
+
+    @staticmethod
+    def receive(C_socket, window):
+        # Read the messages and ACKs sent by the server until it closes the connection
+        try:
+            while True:
                 cadena = client.readString(C_socket)
                 print(f"Cadena: {cadena}")
                 if cadena == "SEND_MESSAGE":
@@ -165,16 +204,17 @@ class client :
                     messageId = client.readString(C_socket)
                     print(f"message id: {messageId}")
                     window['_SERVER_'].print(f"s> SEND MESSAGE {messageId} OK")
+                elif cadena == "SEND_MESS_ACK_BATCH":
+                    # Several ACKs at once: the number of messages and then their IDs
+                    count = int(client.readString(C_socket))
+                    for _ in range(count):
+                        messageId = client.readString(C_socket)
+                        window['_SERVER_'].print(f"s> SEND MESSAGE {messageId} OK")
+        except Exception as _:
+            pass
 
-                # Close the connection with the client
-                C_socket.close()
-
-            except Exception as _:
-                sock.close()
-                return
-
-        # Close the listening socket
-        sock.close()
+        # Close the connection with the server
+        C_socket.close()
 
     # *
     # * @param user - User name to connect to the system
@@ -194,6 +234,8 @@ class client :
                 client._listening_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
                 client._listening_sock.bind(('', 0))
                 client._listening_port = client._listening_sock.getsockname()[1]
+                # Listen before connecting, so the server can send the pending messages right away
+                client._listening_sock.listen(5)
 
             # Indicate the server that we want to register
             sock.sendall("CONNECT".encode())
@@ -216,24 +258,20 @@ class client :
                 listen_thread.daemon = True # Stop the thread when the main thread ends
                 listen_thread.start()
 
-                sock.close()
-
                 window['_SERVER_'].print("s> CONNECT OK")
 
                 return client.RC.OK
             elif (response == b'\x01'):
-                sock.close()
                 window['_SERVER_'].print("s> CONNECT FAIL / USER DOES NOT EXIST")
                 return client.RC.USER_ERROR
             elif (response == b'\x02'):
-                sock.close()
                 window['_SERVER_'].print("s> USER ALREADY CONNECTED")
                 return client.RC.USER_ERROR
             else:
-                sock.close()
                 window['_SERVER_'].print("s> CONNECT FAIL")
                 return client.RC.ERROR
         except Exception as _:
+            client.close_session()
             window['_SERVER_'].print("s> CONNECT FAIL")
             return client.RC.ERROR
 
@@ -259,9 +297,6 @@ class client :
 
             # Receive the response from the server
             response = sock.recv(1)
-
-            # Close the socket
-            sock.close()
             
             if (response == b'\x00'):
                 window['_SERVER_'].print("s> DISCONNECT OK")
@@ -281,6 +316,7 @@ class client :
                 return client.RC.ERROR
 
         except Exception as _:
+            client.close_session()
             window['_SERVER_'].print("s> DISCONNECT FAIL")
             return client.RC.ERROR
             
@@ -328,7 +364,6 @@ class client :
             if (response == b'\x00'):
                 # Read the message id
                 messageId = client.readString(sock)
-                sock.close()
 
                 window['_SERVER_'].print(f"s> SEND OK - MESSAGE {messageId}")
 
@@ -336,11 +371,15 @@ class client :
             elif (response == b'\x01'):
                 window['_SERVER_'].print("s> SEND FAIL / USER DOES NOT EXIST")
                 return client.RC.USER_ERROR
+            elif (response == b'\x03'):
+                window['_SERVER_'].print("s> SEND FAIL / MAILBOX FULL, TRY AGAIN LATER")
+                return client.RC.ERROR
             else:
                 window['_SERVER_'].print("s> SEND FAIL")
                 return client.RC.ERROR
 
         except Exception as _:
+            client.close_session()
             window['_SERVER_'].print("s> SEND FAIL")
             return client.RC.ERROR
 
@@ -380,21 +419,19 @@ class client :
                 # Read the number of connected users and then read as many aliases as connected users are (joining them by commas)
                 numConnUsers = client.readNumber(sock)
                 aliases = ', '.join([client.readString(sock) for _ in range(numConnUsers)])
-                sock.close()    
                 
                 window['_SERVER_'].print(f"s> CONNECTED USERS ({numConnUsers} users connected) OK - {aliases}")
                 return client.RC.OK
             elif (response == b'\x01'):
-                sock.close()
                 window['_SERVER_'].print("s> CONNECTED USERS FAIL / USER IS NOT CONNECTED")
                 return client.RC.USER_ERROR
             else:
-                sock.close()
                 window['_SERVER_'].print("s> CONNECTED USERS FAIL")
                 return client.RC.ERROR
             
     
         except Exception as _:
+            client.close_session()
             window['_SERVER_'].print("s> CONNECTED USERS FAIL")
             return client.RC.ERROR
 
@@ -0,0 +1,298 @@
+/*
+ * File: delivery.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "delivery.h"
+#include "outbound.h"
+#include "util.h"
+
+Recipient *recipients[DELIVERY_BUCKETS];                    // Recipients with queued or in-flight frames
+Recipient *ready_head = NULL;                               // Recipients with frames waiting for a worker
+Recipient *ready_tail = NULL;
+DeliveryStats stats;                                        // Written with the mutex locked, read atomically
+
+pthread_mutex_t delivery_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex protecting the queues
+pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;       // Signaled when a recipient becomes ready
+pthread_t *delivery_threads = NULL;                         // Delivery workers, joined by delivery_stop()
+int delivery_workers = 0;
+int delivery_stopping = 0;                                  // 1 -> The workers exit once the queues are empty
+
+/**
+ * @brief Get the bucket of a recipient (by its IP and port).
+ */
+Recipient **recipient_bucket(const char *ip, const char *port) {
+    return &recipients[listener_hash(ip, port) & (DELIVERY_BUCKETS - 1)];
+}
+
+/**
+ * @brief Find the queue of a recipient, creating it if needed. The mutex must be locked.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the recipient.
+ */
+Recipient *get_recipient(const char *ip, const char *port) {
+    Recipient **bucket = recipient_bucket(ip, port);
+    for (Recipient *current = *bucket; current != NULL; current = current->next) {
+        if (strcmp(current->ip, ip) == 0 && strcmp(current->port, port) == 0) {
+            return current;
+        }
+    }
+
+    Recipient *recipient = (Recipient *)calloc(1, sizeof(Recipient));
+    if (recipient == NULL) {
+        return NULL;
+    }
+    strncpy(recipient->ip, ip, sizeof(recipient->ip) - 1);
+    strncpy(recipient->port, port, sizeof(recipient->port) - 1);
+    recipient->next = *bucket;
+    *bucket = recipient;
+    __atomic_store_n(&stats.recipients, stats.recipients + 1, __ATOMIC_RELAXED);
+    return recipient;
+}
+
+/**
+ * @brief Remove a recipient without frames from the table and free it. The mutex must be locked.
+ */
+void remove_recipient(Recipient *recipient) {
+    Recipient **link = recipient_bucket(recipient->ip, recipient->port);
+    while (*link != recipient) {
+        link = &(*link)->next;
+    }
+    *link = recipient->next;
+    free(recipient);
+    __atomic_store_n(&stats.recipients, stats.recipients - 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Append a recipient to the ready list and wake up a worker. The mutex must be locked.
+ */
+void push_ready(Recipient *recipient) {
+    recipient->next_ready = NULL;
+    if (ready_tail == NULL) {
+        ready_head = recipient;
+    } else {
+        ready_tail->next_ready = recipient;
+    }
+    ready_tail = recipient;
+    pthread_cond_signal(&ready_cond);
+}
+
+/**
+ * @brief Delivery worker: take a ready recipient, send all its queued frames in order and repeat until
+ * delivery_stop() is called and nothing is left to deliver
+ * @return NULL
+ */
+void *delivery_worker(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&delivery_mutex);
+    for (;;) {
+        while (ready_head == NULL && !delivery_stopping) {
+            pthread_cond_wait(&ready_cond, &delivery_mutex);
+        }
+        // * The recipients being drained by the other workers are put back in the ready list by those workers
+        if (ready_head == NULL) {
+            break;
+        }
+        Recipient *recipient = ready_head;
+        ready_head = recipient->next_ready;
+        if (ready_head == NULL) {
+            ready_tail = NULL;
+        }
+        DeliveryJob *jobs = recipient->head;
+        recipient->head = NULL;
+        recipient->tail = NULL;
+        pthread_mutex_unlock(&delivery_mutex);
+
+        // * Deliver the frames without the mutex: only this worker drains the recipient. Once a frame fails (the
+        // listener is gone, or it does not read and the send timed out), the rest are dropped without trying them
+        size_t count = 0;
+        int failing = 0;
+        uint64_t delivered = 0, latency_ns = 0, max_latency_ns = 0;
+        while (jobs != NULL) {
+            DeliveryJob *next = jobs->next;
+            if (!failing && outbound_send(recipient->ip, recipient->port, jobs->data, jobs->len) == 0) {
+                uint64_t latency = now_ns() - jobs->enqueued_ns;
+                delivered++;
+                latency_ns += latency;
+                max_latency_ns = latency > max_latency_ns ? latency : max_latency_ns;
+            } else {
+                failing = 1;
+            }
+            count++;
+            free(jobs);
+            jobs = next;
+        }
+
+        pthread_mutex_lock(&delivery_mutex);
+        recipient->queued -= count;
+        __atomic_store_n(&stats.queued, stats.queued - count, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.delivered, stats.delivered + delivered, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.failed, stats.failed + count - delivered, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.latency_ns, stats.latency_ns + latency_ns, __ATOMIC_RELAXED);
+        if (max_latency_ns > stats.max_latency_ns) {
+            __atomic_store_n(&stats.max_latency_ns, max_latency_ns, __ATOMIC_RELAXED);
+        }
+
+        // * Frames queued while delivering: the recipient goes back to the end of the ready list
+        if (recipient->head != NULL) {
+            push_ready(recipient);
+        } else {
+            remove_recipient(recipient);
+        }
+    }
+    pthread_mutex_unlock(&delivery_mutex);
+    return NULL;
+}
+
+/**
+ * @brief Start the delivery workers.
+ * @return 0 -> Success, -1 -> Error
+ */
+int delivery_start(int workers) {
+    delivery_threads = (pthread_t *)malloc(workers * sizeof(pthread_t));
+    if (delivery_threads == NULL) {
+        return -1;
+    }
+    for (delivery_workers = 0; delivery_workers < workers; delivery_workers++) {
+        if (pthread_create(&delivery_threads[delivery_workers], NULL, delivery_worker, NULL) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Deliver every frame still queued and stop the delivery workers. Nothing may be queued from now on.
+ */
+void delivery_stop() {
+    pthread_mutex_lock(&delivery_mutex);
+    delivery_stopping = 1;
+    pthread_cond_broadcast(&ready_cond);
+    pthread_mutex_unlock(&delivery_mutex);
+
+    for (int i = 0; i < delivery_workers; i++) {
+        pthread_join(delivery_threads[i], NULL);
+    }
+    free(delivery_threads);
+    delivery_threads = NULL;
+    delivery_workers = 0;
+}
+
+/**
+ * @brief Append a job to the queue of its recipient, scheduling the recipient if no worker has it.
+ * @return 0 -> Success, -1 -> Error (no memory or the queue is full, the job is freed)
+ */
+int queue_job(const char *ip, const char *port, DeliveryJob *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&delivery_mutex);
+    Recipient *recipient = get_recipient(ip, port);
+    if (recipient == NULL) {
+        pthread_mutex_unlock(&delivery_mutex);
+        free(job);
+        return -1;
+    }
+    // Back-pressure: a listener that does not keep up gets its frames refused, without making the caller wait
+    // nor taking the room of the other listeners
+    if (recipient->queued >= DELIVERY_MAX_PER_RECIPIENT || stats.queued >= DELIVERY_MAX_QUEUED) {
+        __atomic_store_n(&stats.refused, stats.refused + 1, __ATOMIC_RELAXED);
+        if (recipient->queued == 0) {
+            remove_recipient(recipient);
+        }
+        pthread_mutex_unlock(&delivery_mutex);
+        free(job);
+        return -1;
+    }
+
+    job->enqueued_ns = now_ns();
+    if (recipient->tail == NULL) {
+        recipient->head = job;
+    } else {
+        recipient->tail->next = job;
+    }
+    recipient->tail = job;
+    recipient->queued++;
+    __atomic_store_n(&stats.queued, stats.queued + 1, __ATOMIC_RELAXED);
+    if (stats.queued > stats.max_queued) {
+        __atomic_store_n(&stats.max_queued, stats.queued, __ATOMIC_RELAXED);
+    }
+
+    if (!recipient->scheduled) {
+        recipient->scheduled = 1;
+        push_ready(recipient);
+    }
+    pthread_mutex_unlock(&delivery_mutex);
+    return 0;
+}
+
+/**
+ * @brief Queue a frame of '\0' terminated fields for the listener of a client and return without waiting for it
+ * to be delivered. It never waits: the frame is refused if DELIVERY_MAX_PER_RECIPIENT frames are already waiting
+ * for the listener or DELIVERY_MAX_QUEUED for all of them.
+ * @return 0 -> Success, -1 -> Error (no memory or the queue is full)
+ */
+int delivery_enqueue(const char *ip, const char *port, char **fields, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += strlen(fields[i]) + 1;
+    }
+    DeliveryJob *job = (DeliveryJob *)malloc(sizeof(DeliveryJob) + len);
+    if (job == NULL) {
+        return -1;
+    }
+    job->len = len;
+    char *data = job->data;
+    for (int i = 0; i < count; i++) {
+        size_t field_len = strlen(fields[i]) + 1;
+        memcpy(data, fields[i], field_len);
+        data += field_len;
+    }
+    return queue_job(ip, port, job);
+}
+
+/**
+ * @brief Queue bytes already formatted as one or more frames for the listener of a client (see delivery_enqueue()).
+ * @return 0 -> Success, -1 -> Error (no memory or the queue is full)
+ */
+int delivery_enqueue_data(const char *ip, const char *port, const char *data, size_t len) {
+    DeliveryJob *job = (DeliveryJob *)malloc(sizeof(DeliveryJob) + len);
+    if (job == NULL) {
+        return -1;
+    }
+    job->len = len;
+    memcpy(job->data, data, len);
+    return queue_job(ip, port, job);
+}
+
+/**
+ * @brief Get a copy of the counters of the delivery stage (read without locks, for monitoring).
+ */
+DeliveryStats delivery_stats() {
+    DeliveryStats copy;
+    copy.queued = __atomic_load_n(&stats.queued, __ATOMIC_RELAXED);
+    copy.max_queued = __atomic_load_n(&stats.max_queued, __ATOMIC_RELAXED);
+    copy.recipients = __atomic_load_n(&stats.recipients, __ATOMIC_RELAXED);
+    copy.delivered = __atomic_load_n(&stats.delivered, __ATOMIC_RELAXED);
+    copy.failed = __atomic_load_n(&stats.failed, __ATOMIC_RELAXED);
+    copy.refused = __atomic_load_n(&stats.refused, __ATOMIC_RELAXED);
+    copy.latency_ns = __atomic_load_n(&stats.latency_ns, __ATOMIC_RELAXED);
+    copy.max_latency_ns = __atomic_load_n(&stats.max_latency_ns, __ATOMIC_RELAXED);
+    return copy;
+}
+
+/**
+ * @brief Display the queue depth and the delivery latency.
+ */
+void display_delivery_stats() {
+    DeliveryStats copy = delivery_stats();
+    double average_us = copy.delivered > 0 ? (double)copy.latency_ns / copy.delivered / 1000.0 : 0.0;
+    printf("📬 Deliveries: %zu queued (max %zu) for %zu recipients, %lu delivered, %lu failed, %lu refused, "
+           "latency avg %.1f us, max %.1f us\n",
+           copy.queued, copy.max_queued, copy.recipients, (unsigned long)copy.delivered, (unsigned long)copy.failed,
+           (unsigned long)copy.refused, average_us, copy.max_latency_ns / 1000.0);
+}
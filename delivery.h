@@ -0,0 +1,88 @@
+/*
+ * File: delivery.h
+ * Authors: 100451339 & 100451170
+ */
+
+#ifndef DELIVERY_H
+#define DELIVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELIVERY_WORKERS 4              // Threads delivering the queued frames
+#define DELIVERY_BUCKETS 1024           // Buckets of the table of recipients (power of two)
+#define DELIVERY_MAX_QUEUED 65536       // Frames that may wait in all the queues (more are refused)
+#define DELIVERY_MAX_PER_RECIPIENT 1024 // Frames that may wait for one recipient (more are refused)
+
+// Frame waiting to be delivered to the listener of a client
+typedef struct DeliveryJob
+{
+    struct DeliveryJob *next;           // Next frame for the same recipient
+    uint64_t enqueued_ns;               // Monotonic time when the frame was queued
+    size_t len;                         // Bytes of the frame
+    char data[];                        // Frame: '\0' terminated fields
+} DeliveryJob;
+
+// Queue of the frames for one recipient (listener IP and port). Only one worker drains a recipient at a time,
+// so its frames are delivered in order while different recipients are served in parallel.
+typedef struct Recipient
+{
+    char ip[16];                        // IP address of the listener
+    char port[6];                       // Port of the listener
+    DeliveryJob *head;                  // Oldest queued frame
+    DeliveryJob *tail;                  // Newest queued frame
+    size_t queued;                      // Frames queued or being delivered
+    uint8_t scheduled;                  // 1 -> In the ready list or being drained by a worker
+    struct Recipient *next;             // Next recipient of the bucket
+    struct Recipient *next_ready;       // Next recipient of the ready list
+} Recipient;
+
+// Counters of the delivery stage
+typedef struct
+{
+    size_t queued;                      // Frames waiting in the queues
+    size_t max_queued;                  // Largest number of frames that have waited at the same time
+    size_t recipients;                  // Recipients with queued or in-flight frames
+    uint64_t delivered;                 // Frames delivered
+    uint64_t failed;                    // Frames that could not be delivered
+    uint64_t refused;                   // Frames refused because their queue or all the queues were full
+    uint64_t latency_ns;                // Sum of the times from enqueue to delivery
+    uint64_t max_latency_ns;            // Longest time from enqueue to delivery
+} DeliveryStats;
+
+/**
+ * @brief Start the delivery workers.
+ * @return 0 -> Success, -1 -> Error
+ */
+int delivery_start(int workers);
+
+/**
+ * @brief Deliver every frame still queued and stop the delivery workers. Nothing may be queued from now on.
+ */
+void delivery_stop();
+
+/**
+ * @brief Queue a frame of '\0' terminated fields for the listener of a client and return without waiting for it
+ * to be delivered. It never waits: the frame is refused if DELIVERY_MAX_PER_RECIPIENT frames are already waiting
+ * for the listener or DELIVERY_MAX_QUEUED for all of them.
+ * @return 0 -> Success, -1 -> Error (no memory or the queue is full)
+ */
+int delivery_enqueue(const char *ip, const char *port, char **fields, int count);
+
+/**
+ * @brief Queue bytes already formatted as one or more frames for the listener of a client (see delivery_enqueue()).
+ * @return 0 -> Success, -1 -> Error (no memory or the queue is full)
+ */
+int delivery_enqueue_data(const char *ip, const char *port, const char *data, size_t len);
+
+/**
+ * @brief Get a copy of the counters of the delivery stage (read without locks, for monitoring).
+ */
+DeliveryStats delivery_stats();
+
+/**
+ * @brief Display the queue depth and the delivery latency.
+ */
+void display_delivery_stats();
+
+#endif
@@ -1,6 +1,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include "lines.h"
 
 int sendMessage(int socket, char *buffer, int len)
@@ -90,3 +93,193 @@ ssize_t readLine(int fd, void *buffer, size_t n)
     *buf = '\0';
     return totRead;
 }
+
+/* Initialise an empty reader of the socket fd */
+void reader_init(LineReader *reader, int fd)
+{
+    reader->fd = fd;
+    reader->start = 0;
+    reader->cursor = 0;
+    reader->end = 0;
+    reader->max_field = 0;
+}
+
+/*
+ * Receive more bytes with a single recv(). The fields that have not been released are
+ * moved to the beginning of the buffer first, so the fields handed out since the last
+ * reader_release() must not be used after calling this function.
+ * Returns the number of bytes received, 0 on EOF and -1 on error (ENOBUFS if the
+ * unreleased fields fill the whole buffer).
+ */
+ssize_t reader_fill(LineReader *reader)
+{
+    ssize_t numRead;
+
+    if (reader->start > 0)
+    {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->cursor -= reader->start;
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    if (reader->end == READER_BUFFER_SIZE)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    do
+    {
+        numRead = recv(reader->fd, reader->buffer + reader->end, READER_BUFFER_SIZE - reader->end, 0);
+    } while (numRead == -1 && errno == EINTR); /* interrupted -> restart recv() */
+
+    if (numRead > 0)
+        reader->end += numRead;
+
+    return numRead;
+}
+
+/*
+ * Hand out the next field already received, without copying it: *field points into the
+ * buffer and is '\0' terminated in place. While the end of a field has not arrived, only its
+ * first max_field bytes are kept (like readLine(), which discards the bytes past n - 1), so a
+ * long field does not fill the buffer; the caller cuts what arrives with the terminator.
+ * Without max_field, fields longer than the buffer are not supported.
+ * Returns 1 if a whole field was available, 0 if more bytes must be received.
+ */
+int reader_next_field(LineReader *reader, char **field, size_t *len)
+{
+    char *begin = reader->buffer + reader->cursor;
+    size_t available = reader->end - reader->cursor;
+    char *nul = memchr(begin, '\0', available);
+    char *newline = memchr(begin, '\n', nul != NULL ? (size_t)(nul - begin) : available);
+    char *terminator = newline != NULL ? newline : nul;
+
+    if (terminator == NULL)
+    {
+        if (reader->max_field > 0 && available > reader->max_field)
+            reader->end = reader->cursor + reader->max_field; /* discard the rest of the field */
+        return 0;
+    }
+
+    *terminator = '\0';
+    *field = begin;
+    *len = terminator - begin;
+    reader->cursor += *len + 1;
+    return 1;
+}
+
+/*
+ * Hand out the next len bytes already received, without copying them: *bytes points into
+ * the buffer. Returns 1 if the len bytes were available, 0 if more bytes must be received.
+ */
+int reader_next_bytes(LineReader *reader, size_t len, char **bytes)
+{
+    if (reader->end - reader->cursor < len)
+        return 0;
+
+    *bytes = reader->buffer + reader->cursor;
+    reader->cursor += len;
+    return 1;
+}
+
+/* Go back to the first field that has not been released (the request is incomplete) */
+void reader_rewind(LineReader *reader)
+{
+    reader->cursor = reader->start;
+}
+
+/* Release the fields handed out so far: their bytes may be reused by the next reader_fill() */
+void reader_release(LineReader *reader)
+{
+    reader->start = reader->cursor;
+    if (reader->start == reader->end)
+    {
+        reader->start = 0;
+        reader->cursor = 0;
+        reader->end = 0;
+    }
+}
+
+/* Initialise an empty writer of the socket fd */
+void writer_init(LineWriter *writer, int fd)
+{
+    writer->fd = fd;
+    writer->len = 0;
+    writer->sent = 0;
+    writer->capacity = WRITER_BUFFER_SIZE;
+    writer->data = writer->storage;
+}
+
+/* Append len bytes to the reply. Returns 0 on success and -1 if there is no memory */
+int writer_append(LineWriter *writer, const void *data, size_t len)
+{
+    if (writer->len + len > writer->capacity)
+    {
+        size_t capacity = writer->capacity * 2;
+        while (capacity < writer->len + len)
+            capacity *= 2;
+
+        char *data_new = malloc(capacity);
+        if (data_new == NULL)
+            return -1;
+        memcpy(data_new, writer->data, writer->len);
+        if (writer->data != writer->storage)
+            free(writer->data);
+        writer->data = data_new;
+        writer->capacity = capacity;
+    }
+
+    memcpy(writer->data + writer->len, data, len);
+    writer->len += len;
+    return 0;
+}
+
+/* Append a string to the reply, including its '\0' */
+int writer_append_string(LineWriter *writer, const char *string)
+{
+    return writer_append(writer, string, strlen(string) + 1);
+}
+
+/* Send the whole reply with sendMessage() and empty the writer. Returns 0 on success and -1 on error */
+int writer_flush(LineWriter *writer)
+{
+    int r = 0;
+
+    if (writer->len > 0)
+        r = sendMessage(writer->fd, writer->data, writer->len);
+
+    writer->len = 0;
+    return r;
+}
+
+/* Write as much of the reply as a non-blocking socket takes now, emptying the writer once all of it is written.
+   Returns 0 if everything has been written, 1 if bytes are left (try again when the socket is writable), and -1 on
+   error */
+int writer_flush_some(LineWriter *writer)
+{
+    while (writer->sent < writer->len)
+    {
+        ssize_t r = write(writer->fd, writer->data + writer->sent, writer->len - writer->sent);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        writer->sent += r;
+    }
+
+    writer->len = 0;
+    writer->sent = 0;
+    return 0;
+}
+
+/* Release the memory of the writer */
+void writer_destroy(LineWriter *writer)
+{
+    if (writer->data != writer->storage)
+        free(writer->data);
+    writer_init(writer, writer->fd);
+}
@@ -3,8 +3,47 @@
 
 #include <unistd.h>
 
+#define READER_BUFFER_SIZE 4096     // Bytes buffered per connection, enough for several requests
+#define WRITER_BUFFER_SIZE 1024     // Bytes of a reply that fit without allocating
+
+// Buffered reader of the '\0' (or '\n') terminated fields received from a socket
+typedef struct
+{
+    int fd;                             // Socket descriptor
+    size_t start;                       // First byte of the fields that have not been released
+    size_t cursor;                      // First byte that has not been handed out as a field
+    size_t end;                         // End of the received bytes
+    size_t max_field;                   // Bytes kept of a field, the rest are dropped as they arrive (0 -> No limit)
+    char buffer[READER_BUFFER_SIZE];    // Received bytes
+} LineReader;
+
+// Buffered writer used to send a whole reply with a single write
+typedef struct
+{
+    int fd;                             // Socket descriptor
+    size_t len;                         // Number of bytes of the reply
+    size_t sent;                        // Bytes of the reply already written by writer_flush_some()
+    size_t capacity;                    // Capacity of data
+    char *data;                         // Points to storage, or to the heap when the reply does not fit
+    char storage[WRITER_BUFFER_SIZE];   // Inline storage
+} LineWriter;
+
 int sendMessage(int socket, char *buffer, int len);
 int recvMessage(int socket, char *buffer, int len);
 ssize_t readLine(int fd, void *buffer, size_t n);
 
-#endif
\ No newline at end of file
+void reader_init(LineReader *reader, int fd);
+ssize_t reader_fill(LineReader *reader);
+int reader_next_field(LineReader *reader, char **field, size_t *len);
+int reader_next_bytes(LineReader *reader, size_t len, char **bytes);
+void reader_rewind(LineReader *reader);
+void reader_release(LineReader *reader);
+
+void writer_init(LineWriter *writer, int fd);
+int writer_append(LineWriter *writer, const void *data, size_t len);
+int writer_append_string(LineWriter *writer, const char *string);
+int writer_flush(LineWriter *writer);
+int writer_flush_some(LineWriter *writer);
+void writer_destroy(LineWriter *writer);
+
+#endif
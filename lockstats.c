@@ -0,0 +1,140 @@
+/*
+ * File: lockstats.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+
+#include "lockstats.h"
+
+#ifdef LOCK_STATS
+
+const char *LOCK_OPERATION_NAMES[LOCK_OPERATIONS] = {
+    "INIT", "REGISTER", "UNREGISTER", "CONNECT", "DISCONNECT", "SEND", "DISPLAY", "DELETE_LIST", "HOT_MAILBOXES",
+    "COUNT_USERS", "POP_DELIVERED", "FINISH_DELIVERY", "SNAPSHOT", "REATTACH", "DETACH"};
+
+LockStats lock_stats[LOCK_OPERATIONS];                  // Updated atomically (one cache line per operation)
+uint64_t interval_longest_hold = 0;                     // Longest hold of the interval << 8 | its operation
+uint64_t interval_start_ns = 0;                         // Start of the interval (0 -> no lock taken yet)
+
+/**
+ * @brief Raise *max to value if it is larger.
+ */
+void lock_stats_max(uint64_t *max, uint64_t value) {
+    uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(max, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * @brief Record the wait and the hold of a timer, whose locks have just been released.
+ */
+void lock_stats_record(LOCK_OPERATION operation, LockTimer *timer) {
+    uint64_t wait_ns = timer->acquired - timer->start;
+    uint64_t hold_ns = lock_stats_now() - timer->acquired;
+    LockStats *stats = &lock_stats[operation];
+    __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->wait_ns, wait_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->hold_ns, hold_ns, __ATOMIC_RELAXED);
+    lock_stats_max(&stats->max_wait_ns, wait_ns);
+    lock_stats_max(&stats->max_hold_ns, hold_ns);
+
+    // The operation goes in the low byte, so the largest value is the longest hold and who held it
+    lock_stats_max(&interval_longest_hold, hold_ns << 8 | (uint64_t)operation);
+
+    // The first interval starts with the first lock taken
+    uint64_t unset = 0;
+    if (__atomic_load_n(&interval_start_ns, __ATOMIC_RELAXED) == 0) {
+        __atomic_compare_exchange_n(&interval_start_ns, &unset, timer->start, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Check whether the lock statistics are compiled in.
+ * @return 1 -> Compiled in (-DLOCK_STATS), 0 -> Not compiled in
+ */
+int lock_stats_enabled() {
+    return 1;
+}
+
+/**
+ * @brief Write the times of the locks to path as JSON. The file is replaced at once, so a reader never sees half.
+ */
+void lock_stats_write(const char *path, LockStats *copy, uint64_t longest, uint64_t interval_ns) {
+    char temporary[4200];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) {
+        return;
+    }
+    fprintf(file, "{\"interval_ms\": %lu, \"longest_hold\": {\"operation\": \"%s\", \"ns\": %lu}, \"operations\": [",
+            (unsigned long)(interval_ns / 1000000), LOCK_OPERATION_NAMES[longest & 0xff],
+            (unsigned long)(longest >> 8));
+    for (int i = 0; i < LOCK_OPERATIONS; i++) {
+        fprintf(file, "%s\n  {\"operation\": \"%s\", \"count\": %lu, \"wait_ns\": %lu, \"hold_ns\": %lu, "
+                "\"max_wait_ns\": %lu, \"max_hold_ns\": %lu}",
+                i > 0 ? "," : "", LOCK_OPERATION_NAMES[i], (unsigned long)copy[i].count,
+                (unsigned long)copy[i].wait_ns, (unsigned long)copy[i].hold_ns, (unsigned long)copy[i].max_wait_ns,
+                (unsigned long)copy[i].max_hold_ns);
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) == 0) {
+        rename(temporary, path);
+    }
+}
+
+/**
+ * @brief Display the times of the locks by operation and the longest hold since the previous dump, write them to
+ * path as JSON (if it is not NULL) and start a new interval.
+ */
+void lock_stats_dump(const char *path) {
+    LockStats copy[LOCK_OPERATIONS];
+    for (int i = 0; i < LOCK_OPERATIONS; i++) {
+        copy[i].count = __atomic_load_n(&lock_stats[i].count, __ATOMIC_RELAXED);
+        copy[i].wait_ns = __atomic_load_n(&lock_stats[i].wait_ns, __ATOMIC_RELAXED);
+        copy[i].hold_ns = __atomic_load_n(&lock_stats[i].hold_ns, __ATOMIC_RELAXED);
+        copy[i].max_wait_ns = __atomic_load_n(&lock_stats[i].max_wait_ns, __ATOMIC_RELAXED);
+        copy[i].max_hold_ns = __atomic_load_n(&lock_stats[i].max_hold_ns, __ATOMIC_RELAXED);
+    }
+    uint64_t now = lock_stats_now();
+    uint64_t longest = __atomic_exchange_n(&interval_longest_hold, 0, __ATOMIC_RELAXED);
+    uint64_t start = __atomic_exchange_n(&interval_start_ns, now, __ATOMIC_RELAXED);
+    uint64_t interval_ns = start == 0 ? 0 : now - start;
+
+    printf("🔒 Locks of the registry (wait / hold, in us):\n");
+    for (int i = 0; i < LOCK_OPERATIONS; i++) {
+        if (copy[i].count == 0) {
+            continue;
+        }
+        printf("   %-16s %10lu times, wait avg %8.2f max %10.2f, hold avg %8.2f max %10.2f\n",
+               LOCK_OPERATION_NAMES[i], (unsigned long)copy[i].count,
+               copy[i].wait_ns / 1000.0 / copy[i].count, copy[i].max_wait_ns / 1000.0,
+               copy[i].hold_ns / 1000.0 / copy[i].count, copy[i].max_hold_ns / 1000.0);
+    }
+    printf("   Longest hold since the previous dump: %.2f us by %s\n", (longest >> 8) / 1000.0,
+           LOCK_OPERATION_NAMES[longest & 0xff]);
+
+    if (path != NULL) {
+        lock_stats_write(path, copy, longest, interval_ns);
+    }
+}
+
+#else
+
+/**
+ * @brief Check whether the lock statistics are compiled in.
+ * @return 1 -> Compiled in (-DLOCK_STATS), 0 -> Not compiled in
+ */
+int lock_stats_enabled() {
+    return 0;
+}
+
+/**
+ * @brief Nothing is measured without -DLOCK_STATS.
+ */
+void lock_stats_dump(const char *path) {
+    (void)path;
+}
+
+#endif
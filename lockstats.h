@@ -0,0 +1,94 @@
+/*
+ * File: lockstats.h
+ * Authors: 100451339 & 100451170
+ *
+ * Time the registry wrappers (servidor.c) wait for the locks of the shards and hold them, by operation.
+ * It is only compiled in with -DLOCK_STATS (make proxy LOCK_STATS=1): otherwise the timers are empty macros and
+ * the registry does not read the clock at all.
+ */
+
+#ifndef LOCKSTATS_H
+#define LOCKSTATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Operations that take the locks of the registry
+typedef enum
+{
+    LOCK_INIT = 0,
+    LOCK_REGISTER,
+    LOCK_UNREGISTER,
+    LOCK_CONNECT,
+    LOCK_DISCONNECT,
+    LOCK_SEND,
+    LOCK_DISPLAY,
+    LOCK_DELETE_LIST,
+    LOCK_HOT_MAILBOXES,
+    LOCK_COUNT_USERS,
+    LOCK_POP_DELIVERED,
+    LOCK_FINISH_DELIVERY,
+    LOCK_SNAPSHOT,
+    LOCK_REATTACH,
+    LOCK_DETACH,
+    LOCK_OPERATIONS                 // Number of operations
+} LOCK_OPERATION;
+
+// Times of the locks taken by one operation
+typedef struct
+{
+    uint64_t count;                 // Times the locks were taken
+    uint64_t wait_ns;               // Time waiting for the locks
+    uint64_t hold_ns;               // Time holding the locks
+    uint64_t max_wait_ns;           // Longest wait
+    uint64_t max_hold_ns;           // Longest hold
+} __attribute__((aligned(64))) LockStats;
+
+#ifdef LOCK_STATS
+
+// Times of one acquisition of the locks
+typedef struct
+{
+    uint64_t start;                 // Time the operation started waiting for the locks
+    uint64_t acquired;              // Time it got them
+} LockTimer;
+
+/**
+ * @brief Get the current monotonic time in nanoseconds (vDSO, no system call).
+ */
+static inline uint64_t lock_stats_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Record the wait and the hold of a timer, whose locks have just been released.
+ */
+void lock_stats_record(LOCK_OPERATION operation, LockTimer *timer);
+
+#define LOCK_TIMER_START(timer) LockTimer timer; (timer).start = lock_stats_now()
+#define LOCK_TIMER_ACQUIRED(timer) ((timer).acquired = lock_stats_now())
+#define LOCK_TIMER_RELEASED(timer, operation) lock_stats_record((operation), &(timer))
+
+#else
+
+#define LOCK_TIMER_START(timer) ((void)0)
+#define LOCK_TIMER_ACQUIRED(timer) ((void)0)
+#define LOCK_TIMER_RELEASED(timer, operation) ((void)0)
+
+#endif
+
+/**
+ * @brief Check whether the lock statistics are compiled in.
+ * @return 1 -> Compiled in (-DLOCK_STATS), 0 -> Not compiled in
+ */
+int lock_stats_enabled();
+
+/**
+ * @brief Display the times of the locks by operation and the longest hold since the previous dump, write them to
+ * path as JSON (if it is not NULL) and start a new interval.
+ */
+void lock_stats_dump(const char *path);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * File: logger.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "util.h"
+
+const char *LOG_LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
+
+LOG_LEVEL logger_level = LOG_DEBUG;                         // Lowest level logged
+int logger_running = 0;                                     // 1 -> The writer thread copies the rings (atomic)
+pthread_t logger_thread;
+uint64_t logger_written = 0;                                // Lines written by the writer thread (atomic)
+BlockRegistry logger_registry = BLOCK_REGISTRY_INITIALIZER(LogRing, 64);   // Rings of every thread that has logged
+__thread LogRing *logger_local = NULL;                                      // Ring of the calling thread
+
+/**
+ * @brief Get the level with the given name (debug, info, warn or error).
+ * @return the level, -1 if there is no level with that name
+ */
+int logger_parse_level(const char *name) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if (strcmp(name, LOG_LEVEL_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Get the ring of the calling thread. The writer still copies the lines left in the ring of a thread that ends.
+ * @return NULL if there is no memory
+ */
+LogRing *logger_ring() {
+    if (logger_local == NULL) {
+        logger_local = (LogRing *)registry_acquire(&logger_registry);
+    }
+    return logger_local;
+}
+
+/**
+ * @brief Log a line (printf format) of the given level, if it is not below the level of the log.
+ */
+void logger_write(LOG_LEVEL level, const char *format, ...) {
+    if (level < logger_level) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+
+    LogRing *ring = __atomic_load_n(&logger_running, __ATOMIC_ACQUIRE) ? logger_ring() : NULL;
+    if (ring == NULL) {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    LogEntry *entry = &ring->entries[head & (LOG_RING_SLOTS - 1)];
+    int length = vsnprintf(entry->line, LOG_LINE_SIZE, format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    if (length >= LOG_LINE_SIZE) {
+        // * The line is cut, but it still ends the line
+        length = LOG_LINE_SIZE - 1;
+        entry->line[length - 1] = '\n';
+    }
+    entry->length = (uint32_t)length;
+    entry->time_ns = now_ns();
+
+    // Publish the line to the writer
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write the lines that are in the rings now, the oldest first.
+ * @return the number of lines written
+ */
+unsigned long logger_drain() {
+    unsigned long written = 0;
+    for (;;) {
+        // * The oldest line at the tail of a ring
+        LogRing *oldest = NULL;
+        for (ThreadBlock *next = registry_blocks(&logger_registry); next != NULL; next = next->next) {
+            LogRing *ring = (LogRing *)next;
+            if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if (oldest == NULL || ring->entries[ring->tail & (LOG_RING_SLOTS - 1)].time_ns <
+                                  oldest->entries[oldest->tail & (LOG_RING_SLOTS - 1)].time_ns) {
+                oldest = ring;
+            }
+        }
+        if (oldest == NULL) {
+            break;
+        }
+
+        LogEntry *entry = &oldest->entries[oldest->tail & (LOG_RING_SLOTS - 1)];
+        fwrite(entry->line, 1, entry->length, stdout);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+    if (written > 0) {
+        fflush(stdout);
+        __atomic_fetch_add(&logger_written, written, __ATOMIC_RELAXED);
+    }
+    return written;
+}
+
+/**
+ * @brief Thread that copies the rings to stdout until the log is stopped
+ * @return NULL
+ */
+void *logger_worker(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+        if (logger_drain() == 0) {
+            usleep(LOG_IDLE_US);
+        }
+    }
+    logger_drain();
+    return NULL;
+}
+
+/**
+ * @brief Set the lowest level logged and start the writer thread. Until it is started, the lines are printed
+ * directly by the thread that logs them.
+ * @return 0 -> Success, -1 -> Error (the thread cannot be created)
+ */
+int logger_start(LOG_LEVEL level) {
+    logger_level = level;
+    fflush(stdout);
+    __atomic_store_n(&logger_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&logger_thread, NULL, logger_worker, NULL) != 0) {
+        __atomic_store_n(&logger_running, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write every line logged so far and stop the writer thread. The next lines are printed directly.
+ */
+void logger_stop() {
+    if (!__atomic_exchange_n(&logger_running, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_join(logger_thread, NULL);
+}
+
+/**
+ * @brief Display the lines written and dropped.
+ */
+void display_logger_stats() {
+    uint64_t dropped = 0;
+    for (ThreadBlock *next = registry_blocks(&logger_registry); next != NULL; next = next->next) {
+        LogRing *ring = (LogRing *)next;
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    printf("📝 Log: %lu lines written, %lu dropped (ring full), level %s\n",
+           (unsigned long)__atomic_load_n(&logger_written, __ATOMIC_RELAXED), (unsigned long)dropped,
+           LOG_LEVEL_NAMES[logger_level]);
+}
@@ -0,0 +1,78 @@
+/*
+ * File: logger.h
+ * Authors: 100451339 & 100451170
+ *
+ * Log of the request path. Every thread formats its lines into a ring of its own and a writer thread copies them
+ * to stdout, so a request never waits for the terminal or a pipe, nor for the other threads that log.
+ * The rings are single-producer single-consumer: the owner moves the head and the writer the tail. A line that
+ * finds the ring of its thread full is dropped and counted, rather than blocking the request.
+ * The writer merges the rings by the time of the lines, so the output keeps the order of the requests.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+#include "registry.h"
+
+#define LOG_RING_SLOTS 256              // Lines that can wait in the ring of a thread (power of two)
+#define LOG_LINE_SIZE 512               // Longest line, including its '\n' (longer lines are cut)
+#define LOG_IDLE_US 1000                // Time the writer sleeps when every ring is empty
+
+// Levels of the lines, from the most verbose
+typedef enum
+{
+    LOG_DEBUG = 0,                      // Every request received (IP, port and operation)
+    LOG_INFO,                           // Result of every request ("s> ...")
+    LOG_WARN,                           // Failures the server recovers from
+    LOG_ERROR                           // Failures that lose work
+} LOG_LEVEL;
+
+// Line waiting in a ring
+typedef struct
+{
+    uint64_t time_ns;                   // Time it was logged, to merge the rings
+    uint32_t length;                    // Length of the line
+    char line[LOG_LINE_SIZE];
+} LogEntry;
+
+// Ring of the lines of one thread
+typedef struct
+{
+    ThreadBlock block;                              // Header of the ring in the registry (must be first)
+    uint64_t head __attribute__((aligned(64)));     // Next slot written by the owner
+    uint64_t dropped;                               // Lines dropped because the ring was full (owner only)
+    uint64_t tail __attribute__((aligned(64)));     // Next slot read by the writer
+    LogEntry entries[LOG_RING_SLOTS];
+} LogRing;
+
+/**
+ * @brief Get the level with the given name (debug, info, warn or error).
+ * @return the level, -1 if there is no level with that name
+ */
+int logger_parse_level(const char *name);
+
+/**
+ * @brief Set the lowest level logged and start the writer thread. Until it is started, the lines are printed
+ * directly by the thread that logs them.
+ * @return 0 -> Success, -1 -> Error (the thread cannot be created)
+ */
+int logger_start(LOG_LEVEL level);
+
+/**
+ * @brief Log a line (printf format) of the given level, if it is not below the level of the log.
+ */
+void logger_write(LOG_LEVEL level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Write every line logged so far and stop the writer thread. The next lines are printed directly.
+ */
+void logger_stop();
+
+/**
+ * @brief Display the lines written and dropped.
+ */
+void display_logger_stats();
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * File: microbench.c
+ * Authors: 100451339 & 100451170
+ *
+ * Microbenchmark of the user registry (LinkedList.c and servidor.c) without sockets. It measures the operations of
+ * LinkedList.c for directories of 1,000 users up to max users and for mailboxes of up to max depth messages, and
+ * then the list_* wrappers of servidor.c with 1 to MAX_THREADS threads. Every result is the time per operation
+ * and the number of allocations (malloc, calloc, realloc, aligned_alloc, posix_memalign and mmap calls) per operation.
+ * The mailboxes are kept in memory (no spill, no limits), so the cost measured is the one of LinkedList.c.
+ * Usage: ./microbench [max users] [max depth]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "LinkedList.h"
+#include "servidor.h"
+#include "util.h"
+
+#define DEFAULT_MAX_USERS 1000000   // Largest directory measured when no argument is given
+#define DEFAULT_MAX_DEPTH 100000    // Largest mailbox measured when no argument is given
+#define LOOKUPS 1000000             // Lookups measured per directory size
+#define SENDS 1000000               // Messages between connected users measured per directory size
+#define CONNECTED_EVERY 100         // One user of every CONNECTED_EVERY is connected
+#define CONNECTED_SCANS 10000000    // Users visited by the CONNECTEDUSERS measured per directory size
+#define DEPTH_USERS 10000           // Users of the directory of the mailbox benchmark
+#define DEPTH_BATCH 10000           // Messages stored and deleted per mailbox depth
+#define THREAD_USERS 10000          // Users of the registry of the threaded benchmark
+#define THREAD_OPERATIONS 100000    // Operations of each thread of the threaded benchmark
+#define THREAD_CONNECTED_CALLS 100  // CONNECTEDUSERS of each thread of the threaded benchmark (all users connected)
+#define MAX_THREADS 16              // Largest number of threads of the threaded benchmark
+
+// Operations of the threaded benchmark
+typedef enum
+{
+    OP_REGISTER = 0,                // list_register_user of new users
+    OP_SEND_CONNECTED,              // list_send_message to connected users (not stored)
+    OP_SEND_STORED,                 // list_send_message to disconnected users (stored)
+    OP_CONNECTED_USERS              // list_connected_users
+} THREAD_OPERATION;
+
+// Work of a thread of the threaded benchmark
+typedef struct
+{
+    THREAD_OPERATION operation;
+    int id;                         // Number of the thread
+    int threads;                    // Threads running the operation
+    unsigned int operations;        // Operations done
+} ThreadWork;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+uint64_t allocations = 0;           // Calls to the allocator and to mmap (atomic)
+char **aliases;                     // Aliases "user<i>" of the benchmark
+char message[] = "hello, this is a message of the benchmark";
+
+// * The allocator of the C library, counting its calls (the whole program uses these definitions)
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *memory = __libc_memalign(alignment, size);
+    if (memory == NULL) {
+        return ENOMEM;
+    }
+    *ptr = memory;
+    return 0;
+}
+
+// The slabs (slab.c) are mapped directly; the C library maps its own memory without going through this definition
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+/**
+ * @brief Get the number of allocations so far
+ */
+uint64_t allocations_now() {
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Create the aliases "user<i>" used by the benchmark
+ */
+char **create_aliases(unsigned int count) {
+    char **created = (char **)malloc(count * sizeof(char *));
+    if (created == NULL) {
+        return NULL;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        created[i] = (char *)malloc(16);
+        sprintf(created[i], "user%u", i);
+    }
+    return created;
+}
+
+/**
+ * @brief Print a result: operations operations took elapsed nanoseconds and allocated allocated times
+ * @param depth messages in the mailbox, -1 -> Not relevant
+ */
+void print_result(const char *operation, unsigned int users, long depth, int threads, unsigned long operations,
+                  uint64_t elapsed, uint64_t allocated) {
+    char depth_text[24] = "-";
+    if (depth >= 0) {
+        sprintf(depth_text, "%ld", depth);
+    }
+    double ns = (double)elapsed / operations;
+    printf("%-22s %8u %8s %8d %12.1f %14.0f %10.2f\n", operation, users, depth_text, threads, ns, 1e9 / ns,
+           (double)allocated / operations);
+}
+
+/**
+ * @brief Measure register_user(), search(), connected_users() and send_message() on a directory of users users
+ */
+void bench_directory(unsigned int users) {
+    UserList *list = create_user_list();
+
+    // * register_user
+    uint64_t allocated = allocations_now();
+    uint64_t start = now_ns();
+    for (unsigned int i = 0; i < users; i++) {
+        register_user(list, "127.0.0.1", "5000", aliases[i], aliases[i], "01/01/2000");
+    }
+    print_result("register_user", users, -1, 1, users, now_ns() - start, allocations_now() - allocated);
+
+    // * search of existing aliases, in a pseudo-random order
+    unsigned int found = 0;
+    unsigned int seed = 12345;
+    allocated = allocations_now();
+    start = now_ns();
+    for (unsigned int i = 0; i < LOOKUPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        found += search(list, aliases[seed % users]) != NULL;
+    }
+    print_result("search", users, -1, 1, LOOKUPS, now_ns() - start, allocations_now() - allocated);
+
+    // * search of aliases that do not exist
+    allocated = allocations_now();
+    start = now_ns();
+    for (unsigned int i = 0; i < LOOKUPS; i++) {
+        found += search(list, "nobody") != NULL;
+    }
+    print_result("search (miss)", users, -1, 1, LOOKUPS, now_ns() - start, allocations_now() - allocated);
+    if (found != LOOKUPS) {
+        printf("ERROR: %u of %u lookups found their user\n", found, LOOKUPS);
+    }
+
+    // * connected_users, with one user of every CONNECTED_EVERY connected
+    for (unsigned int i = 0; i < users; i += CONNECTED_EVERY) {
+        connect_user(list, "127.0.0.1", "5000", aliases[i]);
+    }
+    unsigned int calls = CONNECTED_SCANS / users;
+    allocated = allocations_now();
+    start = now_ns();
+    for (unsigned int i = 0; i < calls; i++) {
+        ConnectedUsers result = connected_users(list, aliases[0]);
+        free(result.aliases);
+    }
+    print_result("connected_users", users, -1, 1, calls, now_ns() - start, allocations_now() - allocated);
+
+    // * send_message between connected users (the message is not stored)
+    unsigned int connected = (users + CONNECTED_EVERY - 1) / CONNECTED_EVERY;
+    allocated = allocations_now();
+    start = now_ns();
+    for (unsigned int i = 0; i < SENDS; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned int source = (seed >> 8) % connected * CONNECTED_EVERY;
+        seed = seed * 1103515245 + 12345;
+        unsigned int dest = (seed >> 8) % connected * CONNECTED_EVERY;
+        send_message(list, list, aliases[source], aliases[dest], message);
+    }
+    print_result("send_message", users, -1, 1, SENDS, now_ns() - start, allocations_now() - allocated);
+
+    delete_user_list(list);
+    free(list);
+}
+
+/**
+ * @brief Measure send_message() and add_pending_message() storing DEPTH_BATCH messages in a mailbox that already
+ * holds depth messages, and delete_message() deleting them.
+ */
+void bench_mailbox(unsigned int depth) {
+    UserList *list = create_user_list();
+    for (unsigned int i = 0; i < DEPTH_USERS; i++) {
+        register_user(list, "127.0.0.1", "5000", aliases[i], aliases[i], "01/01/2000");
+    }
+    connect_user(list, "127.0.0.1", "5000", aliases[0]);
+    UserEntry *sender = search(list, aliases[0]);
+    UserEntry *receiver = search(list, aliases[1]);
+    for (unsigned int i = 0; i < depth; i++) {
+        add_pending_message(receiver, sender->alias, i, message);
+    }
+
+    // * send_message to a disconnected user (the message is stored)
+    uint64_t allocated = allocations_now();
+    uint64_t start = now_ns();
+    for (unsigned int i = 0; i < DEPTH_BATCH; i++) {
+        send_message(list, list, aliases[0], aliases[1], message);
+    }
+    print_result("send_message (stored)", DEPTH_USERS, depth, 1, DEPTH_BATCH, now_ns() - start,
+                 allocations_now() - allocated);
+
+    // * delete_message of the messages just stored, in a scattered order (DEPTH_BATCH is not a multiple of 7)
+    allocated = allocations_now();
+    start = now_ns();
+    for (unsigned int i = 0; i < DEPTH_BATCH; i++) {
+        delete_message(list, aliases[1], depth + (i * 7) % DEPTH_BATCH);
+    }
+    print_result("delete_message", DEPTH_USERS, depth, 1, DEPTH_BATCH, now_ns() - start,
+                 allocations_now() - allocated);
+
+    // * add_pending_message, without looking up the users
+    allocated = allocations_now();
+    start = now_ns();
+    for (unsigned int i = 0; i < DEPTH_BATCH; i++) {
+        add_pending_message(receiver, sender->alias, depth + i, message);
+    }
+    print_result("add_pending_message", DEPTH_USERS, depth, 1, DEPTH_BATCH, now_ns() - start,
+                 allocations_now() - allocated);
+
+    delete_user_list(list);
+    free(list);
+}
+
+/**
+ * @brief Run THREAD_OPERATIONS operations of a thread through the list_* wrappers (servidor.c)
+ * The receivers of the stored messages of a thread are its own, so the threads do not write to the same mailboxes.
+ */
+void *thread_worker(void *arg) {
+    ThreadWork *work = (ThreadWork *)arg;
+    unsigned int seed = 12345 + work->id;
+    unsigned int half = THREAD_USERS / 2;
+    unsigned int receivers = half / work->threads;
+    work->operations = 0;
+    for (unsigned int i = 0; i < THREAD_OPERATIONS; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned int source = (seed >> 8) % half;
+        unsigned int receiver = half + work->id * receivers + i % receivers;
+        switch (work->operation) {
+        case OP_REGISTER:
+        {
+            char alias[32];
+            sprintf(alias, "thread%d-%u", work->id, i);
+            list_register_user("127.0.0.1", "5000", alias, alias, "01/01/2000");
+            break;
+        }
+        case OP_SEND_CONNECTED:
+            seed = seed * 1103515245 + 12345;
+            list_send_message(aliases[source], aliases[(seed >> 8) % half], message);
+            break;
+        case OP_SEND_STORED:
+            list_send_message(aliases[source], aliases[receiver], message);
+            break;
+        case OP_CONNECTED_USERS:
+        {
+            if (i == THREAD_CONNECTED_CALLS) {
+                return NULL;
+            }
+            ConnectedUsers result = list_connected_users(aliases[source]);
+            free(result.aliases);
+            break;
+        }
+        }
+        work->operations++;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run an operation with threads threads on a registry of users users and print its result
+ */
+void bench_threads_operation(THREAD_OPERATION operation, const char *name, int threads, unsigned int users) {
+    pthread_t tids[MAX_THREADS];
+    ThreadWork work[MAX_THREADS];
+    uint64_t allocated = allocations_now();
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        work[i].operation = operation;
+        work[i].id = i;
+        work[i].threads = threads;
+        pthread_create(&tids[i], NULL, thread_worker, &work[i]);
+    }
+    unsigned long operations = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        operations += work[i].operations;
+    }
+    print_result(name, users, -1, threads, operations, now_ns() - start, allocations_now() - allocated);
+}
+
+/**
+ * @brief Measure the list_* wrappers with 1 to MAX_THREADS threads. The first half of the users are connected
+ * and send the messages; the second half are disconnected and store them.
+ */
+void bench_threads() {
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        list_init();
+        for (unsigned int i = 0; i < THREAD_USERS; i++) {
+            list_register_user("127.0.0.1", "5000", aliases[i], aliases[i], "01/01/2000");
+            if (i < THREAD_USERS / 2) {
+                list_connect_user("127.0.0.1", "5000", aliases[i]);
+            }
+        }
+        bench_threads_operation(OP_SEND_CONNECTED, "list_send_message", threads, THREAD_USERS);
+        bench_threads_operation(OP_SEND_STORED, "list_send_message (st)", threads, THREAD_USERS);
+        bench_threads_operation(OP_CONNECTED_USERS, "list_connected_users", threads, THREAD_USERS);
+    }
+
+    // * Last, as the users it registers stay in the presence directory and would make the others slower
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        list_init();
+        bench_threads_operation(OP_REGISTER, "list_register_user", threads, 0);
+    }
+    request_delete_list();
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int max_users = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : DEFAULT_MAX_USERS;
+    unsigned int max_depth = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : DEFAULT_MAX_DEPTH;
+    if (max_users < 1000) {
+        printf("Usage: %s [max users >= 1000] [max depth]\n", argv[0]);
+        return 1;
+    }
+
+    // Every message stays in memory and no SEND is refused
+    spill_configure(DEFAULT_SPILL_DIRECTORY, UINT64_MAX, UINT_MAX);
+    quota_configure(0, 0, 0);
+
+    unsigned int alias_count = max_users > DEPTH_USERS ? max_users : DEPTH_USERS;
+    alias_count = alias_count > THREAD_USERS ? alias_count : THREAD_USERS;
+    aliases = create_aliases(alias_count);
+    if (aliases == NULL) {
+        printf("Error creating the aliases\n");
+        return 1;
+    }
+
+    printf("%-22s %8s %8s %8s %12s %14s %10s\n", "operation", "users", "depth", "threads", "ns/op", "ops/s",
+           "allocs/op");
+    for (unsigned int users = 1000; users <= max_users; users *= 10) {
+        bench_directory(users);
+    }
+    printf("\n");
+    bench_mailbox(0);
+    for (unsigned int depth = 100; depth <= max_depth; depth *= 10) {
+        bench_mailbox(depth);
+    }
+    printf("\n");
+    bench_threads();
+
+    for (unsigned int i = 0; i < alias_count; i++) {
+        free(aliases[i]);
+    }
+    free(aliases);
+    return 0;
+}
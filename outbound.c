@@ -0,0 +1,230 @@
+/*
+ * File: outbound.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "outbound.h"
+#include "lines.h"
+#include "logger.h"
+#include "util.h"
+
+OutboundBucket outbound_buckets[OUTBOUND_BUCKETS] = {
+    [0 ... OUTBOUND_BUCKETS - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL}
+};
+
+/**
+ * @brief Get the bucket of a listener (by its IP and port).
+ */
+OutboundBucket *outbound_bucket(const char *ip, const char *port) {
+    return &outbound_buckets[listener_hash(ip, port) & (OUTBOUND_BUCKETS - 1)];
+}
+
+/**
+ * @brief Connect a new socket to the listener of a client. The connect and every send on the socket fail after
+ * OUTBOUND_TIMEOUT_MS, so a listener that does not accept or does not read cannot hold the caller.
+ * @return the socket, or -1 if the connection failed
+ */
+int outbound_connect(const char *ip, const char *port) {
+    int sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sd == -1) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = OUTBOUND_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (OUTBOUND_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in client_addr = {0};
+    client_addr.sin_family = AF_INET;
+    client_addr.sin_addr.s_addr = inet_addr(ip);
+    client_addr.sin_port = htons((uint16_t)strtol(port, NULL, 10));
+
+    if (connect(sd, (struct sockaddr *)&client_addr, sizeof(client_addr)) == -1) {
+        logger_write(LOG_WARN, "Error connecting to the client -> IP: %s , Port: %s\n", ip, port);
+        close(sd);
+        return -1;
+    }
+
+    // Frames are small and the connection is reused: do not wait to coalesce them
+    int flag = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return sd;
+}
+
+/**
+ * @brief Check that an idle connection has not been closed by the client (nothing to read, not even EOF).
+ * It only sees a close that happened before the check: one that races with the next write goes unnoticed.
+ */
+int outbound_alive(int sd) {
+    char byte;
+    ssize_t n = recv(sd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * @brief Take an idle connection to a listener from the pool, or open a new one.
+ * @param reused set to 1 if the connection comes from the pool
+ * @return NULL if the connection failed. Otherwise, the connection (give it back with outbound_release()).
+ */
+OutboundConnection *outbound_acquire(const char *ip, const char *port, int *reused) {
+    OutboundBucket *bucket = outbound_bucket(ip, port);
+
+    for (;;) {
+        pthread_mutex_lock(&bucket->mutex);
+        OutboundConnection **link = &bucket->idle;
+        while (*link != NULL && (strcmp((*link)->ip, ip) != 0 || strcmp((*link)->port, port) != 0)) {
+            link = &(*link)->next;
+        }
+        OutboundConnection *conn = *link;
+        if (conn != NULL) {
+            *link = conn->next;
+        }
+        pthread_mutex_unlock(&bucket->mutex);
+
+        if (conn == NULL) {
+            break;
+        }
+        if (outbound_alive(conn->sd)) {
+            *reused = 1;
+            return conn;
+        }
+        close(conn->sd);
+        free(conn);
+    }
+
+    *reused = 0;
+    OutboundConnection *conn = (OutboundConnection *)malloc(sizeof(OutboundConnection));
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->sd = outbound_connect(ip, port);
+    if (conn->sd == -1) {
+        free(conn);
+        return NULL;
+    }
+    strncpy(conn->ip, ip, sizeof(conn->ip) - 1);
+    conn->ip[sizeof(conn->ip) - 1] = '\0';
+    strncpy(conn->port, port, sizeof(conn->port) - 1);
+    conn->port[sizeof(conn->port) - 1] = '\0';
+    return conn;
+}
+
+/**
+ * @brief Give a connection back to the pool, closing it if the listener already has enough idle connections.
+ */
+void outbound_release(OutboundConnection *conn) {
+    OutboundBucket *bucket = outbound_bucket(conn->ip, conn->port);
+
+    pthread_mutex_lock(&bucket->mutex);
+    int idle = 0;
+    for (OutboundConnection *current = bucket->idle; current != NULL; current = current->next) {
+        idle += strcmp(current->ip, conn->ip) == 0 && strcmp(current->port, conn->port) == 0;
+    }
+    if (idle < OUTBOUND_MAX_IDLE) {
+        conn->next = bucket->idle;
+        bucket->idle = conn;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (conn != NULL) {
+        close(conn->sd);
+        free(conn);
+    }
+}
+
+/**
+ * @brief Send data to the listener of a client over a pooled connection, opening one if none is idle.
+ * A pooled connection that turns out to be broken is closed and the data is sent again over a new one. A send that
+ * times out (the listener does not read) fails at once, and its connection is closed.
+ * Success only means that the socket took the data: the listener does not acknowledge what it reads, so a
+ * listener that closes the connection meanwhile loses it. The deliveries are at-most-once.
+ * @return 0 -> Success, -1 -> Error
+ */
+int outbound_send(const char *ip, const char *port, char *data, size_t len) {
+    int reused;
+    OutboundConnection *conn = outbound_acquire(ip, port, &reused);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    if (sendMessage(conn->sd, data, len) == -1) {
+        int timed_out = errno == EAGAIN || errno == EWOULDBLOCK;
+        close(conn->sd);
+        // Only a pooled connection may be stale: retry once with a new one (not if the listener is just not reading)
+        conn->sd = reused && !timed_out ? outbound_connect(ip, port) : -1;
+        if (conn->sd == -1 || sendMessage(conn->sd, data, len) == -1) {
+            logger_write(LOG_WARN, "Error sending to the client -> IP: %s , Port: %s\n", ip, port);
+            if (conn->sd != -1) {
+                close(conn->sd);
+            }
+            free(conn);
+            return -1;
+        }
+    }
+
+    outbound_release(conn);
+    return 0;
+}
+
+/**
+ * @brief Close the idle connections to a listener (the client disconnected or its listener changed).
+ */
+void outbound_invalidate(const char *ip, const char *port) {
+    OutboundBucket *bucket = outbound_bucket(ip, port);
+    OutboundConnection *closed = NULL;
+
+    pthread_mutex_lock(&bucket->mutex);
+    OutboundConnection **link = &bucket->idle;
+    while (*link != NULL) {
+        OutboundConnection *conn = *link;
+        if (strcmp(conn->ip, ip) == 0 && strcmp(conn->port, port) == 0) {
+            *link = conn->next;
+            conn->next = closed;
+            closed = conn;
+        } else {
+            link = &conn->next;
+        }
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+
+    while (closed != NULL) {
+        OutboundConnection *next = closed->next;
+        close(closed->sd);
+        free(closed);
+        closed = next;
+    }
+}
+
+/**
+ * @brief Close every idle connection of the pool.
+ */
+void outbound_destroy() {
+    for (int i = 0; i < OUTBOUND_BUCKETS; i++) {
+        pthread_mutex_lock(&outbound_buckets[i].mutex);
+        OutboundConnection *conn = outbound_buckets[i].idle;
+        outbound_buckets[i].idle = NULL;
+        pthread_mutex_unlock(&outbound_buckets[i].mutex);
+
+        while (conn != NULL) {
+            OutboundConnection *next = conn->next;
+            close(conn->sd);
+            free(conn);
+            conn = next;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * File: outbound.h
+ * Authors: 100451339 & 100451170
+ */
+
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define OUTBOUND_BUCKETS 256        // Buckets of the pool (power of two)
+#define OUTBOUND_MAX_IDLE 4         // Idle connections kept per listener
+#define OUTBOUND_TIMEOUT_MS 1000    // Longest a connect or a send to a listener may block
+
+// Idle connection to the listener of a client, waiting to be reused
+typedef struct OutboundConnection
+{
+    int sd;                                 // Connected socket
+    char ip[16];                            // IP address of the listener
+    char port[6];                           // Port of the listener
+    struct OutboundConnection *next;        // Next idle connection of the bucket
+} OutboundConnection;
+
+// Bucket of the pool: idle connections whose (ip, port) hash to it
+typedef struct
+{
+    pthread_mutex_t mutex;                  // Mutex protecting the bucket
+    OutboundConnection *idle;               // Idle connections, most recently used first
+} OutboundBucket;
+
+/**
+ * @brief Connect a new socket to the listener of a client. The connect and every send on the socket fail after
+ * OUTBOUND_TIMEOUT_MS, so a listener that does not accept or does not read cannot hold the caller.
+ * @return the socket, or -1 if the connection failed
+ */
+int outbound_connect(const char *ip, const char *port);
+
+/**
+ * @brief Send data to the listener of a client over a pooled connection, opening one if none is idle.
+ * A pooled connection that turns out to be broken is closed and the data is sent again over a new one. A send that
+ * times out (the listener does not read) fails at once, and its connection is closed.
+ * Success only means that the socket took the data: the listener does not acknowledge what it reads, so a
+ * listener that closes the connection meanwhile loses it. The deliveries are at-most-once.
+ * @return 0 -> Success, -1 -> Error
+ */
+int outbound_send(const char *ip, const char *port, char *data, size_t len);
+
+/**
+ * @brief Close the idle connections to a listener (the client disconnected or its listener changed).
+ */
+void outbound_invalidate(const char *ip, const char *port);
+
+/**
+ * @brief Close every idle connection of the pool.
+ */
+void outbound_destroy();
+
+#endif
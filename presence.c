@@ -0,0 +1,363 @@
+/*
+ * File: presence.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "presence.h"
+
+#define PRESENCE_MIN_CAPACITY 256       // Slots of the smallest table
+#define PRESENCE_MIN_DEAD 64            // Unregistered records after which an unregister may compact the table
+
+PresenceTable *presence_table = NULL;                           // Current table (atomic pointer)
+size_t presence_dead = 0;                                       // Unregistered records of the current table (atomic)
+pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;     // Serializes the inserts and the rebuilds (not the readers)
+unsigned long presence_epoch = 0;                               // Incremented by every rebuild (atomic)
+unsigned long presence_readers[2] = {0, 0};                     // Readers inside, by the parity of the epoch they entered in
+
+/**
+ * @brief Enter a read section: the tables and records seen inside it are not freed until it is left.
+ * @return the epoch to give to read_exit()
+ */
+unsigned long read_enter() {
+    for (;;) {
+        unsigned long epoch = __atomic_load_n(&presence_epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&presence_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        // A rebuild that started meanwhile may not be waiting for this counter: enter again with the new epoch
+        if (__atomic_load_n(&presence_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return epoch;
+        }
+        __atomic_fetch_sub(&presence_readers[epoch & 1], 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Leave a read section.
+ */
+void read_exit(unsigned long epoch) {
+    __atomic_fetch_sub(&presence_readers[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Wait until every read section that may have seen what was unpublished before the call has been left.
+ * The presence mutex must be locked, and the calling thread must not be inside a read section.
+ */
+void wait_for_readers() {
+    unsigned long epoch = __atomic_load_n(&presence_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&presence_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    // Readers are short and never wait for a writer, and new readers count in the other counter
+    while (__atomic_load_n(&presence_readers[epoch & 1], __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Copy the status fields of a record, retrying while a writer is changing them.
+ */
+PresenceRecord read_record(PresenceRecord *record) {
+    PresenceRecord copy;
+    unsigned int seq;
+    for (;;) {
+        seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();          // A writer is in the middle of an update: it only takes a few stores
+            continue;
+        }
+        copy.status = record->status;
+        memcpy(copy.ip, record->ip, sizeof(copy.ip));
+        memcpy(copy.port, record->port, sizeof(copy.port));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq) {
+            return copy;
+        }
+    }
+}
+
+/**
+ * @brief Write the status fields of a record. Only one thread writes a given record at a time.
+ */
+void write_record(PresenceRecord *record, uint8_t status, char *ip, char *port) {
+    unsigned int seq = record->seq;
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->status = status;
+    if (ip != NULL) {
+        strncpy(record->ip, ip, sizeof(record->ip) - 1);
+        record->ip[sizeof(record->ip) - 1] = '\0';
+    }
+    if (port != NULL) {
+        strncpy(record->port, port, sizeof(record->port) - 1);
+        record->port[sizeof(record->port) - 1] = '\0';
+    }
+    __atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Find the record of an alias in a table without locks (inside a read section).
+ * @return NULL if the alias has no record. Otherwise, return a pointer to the record.
+ */
+PresenceRecord *find_record(PresenceTable *table, const char *alias, uint64_t hash) {
+    if (table == NULL) {
+        return NULL;
+    }
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        PresenceRecord *record = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+        if (record == NULL) {
+            return NULL;
+        }
+        if (record->hash == hash && strcmp(record->alias, alias) == 0) {
+            return record;
+        }
+    }
+}
+
+/**
+ * @brief Put a record in the first empty slot of its probe sequence.
+ */
+void place_record(PresenceTable *table, PresenceRecord *record) {
+    size_t mask = table->capacity - 1;
+    size_t i = record->hash & mask;
+    while (table->slots[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    __atomic_store_n(&table->slots[i], record, __ATOMIC_RELEASE);
+    table->count++;
+}
+
+/**
+ * @brief Replace the table by a copy without the unregistered records, with room for extra more records, and free
+ * the old table and the dropped records once no reader can see them. The presence mutex must be locked.
+ * An unregistered record cannot be registered again meanwhile: that takes the mutex (see presence_set()).
+ * @return 0 -> Success, -1 -> Error (no memory, the table is kept)
+ */
+int rebuild_table(size_t extra) {
+    PresenceTable *table = presence_table;
+    size_t count = table == NULL ? 0 : table->count;
+    size_t live = 0;
+    for (size_t i = 0; table != NULL && i < table->capacity; i++) {
+        live += table->slots[i] != NULL && read_record(table->slots[i]).status != PRESENCE_UNREGISTERED;
+    }
+
+    size_t capacity = PRESENCE_MIN_CAPACITY;
+    while ((live + extra) * 4 > capacity * 3) {
+        capacity *= 2;
+    }
+    PresenceTable *new_table = (PresenceTable *)calloc(1, sizeof(PresenceTable) + capacity * sizeof(PresenceRecord *));
+    // Records unregistered during the copy are dropped too, so any of them may be
+    PresenceRecord **dropped = (PresenceRecord **)malloc((count + 1) * sizeof(PresenceRecord *));
+    if (new_table == NULL || dropped == NULL) {
+        free(new_table);
+        free(dropped);
+        return -1;
+    }
+    new_table->capacity = capacity;
+
+    size_t num_dropped = 0;
+    for (size_t i = 0; table != NULL && i < table->capacity; i++) {
+        PresenceRecord *record = table->slots[i];
+        if (record == NULL) {
+            continue;
+        }
+        if (read_record(record).status != PRESENCE_UNREGISTERED) {
+            place_record(new_table, record);
+        } else {
+            dropped[num_dropped++] = record;
+        }
+    }
+    __atomic_store_n(&presence_table, new_table, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&presence_dead, num_dropped, __ATOMIC_RELAXED);
+
+    // * Readers that loaded the old table may still be walking it or reading the dropped records
+    if (table != NULL) {
+        wait_for_readers();
+        for (size_t i = 0; i < num_dropped; i++) {
+            free(dropped[i]);
+        }
+        free(table);
+    }
+    free(dropped);
+    return 0;
+}
+
+/**
+ * @brief Make room for one more record, rebuilding the table when it is 3/4 full (twice as large, unless
+ * enough of its records are unregistered). The presence mutex must be locked.
+ * @return 0 -> Success, -1 -> Error (no memory)
+ */
+int reserve_record(void) {
+    PresenceTable *table = presence_table;
+    if (table != NULL && (table->count + 1) * 4 <= table->capacity * 3) {
+        return 0;
+    }
+    return rebuild_table(1);
+}
+
+/**
+ * @brief Write the status of a record of the current table, counting the records that become unregistered.
+ */
+void set_status(PresenceRecord *record, uint8_t status, char *ip, char *port) {
+    // Counted before a rebuild can see the status, so the count never goes below the records it drops
+    if (status == PRESENCE_UNREGISTERED && record->status != PRESENCE_UNREGISTERED) {
+        __atomic_fetch_add(&presence_dead, 1, __ATOMIC_RELAXED);
+    }
+    write_record(record, status, ip, port);
+}
+
+/**
+ * @brief Set the presence of an alias, creating its record if needed.
+ * The caller must hold the lock of the shard of the alias, so each record has a single writer.
+ * A record stays in the table while its alias is unregistered, so registering it again is cheap, until enough
+ * records are unregistered to compact the table: then they are dropped and freed.
+ * @return 0 -> Success, -1 -> Error (no memory)
+ */
+int presence_set(char *alias, uint8_t status, char *ip, char *port) {
+    uint64_t hash = hash_alias(alias);
+
+    // * A registered alias has a record that no rebuild drops, and only this thread writes it
+    unsigned long epoch = read_enter();
+    PresenceTable *table = __atomic_load_n(&presence_table, __ATOMIC_ACQUIRE);
+    PresenceRecord *record = find_record(table, alias, hash);
+    if (record != NULL && record->status != PRESENCE_UNREGISTERED) {
+        set_status(record, status, ip, port);
+        size_t dead = __atomic_load_n(&presence_dead, __ATOMIC_RELAXED);
+        int compact = status == PRESENCE_UNREGISTERED && dead >= PRESENCE_MIN_DEAD && dead * 2 >= table->count;
+        read_exit(epoch);
+
+        // * Half of the records are unregistered: drop them, so walking the table costs the registered users
+        if (compact) {
+            pthread_mutex_lock(&presence_mutex);
+            dead = __atomic_load_n(&presence_dead, __ATOMIC_RELAXED);
+            if (dead >= PRESENCE_MIN_DEAD && dead * 2 >= presence_table->count) {
+                rebuild_table(0);
+            }
+            pthread_mutex_unlock(&presence_mutex);
+        }
+        return 0;
+    }
+    read_exit(epoch);
+    if (status == PRESENCE_UNREGISTERED) {
+        return 0;
+    }
+
+    // * The record is registered again or created under the mutex: no rebuild can drop it meanwhile, and users of
+    // other shards may be inserted at the same time
+    pthread_mutex_lock(&presence_mutex);
+    record = find_record(presence_table, alias, hash);
+    if (record != NULL) {
+        write_record(record, status, ip, port);
+        __atomic_fetch_sub(&presence_dead, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&presence_mutex);
+        return 0;
+    }
+    if (reserve_record() != 0) {
+        pthread_mutex_unlock(&presence_mutex);
+        return -1;
+    }
+    size_t length = strnlen(alias, 255);
+    record = (PresenceRecord *)calloc(1, sizeof(PresenceRecord) + length + 1);
+    if (record == NULL) {
+        pthread_mutex_unlock(&presence_mutex);
+        return -1;
+    }
+    record->hash = hash;
+    memcpy(record->alias, alias, length);
+    record->alias[length] = '\0';
+    write_record(record, status, ip, port);
+    place_record(presence_table, record);
+    pthread_mutex_unlock(&presence_mutex);
+    return 0;
+}
+
+/**
+ * @brief Get the connection status of an alias. It never blocks and never fails because of concurrent writers.
+ * @return ConnectionStatus with error_code: 0 -> Connected (ip and port filled), 1 -> User not found, 2 -> User not connected
+ */
+ConnectionStatus presence_get(char *alias) {
+    ConnectionStatus result;
+    result.error_code = 0;
+
+    unsigned long epoch = read_enter();
+    PresenceRecord *record = find_record(__atomic_load_n(&presence_table, __ATOMIC_ACQUIRE), alias, hash_alias(alias));
+    PresenceRecord copy;
+    copy.status = PRESENCE_UNREGISTERED;
+    if (record != NULL) {
+        copy = read_record(record);
+    }
+    read_exit(epoch);
+
+    if (copy.status == PRESENCE_UNREGISTERED) {
+        result.error_code = 1;
+        return result;
+    }
+    if (copy.status == PRESENCE_DISCONNECTED) {
+        result.error_code = 2;
+        return result;
+    }
+    memcpy(result.ip, copy.ip, sizeof(result.ip));
+    memcpy(result.port, copy.port, sizeof(result.port));
+    return result;
+}
+
+/**
+ * @brief Get the connected users, if the user with the given alias is connected. It never blocks writers.
+ * Each status is read atomically, but the list is not a snapshot of all the users at a single instant.
+ * @return ConnectedUsers struct with error_code: 0 -> Success, 1 -> User not connected, 2 -> User not found, 3 -> Error
+ */
+ConnectedUsers presence_connected_users(char *alias) {
+    ConnectedUsers result;
+    memset(&result, 0, sizeof(result));
+
+    ConnectionStatus status = presence_get(alias);
+    if (status.error_code != 0) {
+        result.error_code = status.error_code == 1 ? 2 : 1;
+        return result;
+    }
+
+    unsigned long epoch = read_enter();
+    PresenceTable *table = __atomic_load_n(&presence_table, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; table != NULL && i < table->capacity; i++) {
+        PresenceRecord *record = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+        if (record != NULL && read_record(record).status == PRESENCE_CONNECTED) {
+            if (append_connected_user(&result, record->alias)) {
+                read_exit(epoch);
+                free(result.aliases);
+                memset(&result, 0, sizeof(result));
+                result.error_code = 3;
+                return result;
+            }
+        }
+    }
+    read_exit(epoch);
+    return result;
+}
+
+/**
+ * @brief Mark every alias as unregistered and free the records. The caller must hold the locks of all the shards.
+ */
+void presence_clear() {
+    pthread_mutex_lock(&presence_mutex);
+    PresenceTable *table = presence_table;
+    for (size_t i = 0; table != NULL && i < table->capacity; i++) {
+        if (table->slots[i] != NULL) {
+            set_status(table->slots[i], PRESENCE_UNREGISTERED, NULL, NULL);
+        }
+    }
+    rebuild_table(0);
+    pthread_mutex_unlock(&presence_mutex);
+}
+
+/**
+ * @brief Free the presence directory. No other thread may use it.
+ */
+void presence_destroy() {
+    PresenceTable *table = presence_table;
+    presence_table = NULL;
+    presence_dead = 0;
+    for (size_t i = 0; table != NULL && i < table->capacity; i++) {
+        free(table->slots[i]);
+    }
+    free(table);
+}
@@ -0,0 +1,74 @@
+/*
+ * File: presence.h
+ * Authors: 100451339 & 100451170
+ */
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "LinkedList.h"
+
+// Status of a user in the presence directory
+#define PRESENCE_DISCONNECTED 0     // Registered and disconnected
+#define PRESENCE_CONNECTED 1        // Registered and connected
+#define PRESENCE_UNREGISTERED 2     // Not registered (any more)
+
+// Presence of an alias: a copy of the fields read by CONNECTEDUSERS and by the deliveries of messages
+// An unregistered alias keeps its record (reused if it registers again) until the table is compacted. Readers use
+// the records without locks inside read sections, which a compaction waits for before freeing the records it
+// dropped. The status fields are protected by a sequence lock.
+typedef struct
+{
+    unsigned int seq;               // Sequence lock: odd while the fields are being written
+    uint8_t status;                 // PRESENCE_DISCONNECTED, PRESENCE_CONNECTED or PRESENCE_UNREGISTERED
+    char ip[16];                    // IP address of the user
+    char port[6];                   // Port of the user
+    uint64_t hash;                  // Hash of the alias
+    char alias[];                   // Alias of the user (never modified)
+} PresenceRecord;
+
+// Open-addressing table of presence records. Records are only inserted: a full table, or one where half of the
+// records are unregistered, is replaced by a copy with only the registered records, sized for them. The old table
+// is freed once the readers that may be walking it have left their read sections.
+typedef struct PresenceTable
+{
+    size_t capacity;                        // Number of slots (power of two)
+    size_t count;                           // Number of records
+    PresenceRecord *slots[];                // NULL -> Empty slot
+} PresenceTable;
+
+/**
+ * @brief Set the presence of an alias, creating its record if needed.
+ * The caller must hold the lock of the shard of the alias, so each record has a single writer.
+ * A record stays in the table while its alias is unregistered, so registering it again is cheap, until enough
+ * records are unregistered to compact the table: then they are dropped and freed.
+ * @return 0 -> Success, -1 -> Error (no memory)
+ */
+int presence_set(char *alias, uint8_t status, char *ip, char *port);
+
+/**
+ * @brief Get the connection status of an alias. It never blocks and never fails because of concurrent writers.
+ * @return ConnectionStatus with error_code: 0 -> Connected (ip and port filled), 1 -> User not found, 2 -> User not connected
+ */
+ConnectionStatus presence_get(char *alias);
+
+/**
+ * @brief Get the connected users, if the user with the given alias is connected. It never blocks writers.
+ * @return ConnectedUsers struct with error_code: 0 -> Success, 1 -> User not connected, 2 -> User not found, 3 -> Error
+ */
+ConnectedUsers presence_connected_users(char *alias);
+
+/**
+ * @brief Mark every alias as unregistered and free the records. The caller must hold the locks of all the shards.
+ */
+void presence_clear();
+
+/**
+ * @brief Free the presence directory. No other thread may use it.
+ */
+void presence_destroy();
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * File: protocol.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+/**
+ * @brief Select the protocol of a connection from its first byte (the v2 magic byte is consumed).
+ * @return 1 if the protocol is known, 0 if more bytes must be received
+ */
+int framing_detect(Framing *framing, LineReader *reader) {
+    if (framing->version != PROTOCOL_UNKNOWN) {
+        return 1;
+    }
+
+    char *first;
+    if (!reader_next_bytes(reader, 1, &first)) {
+        return 0;
+    }
+    if ((unsigned char)*first == PROTOCOL_V2_MAGIC) {
+        framing->version = PROTOCOL_V2;
+        reader_release(reader);
+    } else {
+        // Text clients start with the name of the operation: the byte is part of it
+        framing->version = PROTOCOL_TEXT;
+        reader_rewind(reader);
+    }
+    return 1;
+}
+
+/**
+ * @brief Read a whole v2 request. The fields are '\0' terminated in place (no copies).
+ * @param fields pointers to the fields, up to max_fields
+ * @param num_fields number of fields of the request
+ * @return 1 -> Complete request, 0 -> More bytes must be received, -1 -> Invalid request
+ */
+int v2_read_request(Framing *framing, LineReader *reader, char **fields, int max_fields, int *num_fields) {
+    char *header;
+    char *payload;
+    uint32_t request_id;
+    uint32_t length;
+
+    if (!reader_next_bytes(reader, V2_HEADER_SIZE, &header)) {
+        reader_rewind(reader);
+        return 0;
+    }
+    memcpy(&request_id, header + 1, sizeof(request_id));
+    memcpy(&length, header + 5, sizeof(length));
+    length = ntohl(length);
+    if (length > V2_MAX_PAYLOAD) {
+        return -1;
+    }
+    if (!reader_next_bytes(reader, length, &payload)) {
+        reader_rewind(reader);
+        return 0;
+    }
+
+    framing->opcode = (unsigned char)header[0] < 128 ? (int8_t)header[0] : -1;
+    framing->request_id = ntohl(request_id);
+
+    // * Each field is moved 2 bytes back, over its length, which leaves room for its '\0'
+    uint32_t position = 0;
+    int count = 0;
+    while (position < length) {
+        uint16_t field_length;
+        if (count == max_fields || length - position < sizeof(field_length)) {
+            return -1;
+        }
+        memcpy(&field_length, payload + position, sizeof(field_length));
+        field_length = ntohs(field_length);
+        position += sizeof(field_length);
+        if (field_length > length - position) {
+            return -1;
+        }
+
+        char *field = payload + position - sizeof(field_length);
+        memmove(field, payload + position, field_length);
+        field[field_length] = '\0';
+        fields[count++] = field;
+        position += field_length;
+    }
+
+    *num_fields = count;
+    return 1;
+}
+
+/**
+ * @brief Start the reply of the request being served.
+ */
+void reply_begin(Framing *framing, LineWriter *reply) {
+    framing->reply_open = 1;
+    if (framing->version != PROTOCOL_V2) {
+        return;
+    }
+
+    // The length is written by reply_end(), when the payload is known
+    char header[V2_HEADER_SIZE] = {0};
+    uint32_t request_id = htonl(framing->request_id);
+    header[0] = framing->opcode;
+    memcpy(header + 1, &request_id, sizeof(request_id));
+    framing->reply_header = reply->len;
+    writer_append(reply, header, sizeof(header));
+}
+
+/**
+ * @brief Append the error code of the reply.
+ */
+void reply_status(Framing *framing, LineWriter *reply, uint8_t error_code) {
+    (void)framing;
+    writer_append(reply, &error_code, sizeof(error_code));
+}
+
+/**
+ * @brief Append a string to the reply.
+ */
+void reply_string(Framing *framing, LineWriter *reply, const char *string) {
+    if (framing->version != PROTOCOL_V2) {
+        writer_append_string(reply, string);
+        return;
+    }
+    size_t length = strnlen(string, UINT16_MAX);
+    uint16_t field_length = htons((uint16_t)length);
+    writer_append(reply, &field_length, sizeof(field_length));
+    writer_append(reply, string, length);
+}
+
+/**
+ * @brief Append count strings, stored one after another with their '\0', to the reply.
+ */
+void reply_strings(Framing *framing, LineWriter *reply, const char *strings, size_t len, unsigned int count) {
+    if (framing->version != PROTOCOL_V2) {
+        // Already in the text format: a single copy
+        writer_append(reply, strings, len);
+        return;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        reply_string(framing, reply, strings);
+        strings += strlen(strings) + 1;
+    }
+}
+
+/**
+ * @brief Append a number to the reply (decimal text in the text protocol).
+ */
+void reply_uint(Framing *framing, LineWriter *reply, uint32_t value) {
+    if (framing->version != PROTOCOL_V2) {
+        char text[11];
+        sprintf(text, "%u", value);
+        writer_append_string(reply, text);
+        return;
+    }
+    uint32_t number = htonl(value);
+    writer_append(reply, &number, sizeof(number));
+}
+
+/**
+ * @brief End the reply: in v2, its length is written in its header. Nothing is done if no reply is open.
+ */
+void reply_end(Framing *framing, LineWriter *reply) {
+    if (!framing->reply_open) {
+        return;
+    }
+    framing->reply_open = 0;
+    if (framing->version != PROTOCOL_V2) {
+        return;
+    }
+    uint32_t length = htonl((uint32_t)(reply->len - framing->reply_header - V2_HEADER_SIZE));
+    memcpy(reply->data + framing->reply_header + 5, &length, sizeof(length));
+}
@@ -0,0 +1,87 @@
+/*
+ * File: protocol.h
+ * Authors: 100451339 & 100451170
+ *
+ * Framing of the requests and replies of a client connection. A connection uses the text protocol
+ * ('\0' terminated fields) unless its first byte is PROTOCOL_V2_MAGIC, which selects protocol v2:
+ *
+ *   request:  opcode (1 byte) | request id (4 bytes) | payload length (4 bytes) | payload
+ *   reply:    opcode (1 byte) | request id (4 bytes) | payload length (4 bytes) | payload
+ *
+ * The opcode is the index of the operation in OPERATION_NAMES. A request payload is a sequence of
+ * fields, each one a 2-byte length followed by its bytes. A reply payload starts with the error code
+ * (1 byte), followed by the results: numbers as 4-byte integers and strings as length-prefixed fields.
+ * Every integer is in network byte order.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "lines.h"
+
+#define PROTOCOL_UNKNOWN 0          // The first byte of the connection has not been received yet
+#define PROTOCOL_TEXT 1             // '\0' terminated fields (legacy)
+#define PROTOCOL_V2 2               // Fixed header and length-prefixed fields
+
+#define PROTOCOL_V2_MAGIC 0xB2      // First byte of a connection that uses protocol v2
+#define V2_HEADER_SIZE 9            // Bytes of the header of a v2 frame
+#define V2_MAX_PAYLOAD (READER_BUFFER_SIZE - V2_HEADER_SIZE)    // A whole frame must fit in the reader
+
+// Framing state of a connection and of the request being served
+typedef struct
+{
+    int version;                    // PROTOCOL_UNKNOWN, PROTOCOL_TEXT or PROTOCOL_V2
+    int8_t opcode;                  // Operation of the request being served
+    uint32_t request_id;            // Request id of the request being served (v2), echoed in its reply
+    size_t reply_header;            // Offset of the header of the reply in the writer (v2)
+    int reply_open;                 // 1 -> reply_begin() has been called and reply_end() has not
+} Framing;
+
+/**
+ * @brief Select the protocol of a connection from its first byte (the v2 magic byte is consumed).
+ * @return 1 if the protocol is known, 0 if more bytes must be received
+ */
+int framing_detect(Framing *framing, LineReader *reader);
+
+/**
+ * @brief Read a whole v2 request. The fields are '\0' terminated in place (no copies).
+ * @param fields pointers to the fields, up to max_fields
+ * @param num_fields number of fields of the request
+ * @return 1 -> Complete request, 0 -> More bytes must be received, -1 -> Invalid request
+ */
+int v2_read_request(Framing *framing, LineReader *reader, char **fields, int max_fields, int *num_fields);
+
+/**
+ * @brief Start the reply of the request being served.
+ */
+void reply_begin(Framing *framing, LineWriter *reply);
+
+/**
+ * @brief Append the error code of the reply.
+ */
+void reply_status(Framing *framing, LineWriter *reply, uint8_t error_code);
+
+/**
+ * @brief Append a string to the reply.
+ */
+void reply_string(Framing *framing, LineWriter *reply, const char *string);
+
+/**
+ * @brief Append count strings, stored one after another with their '\0', to the reply.
+ */
+void reply_strings(Framing *framing, LineWriter *reply, const char *strings, size_t len, unsigned int count);
+
+/**
+ * @brief Append a number to the reply (decimal text in the text protocol).
+ */
+void reply_uint(Framing *framing, LineWriter *reply, uint32_t value);
+
+/**
+ * @brief End the reply: in v2, its length is written in its header. Nothing is done if no reply is open.
+ */
+void reply_end(Framing *framing, LineWriter *reply);
+
+#endif
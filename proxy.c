@@ -13,28 +13,172 @@
 #include <stdlib.h>     /* For exit */
 #include <signal.h>     /* For signal */
 #include <string.h>     /* For strlen, strcpy, sprintf */
-#include <unistd.h>     /* For getpid */
+#include <unistd.h>     /* For getpid, getopt */
+#include <errno.h>      /* For errno */
+#include <sys/epoll.h>  /* For epoll_create1(), epoll_ctl() and epoll_wait() */
+#include <poll.h>       /* For poll */
+#include <sys/time.h>   /* For struct timeval */
+#include <time.h>       /* For clock_gettime */
 
 #include "request.h"  /* For request struct */
 #include "servidor.h" /* For server functions */
 #include "lines.h"    /* For reading the lines send from a socket */
+#include "queue.h"    /* For the queue of accepted clients */
+#include "outbound.h" /* For the pooled connections to the clients */
+#include "delivery.h" /* For the queues of messages waiting to be delivered */
+#include "ack.h"      /* For the ACKs coalesced per sender */
+#include "wal.h"      /* For the write-ahead log of the registry */
+#include "spill.h"    /* For the mailboxes that overflow to disk */
+#include "quota.h"    /* For the limits of the mailboxes */
+#include "stats.h"    /* For the counters and latencies of the requests */
+#include "lockstats.h" /* For the wait and hold times of the locks of the registry */
+#include "logger.h"    /* For the log of the requests, written by its own thread */
+#include "util.h"      /* For the monotonic clock */
 
 #define MAX_LINE 256
+#define MAX_EVENTS 64       // Maximum number of events returned by a single epoll_wait()
+#define DEFAULT_WORKERS 8   // Number of worker threads when -w is not given
+#define MAX_WORKERS 1024    // Maximum number of worker threads
+#define QUEUE_PER_WORKER 64 // Accepted clients that can wait in the queue per worker
+#define DEFAULT_IDLE_TIMEOUT 30 // Seconds a session may stay idle when -t is not given
+#define FLUSH_BATCH_MESSAGES 256    // Pending messages sent with one write on CONNECT
+#define FLUSH_BATCH_BYTES 65536     // Bytes after which a batch of pending messages is sent
+#define FLUSH_CONNECT_RETRIES 6     // Retries of a batch while the client starts listening
+#define FLUSH_RETRY_DELAY_US 20000  // Delay before the first retry, doubled after each one
+#define PIPELINE_MAX_INFLIGHT 128   // Requests of a v2 session that may be executing at the same time
+#define PIPELINE_QUEUE_SIZE 4096    // Pipelined requests that can wait for a pipeline worker
+#define DEFAULT_SNAPSHOT_INTERVAL 300   // Seconds between two snapshots of the registry when -s is not given
+
+// Enum to identify how the server dispatches the requests
+typedef enum
+{
+    MODE_THREADS = 0,       // Fixed pool of worker threads (default)
+    MODE_EPOLL = 1          // Single-threaded non-blocking epoll reactor
+} SERVER_MODE;
+
+SERVER_MODE server_mode = MODE_THREADS;
+int num_workers = DEFAULT_WORKERS;
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;   // 0 -> one request per connection
+char *wal_path = NULL;                      // Write-ahead log of the registry, NULL -> Nothing survives a restart
+WAL_MODE wal_durability = WAL_BATCHED;
+int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;  // 0 -> No snapshots: the whole log is replayed
+char *spill_directory = DEFAULT_SPILL_DIRECTORY;    // Directory of the mailboxes that overflow to disk
+unsigned long spill_memory_mb = DEFAULT_SPILL_MEMORY_MB;
+unsigned int spill_user_messages = DEFAULT_SPILL_USER_MESSAGES;
+unsigned int quota_messages = DEFAULT_QUOTA_MESSAGES;           // 0 -> No limit of messages per recipient
+unsigned long quota_kb = DEFAULT_QUOTA_KB;                      // 0 -> No limit of bytes per recipient
+unsigned long quota_global_mb = DEFAULT_QUOTA_GLOBAL_MB;        // 0 -> No limit of bytes over all the mailboxes
+char *lock_stats_path = NULL;                   // JSON file of the times of the locks, NULL -> Only displayed
+LOG_LEVEL log_level = LOG_DEBUG;                // Lowest level of the lines logged (debug -> every request)
+
+// ! Queue of accepted clients waiting for a worker
+Queue client_queue;
+
+// ! Queue of pipelined requests waiting for a pipeline worker
+Queue pipeline_queue;
+
+// Session of a v2 client whose requests are executed by the pipeline workers
+typedef struct
+{
+    int socket;                     // Socket descriptor of the client
+    pthread_mutex_t write_mutex;    // Serialises the replies, which are written as their requests complete
+    pthread_mutex_t mutex;          // Protects inflight and failed
+    pthread_cond_t done;            // Signaled when a request of the session completes
+    int inflight;                   // Requests dispatched and not completed yet
+    int failed;                     // 1 -> A reply could not be written
+} Session;
+
+// Request copied out of the reader of its session, so the reader can go on with the next requests
+typedef struct
+{
+    Session *session;               // Session of the request
+    Request request;                // Request, with its parameters pointing into fields
+    char fields[];                  // Parameters of the request, one after another with their '\0'
+} PipelinedRequest;
+
+/**
+ * @brief Display the messages waiting in the mailboxes and the largest mailboxes
+ */
+void display_mailbox_stats()
+{
+    MailboxUsage hot[HOT_MAILBOXES];
+    int count = list_hot_mailboxes(hot, HOT_MAILBOXES);
+    display_quota_stats(hot, count);
+}
 
-// ! Mutex & Condition variables
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-int busy = true;
+// ! Pipe written by the stop handler and watched by the main thread, which stops the server
+// Stopping joins threads and takes locks, which a signal handler must not do
+int stop_pipe[2] = {-1, -1};
 
 // ! Signal handler
-// Using a signal handler to stop the server, forced to declare and use signum to avoid warnings
+// Ask the main thread to stop the server (Ctrl+C), forced to declare and use signum to avoid warnings
 void stopServer(int signum)
 {
-    printf("\n\nClosing the server and deleting the users list...\n\n");
+    (void)signum;
+    int saved_errno = errno;
 
-    request_delete_list();
+    char byte = 1;
+    ssize_t written = write(stop_pipe[1], &byte, 1);
+    (void)written;
+
+    errno = saved_errno;
+}
+
+// ! Pipe written by the statistics handler and read by the statistics thread
+// A signal handler may only call async-signal-safe functions, so the statistics are never displayed from it
+int stats_pipe[2] = {-1, -1};
+
+// ! Statistics handler
+// Ask the statistics thread to display the statistics of the server without stopping it (kill -USR1 <pid>)
+void dumpStats(int signum)
+{
+    (void)signum;
+    int saved_errno = errno;
+
+    // * The write end is non-blocking: if the pipe is full, a display is already pending
+    char byte = 1;
+    ssize_t written = write(stats_pipe[1], &byte, 1);
+    (void)written;
+
+    errno = saved_errno;
+}
+
+/**
+ * @brief Statistics thread: display the statistics each time the statistics handler asks for them,
+ * until the main thread writes a 0 to the pipe
+ *
+ * @param arg (unused)
+ * @return NULL
+ */
+void *stats_thread(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        // * Several signals received while displaying are answered with a single display
+        char bytes[64];
+        ssize_t received = read(stats_pipe[0], bytes, sizeof(bytes));
+        if (received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0 || memchr(bytes, 0, received) != NULL)
+        {
+            break;
+        }
+
+        display_delivery_stats();
+        display_slab_stats();
+        display_wal_stats();
+        display_spill_stats();
+        display_mailbox_stats();
+        display_logger_stats();
+        lock_stats_dump(lock_stats_path);
+        fflush(stdout);
+    }
 
-    exit(signum);
+    return NULL;
 }
 
 int validate_port(char *port_str) {
@@ -60,21 +204,178 @@ int validate_port(char *port_str) {
 }
 
 /**
- * @brief Get the port number from the user
+ * @brief Get the port number, the dispatch mode, the number of workers, the session idle timeout,
+ * the use of huge pages, the write-ahead log, the snapshots, the memory of the mailboxes, the file of the times
+ * of the locks and the level of the log from the user
+ * Usage: servidor -p <port> [-w <workers>] [-m threads|epoll] [-t <idle seconds>] [-H]
+ *                 [-l <log> [-d none|batched|per-op] [-s <snapshot seconds>]]
+ *                 [-M <mailbox MiB>] [-N <messages per mailbox>] [-S <spill directory>]
+ *                 [-q <messages per recipient>] [-Q <KiB per recipient>] [-G <MiB of all mailboxes>]
+ *                 [-L <lock stats file>] [-v debug|info|warn|error]
  *
  * @param argc
  * @param argv
  * @return int
  */
-int process_port(int argc, char *argv[])
+int process_arguments(int argc, char *argv[])
 {
-    if (argc != 3)
+    int port = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:w:m:t:Hl:d:s:M:N:S:q:Q:G:L:v:")) != -1)
     {
-        printf("Usage: %s -p <port>\n", argv[0]);
-        exit(1);
+        switch (opt)
+        {
+        case 'p':
+            port = validate_port(optarg);
+            break;
+        case 'w':
+        {
+            char *end;
+            num_workers = (int)strtol(optarg, &end, 10);
+            if (*end != '\0' || num_workers < 1 || num_workers > MAX_WORKERS)
+            {
+                printf("Invalid number of workers: %s (expected 1-%d)\n", optarg, MAX_WORKERS);
+                exit(1);
+            }
+            break;
+        }
+        case 't':
+        {
+            char *end;
+            idle_timeout = (int)strtol(optarg, &end, 10);
+            if (*end != '\0' || idle_timeout < 0)
+            {
+                printf("Invalid idle timeout: %s (expected seconds, 0 disables sessions)\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case 'H':
+            slab_set_huge_pages(true);
+            break;
+        case 'l':
+            wal_path = optarg;
+            break;
+        case 'd':
+        {
+            int mode = wal_parse_mode(optarg);
+            if (mode == -1)
+            {
+                printf("Invalid durability: %s (expected none, batched or per-op)\n", optarg);
+                exit(1);
+            }
+            wal_durability = (WAL_MODE)mode;
+            break;
+        }
+        case 's':
+        {
+            char *end;
+            snapshot_interval = (int)strtol(optarg, &end, 10);
+            if (*end != '\0' || snapshot_interval < 0)
+            {
+                printf("Invalid snapshot interval: %s (expected seconds, 0 disables snapshots)\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case 'M':
+        {
+            char *end;
+            spill_memory_mb = strtoul(optarg, &end, 10);
+            if (*end != '\0' || optarg[0] == '-')
+            {
+                printf("Invalid mailbox memory: %s (expected MiB)\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case 'N':
+        {
+            char *end;
+            long messages = strtol(optarg, &end, 10);
+            if (*end != '\0' || messages < 1 || messages > UINT32_MAX)
+            {
+                printf("Invalid messages per mailbox: %s (expected at least 1)\n", optarg);
+                exit(1);
+            }
+            spill_user_messages = (unsigned int)messages;
+            break;
+        }
+        case 'S':
+            spill_directory = optarg;
+            break;
+        case 'q':
+        case 'Q':
+        case 'G':
+        {
+            // Limits of the mailboxes: 0 -> No limit
+            char *end;
+            unsigned long limit = strtoul(optarg, &end, 10);
+            if (*end != '\0' || optarg[0] == '-' || (opt == 'q' && limit > UINT32_MAX))
+            {
+                printf("Invalid mailbox limit: -%c %s (expected a number, 0 -> no limit)\n", opt, optarg);
+                exit(1);
+            }
+            if (opt == 'q')
+            {
+                quota_messages = (unsigned int)limit;
+            }
+            else if (opt == 'Q')
+            {
+                quota_kb = limit;
+            }
+            else
+            {
+                quota_global_mb = limit;
+            }
+            break;
+        }
+        case 'L':
+            lock_stats_path = optarg;
+            if (!lock_stats_enabled())
+            {
+                printf("Warning: the times of the locks are not measured (build with make proxy LOCK_STATS=1)\n");
+            }
+            break;
+        case 'v':
+        {
+            int level = logger_parse_level(optarg);
+            if (level == -1)
+            {
+                printf("Invalid log level: %s (expected debug, info, warn or error)\n", optarg);
+                exit(1);
+            }
+            log_level = (LOG_LEVEL)level;
+            break;
+        }
+        case 'm':
+            if (strcmp(optarg, "threads") == 0)
+            {
+                server_mode = MODE_THREADS;
+            }
+            else if (strcmp(optarg, "epoll") == 0)
+            {
+                server_mode = MODE_EPOLL;
+            }
+            else
+            {
+                printf("Invalid mode: %s (expected threads or epoll)\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            port = -1;
+            optind = argc;
+            break;
+        }
     }
 
-    int port = validate_port(argv[2]);
+    if (port == -1 || optind != argc)
+    {
+        printf("Usage: %s -p <port> [-w <workers>] [-m threads|epoll] [-t <idle seconds>] [-H] [-l <log> [-d none|batched|per-op] [-s <snapshot seconds>]] [-M <mailbox MiB>] [-N <messages per mailbox>] [-S <spill directory>] [-q <messages per recipient>] [-Q <KiB per recipient>] [-G <MiB of all mailboxes>] [-L <lock stats file>] [-v debug|info|warn|error]\n", argv[0]);
+        exit(1);
+    }
 
     return port;
 }
@@ -125,51 +426,6 @@ int create_socket(int port)
     return sd;
 }
 
-/**
- * @brief Create and connect the socket
- * 
- * @param ip 
- * @param port_str 
- * @return socket 
- */
-int create_and_connect_socket(char* ip, char* port_str)
-{
-    int sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sd == -1)
-    {
-        printf("Error creating socket\n");
-        exit(1);
-    }
-
-    struct sockaddr_in server_addr = {0};
-    bzero((char *)&server_addr, sizeof(server_addr));
-
-    int port = validate_port(port_str);
-    server_addr.sin_addr.s_addr = inet_addr(ip);
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-
-    if (connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
-        printf("Error connecting to the client -> IP: %s , Port: %d\n", ip, ntohs(server_addr.sin_port));
-
-    return sd;
-}
-
-char *read_string(int sd)
-{
-    char *string = malloc(MAX_LINE);
-
-    ssize_t bytes_read = readLine(sd, string, MAX_LINE);
-    if (bytes_read == -1)
-    {
-        perror("Error reading the string");
-        // TODO: Hacer un free del string (cuidao con valgrind)
-        return NULL;
-    }
-
-    return string;
-}
-
 void send_int(int sd, int int_value)
 {
     if (send(sd, &int_value, sizeof(int), 0) == -1)
@@ -179,22 +435,30 @@ void send_int(int sd, int int_value)
     }
 }
 
-void send_string(int sd, char *string)
+int send_string(int sd, char *string)
 {
     int len = strlen(string) + 1;
 
     if ((sendMessage(sd, string, len)) == -1)
     {
-        printf("Error sending string to the server\n");
-        exit(1);
+        printf("Error sending string to the client\n");
+        return -1;
     }
+
+    return 0;
 }
 
+/**
+ * @brief Get the operation code from its name
+ *
+ * @param operation_code_str
+ * @return the operation code, -1 if the operation does not exist
+ */
 int8_t get_operation_code(char *operation_code_str)
 {
     // * Get the operation code (int)
     int8_t operation_code_int = -1;
-    for (int i = 0; i < 7; i++)
+    for (int i = 0; i < NUM_OPERATIONS; i++)
     {
         if (strcmp(operation_code_str, OPERATION_NAMES[i]) == 0)
         {
@@ -206,7 +470,6 @@ int8_t get_operation_code(char *operation_code_str)
     if (operation_code_int == -1)
     {
         printf("Error: Invalid operation code\n");
-        exit(1);
     }
 
     return operation_code_int;
@@ -223,189 +486,545 @@ void send_error_code(int socket, char error_code)
 }
 
 /**
- * @brief Deal with the request
+ * @brief Truncate a field received from a client to max characters
  *
- * @param client_request
+ * @param field
+ * @param max
  */
-void deal_with_request(Request *client_request)
+void truncate_field(char *field, size_t max)
 {
-    // Parameters parameters = {0};
-
-    char operation_code_copy[256] = "";
-    int client_sd = 0;
-    char client_IP[16] = "";
-    int client_port = 0;
-    struct sockaddr_in client_addr = {0};
-    socklen_t client_addr_len = sizeof(client_addr);
+    if (strlen(field) > max)
+    {
+        field[max] = '\0';
+    }
+}
 
-    // * Lock the mutex on the process of request copying
-    pthread_mutex_lock(&mutex);
-    strcpy(operation_code_copy, client_request->operation);
-    client_sd = client_request->socket;
+/**
+ * @brief Read a whole protocol v2 request from the buffered reader (see protocol.h)
+ *
+ * @param reader
+ * @param request
+ * @return 1 -> Complete request, 0 -> More bytes must be received, -1 -> Invalid request
+ */
+int parse_request_v2(LineReader *reader, Request *request)
+{
+    int num_fields;
+    int status = v2_read_request(&request->framing, reader, request->params, MAX_PARAMS, &num_fields);
+    if (status != 1)
+    {
+        return status;
+    }
 
-    // get the client IP and port
-    getpeername(client_sd, (struct sockaddr *)&client_addr, &client_addr_len);
-    strcpy(client_IP, inet_ntoa(client_addr.sin_addr));
-    client_port = ntohs(client_addr.sin_port);
+    // * The opcode is the index of the operation: no names to compare
+    int8_t operation_code_int = request->framing.opcode;
+    if (operation_code_int < 0 || operation_code_int >= NUM_OPERATIONS || num_fields != OPERATION_PARAMS[operation_code_int])
+    {
+        return -1;
+    }
+    request->operation = OPERATION_NAMES[operation_code_int];
+    for (int i = 0; i < num_fields; i++)
+    {
+        truncate_field(request->params[i], MAX_LINE - 1);
+    }
 
-    // print the client IP and port
-    printf("IP: %s, Port: %d\n", client_IP, client_port);
+    logger_write(LOG_DEBUG, "📧 Operation -> \"%s\" (v2, request %u)\n", request->operation, request->framing.request_id);
 
-    busy = false;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
+    return 1;
+}
 
-    // * Get the operation code (int)
-    int8_t operation_code_int = get_operation_code(operation_code_copy);
+/**
+ * @brief Parse the next request from the fields buffered by the reader of the client
+ * The operation and the parameters point into the reader buffer, so they are valid until
+ * the reader receives more bytes.
+ *
+ * @param reader
+ * @param request
+ * @return 1 -> Request complete, 0 -> More bytes needed, -1 -> Invalid operation
+ */
+int parse_request(LineReader *reader, Request *request)
+{
+    size_t len;
 
-    // * Get the number of parameters
-    // int num_parameters = OPERATION_PARAMS[operation_code_int];
+    // * The first byte of the connection selects the protocol
+    if (!framing_detect(&request->framing, reader))
+    {
+        return 0;
+    }
+    if (request->framing.version == PROTOCOL_V2)
+    {
+        return parse_request_v2(reader, request);
+    }
 
-    char client_port_str[6];
-    sprintf(client_port_str, "%d", client_port);
+    if (!reader_next_field(reader, &request->operation, &len))
+    {
+        reader_rewind(reader);
+        return 0;
+    }
 
-    // * Parameter declaration
-    char port[6];               // Port of the user: 5 characters + '\0'
-    char name[256];             // Name of the user: 255 characters + '\0'
-    char alias[256];            // Alias of the user: 255 characters + '\0' <- IDENTIFIER
-    char receiver[256];             // Alias of the destination user: 255 characters + '\0'
-    char message[256];          // Message to send: 255 characters + '\0' 
-    char birth[11];             // Birth of the user: "DD/MM/AAAA" + '\0'
+    int8_t operation_code_int = get_operation_code(request->operation);
+    if (operation_code_int == -1)
+    {
+        return -1;
+    }
 
-    uint8_t error_code;
-    switch (operation_code_int)
+    for (int i = 0; i < OPERATION_PARAMS[operation_code_int]; i++)
     {
-        case REGISTER:
-            // * Read the parameters
-            strcpy(name, read_string(client_sd));
-            strcpy(alias, read_string(client_sd));
-            strcpy(birth, read_string(client_sd));
+        if (!reader_next_field(reader, &request->params[i], &len))
+        {
+            reader_rewind(reader);
+            return 0;
+        }
+    }
 
-            // * Register the user
-            error_code = list_register_user(client_IP, client_port_str, name, alias, birth);
-            // list_display_user_list();
-            
-            // * Print the terminal result
-            if (!error_code) {
-                printf("s> REGISTER %s OK\n", alias);
-            }
-            else {
-                printf("s> REGISTER %s FAIL\n", alias);
-            }
+    // * Fields are truncated once the request is complete: truncating them earlier would split them when parsing again
+    truncate_field(request->operation, MAX_LINE - 1);
+    for (int i = 0; i < OPERATION_PARAMS[operation_code_int]; i++)
+    {
+        truncate_field(request->params[i], MAX_LINE - 1);
+    }
+    request->framing.opcode = operation_code_int;
 
-            // * Send the error code to the client
-            send_error_code(client_sd, error_code);
+    logger_write(LOG_DEBUG, "📧 Operation -> \"%s\"\n", request->operation);
 
-            break;
+    return 1;
+}
 
-        case UNREGISTER:
+// Structure with everything needed to flush the pending messages of a user
+typedef struct
+{
+    char alias[256];                // Alias of the user that has just connected
+    char ip[16];                    // IP address where the user listens
+    char port[6];                   // Port where the user listens
+    MessageList *pendingMessages;   // Pending messages detached from the user (owned by the flush)
+} PendingFlush;
 
-            // * Read the parameters
-            strcpy(alias, read_string(client_sd));
-            
-            // * Unregister the user
-            error_code = list_unregister_user(alias);
-            // list_display_user_list();
+/**
+ * @brief Send data to the listener of a user that has just connected, retrying while it starts listening
+ *
+ * @return 0 -> Success, -1 -> Error
+ */
+int send_to_new_listener(char *ip, char *port, char *data, size_t len)
+{
+    for (int attempt = 0; ; attempt++)
+    {
+        if (outbound_send(ip, port, data, len) == 0)
+        {
+            return 0;
+        }
+        if (attempt == FLUSH_CONNECT_RETRIES)
+        {
+            return -1;
+        }
+        usleep(FLUSH_RETRY_DELAY_US << attempt);
+    }
+}
 
-            // * Print the terminal result
-            if (!error_code) {
-                printf("s> UNREGISTER %s OK\n", alias);
-            }
-            else {
-                printf("s> UNREGISTER %s FAIL\n", alias);
-            }
+/**
+ * @brief Drop the first count messages of a detached list, once they have been written to the receiver,
+ * and acknowledge them to their senders (the ACKs for each sender are coalesced, see ack.c)
+ *
+ * @param alias (receiver)
+ * @param messages
+ * @param count (at most FLUSH_BATCH_MESSAGES)
+ */
+void acknowledge_messages(char *alias, MessageList *messages, unsigned int count)
+{
+    Alias *source = NULL;           // Sender of the previous message, whose status is in status
+    ConnectionStatus status;
 
-            // * Send the error code to the client
-            send_error_code(client_sd, error_code);
+    // * The messages are removed (and logged as delivered) in one step, under the lock of the receiver
+    MessageEntry *delivered[FLUSH_BATCH_MESSAGES];
+    uint8_t error_code;
+    count = list_pop_delivered(alias, messages, count, delivered, &error_code);
+    if (error_code != 0)
+    {
+        // ! They were delivered, so they are still ACKed, but a restart would deliver them again
+        logger_write(LOG_ERROR, "s> Error logging the delivery of %u messages to %s\n", count, alias);
+    }
 
-            break;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        MessageEntry *current = delivered[i];
 
-        case CONNECT:
+        // * Inform the sender if it is connected (consecutive messages usually come from the same sender)
+        if (current->source != source)
+        {
+            source = current->source;
+            status = list_get_connection_status(source->str);
+        }
+        if (status.error_code == 0)
+        {
+            ack_add(status.ip, status.port, current->msgId);
+        }
 
-            // * Read the parameters
-            strcpy(alias, read_string(client_sd));
-            strcpy(port, read_string(client_sd));
+        delete_message_entry(messages, current);
+    }
+}
 
-            // * Connect the user
-            ConnectionResult conn_result = list_connect_user(client_IP, port, alias);
-            // list_display_user_list();
+/**
+ * @brief Send the pending messages to a user that has just connected and notify the senders
+ * The messages are sent in batches over one pooled connection. A message is only dropped (and ACKed) once the
+ * batch with it has been written; the messages that could not be sent are given back to the user.
+ *
+ * @param flush (PendingFlush*, freed by this function)
+ * @return NULL
+ */
+void *flush_pending_messages(void *arg)
+{
+    PendingFlush *flush = (PendingFlush *)arg;
+    MessageList *messages = flush->pendingMessages;
 
-            // * Print the terminal result
-            if (!conn_result.error_code) {
-                printf("s> CONNECT %s OK\n", alias);
-            }
-            else {
-                printf("s> CONNECT %s FAIL\n", alias);
+    while (messages->size > 0)
+    {
+        // * Build a batch with the oldest messages
+        LineWriter batch;
+        writer_init(&batch, -1);
+        unsigned int count = 0;
+        for (unsigned int num = messages->first;
+             num != messages->next && count < FLUSH_BATCH_MESSAGES && batch.len < FLUSH_BATCH_BYTES; num++)
+        {
+            MessageEntry *current = get_pending_message(messages, num);
+            if (current == NULL)
+            {
+                continue;
             }
+            char msgId[11];
+            sprintf(msgId, "%u", current->msgId);
+            writer_append_string(&batch, "SEND_MESSAGE");
+            writer_append_string(&batch, current->source->str);
+            writer_append_string(&batch, msgId);
+            writer_append(&batch, current->message, current->length + 1);
+            count++;
+        }
 
-            // * Send the error code to the client
-            send_error_code(client_sd, conn_result.error_code);
+        // * Send the whole batch with one write
+        int error = send_to_new_listener(flush->ip, flush->port, batch.data, batch.len);
+        writer_destroy(&batch);
+        if (error)
+        {
+            break;
+        }
 
-            if (conn_result.error_code == 0 && conn_result.pendingMessages != NULL) {
-                sleep(1);
-
-                // * Send the list of pending messages to the client
-                MessageEntry *previous = NULL;
-                MessageEntry *current = conn_result.pendingMessages->head;
-                while (current != NULL)
-                {
-                    int client_listen_thread = create_and_connect_socket(client_IP, port);
-                    send_string(client_listen_thread, "SEND_MESSAGE");
-                    send_string(client_listen_thread, current->sourceAlias);
-                    char msgId[11];
-                    sprintf(msgId, "%u", current->msgId);
-                    send_string(client_listen_thread, msgId);
-                    send_string(client_listen_thread, current->message);
-                    close(client_listen_thread);
-
-
-                    // * Inform the sender that the message has been sent
-                    ConnectionStatus status = list_get_connection_status(current->sourceAlias);
-                    // If the sender is not connected (status.error_code == 1) or if there occured an error (status.error_code == 2)
-                    // we don't notify the sender. However, if it's connected (status.error_code == 0) we notify the sender
-                    if (status.error_code == 0) {
-                        int sender_sd = create_and_connect_socket(status.ip, status.port);
-                        send_string(sender_sd, "SEND_MESS_ACK");
-                        send_string(sender_sd, msgId);
-                        close(sender_sd);
-                    }
-                    previous = current;
-                    current = current->next;
+        // * The batch has been written: drop its messages and inform the senders
+        acknowledge_messages(flush->alias, messages, count);
+    }
 
-                    // * Delete the message from the list
-                    if (list_delete_message(alias, previous->num)){
-                        printf("s> Error deleting message %u from %s\n", previous->msgId, previous->sourceAlias);
-                    }
-                }
+    if (messages->size > 0)
+    {
+        logger_write(LOG_WARN, "s> Error sending %u pending messages to %s, kept for the next connection\n",
+                     pending_message_count(messages), flush->alias);
+        list_reattach_pending_messages(flush->alias, messages);
+
+        // * The user may have connected again (to another listener) while we were trying: deliver them there
+        ConnectionStatus status = list_get_connection_status(flush->alias);
+        if (status.error_code == 0 && (strcmp(status.ip, flush->ip) != 0 || strcmp(status.port, flush->port) != 0))
+        {
+            flush->pendingMessages = list_detach_pending_messages(flush->alias);
+            if (flush->pendingMessages != NULL)
+            {
+                strcpy(flush->ip, status.ip);
+                strcpy(flush->port, status.port);
+                return flush_pending_messages(flush);
             }
+        }
+    }
+    else
+    {
+        list_finish_delivery(flush->alias, messages);
+        destroy_message_list(messages);
+    }
 
-            break;
+    free(flush);
+    return NULL;
+}
 
-        case DISCONNECT:
+// ! Threads flushing pending messages, waited for when the server stops
+int active_flushes = 0;
+pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;     // Signaled when a flush thread ends
 
-            // * Read the parameters
-            strcpy(alias, read_string(client_sd));
+/**
+ * @brief Flush thread: send the pending messages of a user that has just connected, then count the thread out
+ *
+ * @param flush (PendingFlush*, freed by flush_pending_messages)
+ * @return NULL
+ */
+void *flush_thread(void *arg)
+{
+    flush_pending_messages(arg);
 
-            // * Disconnect the user
-            error_code = list_disconnect_user(client_IP, alias);
+    pthread_mutex_lock(&flush_mutex);
+    active_flushes--;
+    pthread_cond_broadcast(&flush_done);
+    pthread_mutex_unlock(&flush_mutex);
+    return NULL;
+}
+
+/**
+ * @brief Send the reply of a request, taking the write mutex of its session if the requests are pipelined
+ * In the reactor, the bytes the socket does not take at once are kept in the output of the connection.
+ *
+ * @param request
+ * @param reply
+ * @return 0 -> Success, -1 -> Error
+ */
+int send_reply(Request *request, LineWriter *reply)
+{
+    if (request->output != NULL)
+    {
+        int error = writer_append(request->output, reply->data, reply->len);
+        reply->len = 0;
+        if (error == -1)
+        {
+            return -1;
+        }
+        return writer_flush_some(request->output) == -1 ? -1 : 0;
+    }
+
+    if (request->write_mutex == NULL)
+    {
+        return writer_flush(reply);
+    }
+
+    pthread_mutex_lock(request->write_mutex);
+    int error = writer_flush(reply);
+    pthread_mutex_unlock(request->write_mutex);
+    return error;
+}
+
+/**
+ * @brief Append the report of STATS to a reply: one "key=value ..." line per operation with its requests, their
+ * error codes and their latencies (from the counters of every thread), and one line with the state of the server
+ *
+ * @param framing
+ * @param reply
+ */
+void reply_stats(Framing *framing, LineWriter *reply)
+{
+    OperationStats operations[STATS_OPERATIONS];
+    stats_merge(operations);
+    DeliveryStats deliveries = delivery_stats();
+    QuotaStats mailboxes = quota_stats();
+
+    // * The lines one after another, each one with its '\0' (a line that does not fit is left out, and not counted)
+    char report[(STATS_OPERATIONS + 1) * 512];
+    size_t len = 0;
+    unsigned int lines = 0;
+    for (int i = 0; i < STATS_OPERATIONS; i++)
+    {
+        OperationStats *operation = &operations[i];
+        char errors[128] = "-";
+        size_t errors_len = 0;
+        for (int e = 0; e < STATS_ERROR_CODES; e++)
+        {
+            if (operation->errors[e] > 0 && errors_len < sizeof(errors))
+            {
+                errors_len += snprintf(errors + errors_len, sizeof(errors) - errors_len, "%s%d:%lu",
+                                       errors_len > 0 ? "," : "", e, (unsigned long)operation->errors[e]);
+            }
+        }
+        double average_us = operation->count > 0 ? (double)operation->latency_ns / operation->count / 1000.0 : 0.0;
+        int written = snprintf(report + len, sizeof(report) - len,
+                               "%s count=%lu errors=%s avg_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f",
+                               OPERATION_NAMES[i], (unsigned long)operation->count, errors, average_us,
+                               stats_percentile(operation, 0.5) / 1000.0, stats_percentile(operation, 0.99) / 1000.0,
+                               stats_percentile(operation, 0.999) / 1000.0, operation->max_ns / 1000.0);
+        if (written >= 0 && (size_t)written < sizeof(report) - len)
+        {
+            len += written + 1;
+            lines++;
+        }
+    }
+    int written = snprintf(report + len, sizeof(report) - len,
+                           "SERVER users=%ld queued_messages=%lu queued_bytes=%lu delivered=%lu delivery_failures=%lu "
+                           "delivery_queue=%zu",
+                           list_count_users(), (unsigned long)mailboxes.messages, (unsigned long)mailboxes.bytes,
+                           (unsigned long)deliveries.delivered, (unsigned long)deliveries.failed, deliveries.queued);
+    if (written >= 0 && (size_t)written < sizeof(report) - len)
+    {
+        len += written + 1;
+        lines++;
+    }
+
+    reply_uint(framing, reply, lines);
+    reply_strings(framing, reply, report, len, lines);
+}
+
+/**
+ * @brief Execute a request whose operation and parameters have already been read
+ * The result is appended to the reply, which the caller sends to the client.
+ *
+ * @param request
+ * @param reply
+ */
+void execute_request(Request *request, LineWriter *reply)
+{
+    uint64_t start = now_ns();
+
+    char *client_IP = request->client_IP;
+
+    // * Get the operation code (int), already found by parse_request()
+    Framing *framing = &request->framing;
+    int8_t operation_code_int = framing->opcode;
+
+    char client_port_str[6];
+    sprintf(client_port_str, "%d", request->client_port);
+
+    // * Parameter declaration
+    char *port;                 // Port of the user: 5 characters + '\0'
+    char *name;                 // Name of the user: 255 characters + '\0'
+    char *alias;                // Alias of the user: 255 characters + '\0' <- IDENTIFIER
+    char *receiver;             // Alias of the destination user: 255 characters + '\0'
+    char *message;              // Message to send: 255 characters + '\0'
+    char *birth;                // Birth of the user: "DD/MM/AAAA" + '\0'
+    ConnectionStatus listener;  // Listener of the user, before it disconnects
+
+    uint8_t error_code = 0;
+    reply_begin(framing, reply);
+    switch (operation_code_int)
+    {
+        case REGISTER:
+            // * Read the parameters
+            name = request->params[0];
+            alias = request->params[1];
+            birth = request->params[2];
+            truncate_field(birth, 10);
+
+            // * Register the user
+            error_code = list_register_user(client_IP, client_port_str, name, alias, birth);
+            // list_display_user_list();
+            
+            // * Print the terminal result
+            if (!error_code) {
+                logger_write(LOG_INFO, "s> REGISTER %s OK\n", alias);
+            }
+            else {
+                logger_write(LOG_INFO, "s> REGISTER %s FAIL\n", alias);
+            }
+
+            // * Send the error code to the client
+            reply_status(framing, reply, error_code);
+
+            break;
+
+        case UNREGISTER:
+
+            // * Read the parameters
+            alias = request->params[0];
+            
+            // * Unregister the user, closing the pooled connections to its listener
+            listener = list_get_connection_status(alias);
+            error_code = list_unregister_user(alias);
+            if (error_code == 0 && listener.error_code == 0) {
+                outbound_invalidate(listener.ip, listener.port);
+            }
+            // list_display_user_list();
+
+            // * Print the terminal result
+            if (!error_code) {
+                logger_write(LOG_INFO, "s> UNREGISTER %s OK\n", alias);
+            }
+            else {
+                logger_write(LOG_INFO, "s> UNREGISTER %s FAIL\n", alias);
+            }
+
+            // * Send the error code to the client
+            reply_status(framing, reply, error_code);
+
+            break;
+
+        case CONNECT:
+
+            // * Read the parameters
+            alias = request->params[0];
+            port = request->params[1];
+            truncate_field(port, 5);
+
+            // * Connect the user
+            ConnectionResult conn_result = list_connect_user(client_IP, port, alias);
+            // list_display_user_list();
+
+            // * Print the terminal result
+            if (!conn_result.error_code) {
+                logger_write(LOG_INFO, "s> CONNECT %s OK\n", alias);
+            }
+            else {
+                logger_write(LOG_INFO, "s> CONNECT %s FAIL\n", alias);
+            }
+
+            // * Send the error code to the client now: the pending messages are sent after it
+            reply_status(framing, reply, conn_result.error_code);
+            stats_record(CONNECT, conn_result.error_code, now_ns() - start);
+            reply_end(framing, reply);
+            send_reply(request, reply);
+
+            if (conn_result.error_code == 0 && conn_result.pendingMessages != NULL) {
+                PendingFlush *flush = (PendingFlush *)malloc(sizeof(PendingFlush));
+                if (flush == NULL) {
+                    logger_write(LOG_WARN, "s> Error flushing the pending messages of %s\n", alias);
+                    break;
+                }
+                strcpy(flush->alias, alias);
+                strcpy(flush->ip, client_IP);
+                strcpy(flush->port, port);
+                flush->pendingMessages = conn_result.pendingMessages;
+
+                // ! The reactor cannot wait for the client, so the flush is done by a helper thread
+                if (server_mode == MODE_EPOLL) {
+                    pthread_attr_t attr;
+                    pthread_attr_init(&attr);
+                    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+                    pthread_mutex_lock(&flush_mutex);
+                    active_flushes++;
+                    pthread_mutex_unlock(&flush_mutex);
+
+                    pthread_t thread;
+                    if (pthread_create(&thread, &attr, flush_thread, (void *)flush) != 0) {
+                        logger_write(LOG_WARN, "s> Error flushing the pending messages of %s\n", alias);
+                        free(flush);
+                        pthread_mutex_lock(&flush_mutex);
+                        active_flushes--;
+                        pthread_mutex_unlock(&flush_mutex);
+                    }
+                    pthread_attr_destroy(&attr);
+                }
+                else {
+                    flush_pending_messages(flush);
+                }
+            }
+
+            break;
+
+        case DISCONNECT:
+
+            // * Read the parameters
+            alias = request->params[0];
+
+            // * Disconnect the user, closing the pooled connections to its listener
+            listener = list_get_connection_status(alias);
+            error_code = list_disconnect_user(client_IP, alias);
+            if (error_code == 0 && listener.error_code == 0) {
+                outbound_invalidate(listener.ip, listener.port);
+            }
             // list_display_user_list();
 
             // * Print the terminal result
             if (!error_code) {
-                printf("s> DISCONNECT %s OK\n", alias);
+                logger_write(LOG_INFO, "s> DISCONNECT %s OK\n", alias);
             }
             else {
-                printf("s> DISCONNECT %s FAIL\n", alias);
+                logger_write(LOG_INFO, "s> DISCONNECT %s FAIL\n", alias);
             }
 
             // * Send the error code to the client
-            send_error_code(client_sd, error_code);
+            reply_status(framing, reply, error_code);
 
             break;
 
         case CONNECTEDUSERS: 
             // * Read the parameters
-            strcpy(alias, read_string(client_sd));
+            alias = request->params[0];
  
             // * Get the list of connected users
             ConnectedUsers connUsers = list_connected_users(alias);
@@ -413,36 +1032,30 @@ void deal_with_request(Request *client_request)
 
             // * Print the terminal result
             if (!connUsers.error_code) {
-                printf("s> CONNECTEDUSERS OK\n");
+                logger_write(LOG_INFO, "s> CONNECTEDUSERS OK\n");
             }
             else {
-                printf("s> CONNECTEDUSERS FAIL\n");
+                logger_write(LOG_INFO, "s> CONNECTEDUSERS FAIL\n");
             }
 
             // * Send the list of connected users to the client
-            send_error_code(client_sd, connUsers.error_code);
+            error_code = connUsers.error_code;
+            reply_status(framing, reply, connUsers.error_code);
 
             // * Send the number of connected users to the client and the list of connected users
             if (connUsers.error_code == 0) {
-                // * Send the number of connected users to the client
-                char connUserSize[7];
-                sprintf(connUserSize, "%u", connUsers.size);
-                send_string(client_sd, connUserSize);
-
-                // * Send the list of connected users to the client
-                for (unsigned int i = 0; i < connUsers.size; i++)
-                {
-                    send_string(client_sd, connUsers.alias[i]);
-                }
+                reply_uint(framing, reply, connUsers.size);
+                reply_strings(framing, reply, connUsers.aliases, connUsers.length, connUsers.size);
             }
+            free(connUsers.aliases);
 
             break;
 
         case SEND:
             // * Read the parameters
-            strcpy(alias, read_string(client_sd));
-            strcpy(receiver, read_string(client_sd));
-            strcpy(message, read_string(client_sd));
+            alias = request->params[0];
+            receiver = request->params[1];
+            message = request->params[2];
 
             // * Send the message
             ReceiverMessage result = list_send_message(alias, receiver, message);
@@ -450,118 +1063,1241 @@ void deal_with_request(Request *client_request)
             // Check if the receiver is connected and all went well
             if (result.error_code == 0 && strlen(result.ip) > 0 && strlen(result.port) > 0) {
                 // * Send the message to the receiver
-                int receiver_sd = create_and_connect_socket(result.ip, result.port);
-                send_string(receiver_sd, "SEND_MESSAGE");
-                send_string(receiver_sd, alias);
                 char msgId[11];
                 sprintf(msgId, "%u", result.msgId);
-                send_string(receiver_sd, msgId);
-                send_string(receiver_sd, message);
-                close(receiver_sd);
+                char *message_frame[] = {"SEND_MESSAGE", alias, msgId, message};
+                // ! The message is queued: the sender gets its reply without waiting for the receiver
+                // ! A receiver that does not keep up has its queue full: the message is refused and the SEND fails
+                if (delivery_enqueue(result.ip, result.port, message_frame, 4) != 0) {
+                    logger_write(LOG_WARN, "s> Error queueing message %u for %s\n", result.msgId, receiver);
+                    result.error_code = 2;
+                }
             }
 
             // list_display_user_list();
 
             // * Send the error code to the client
-            send_error_code(client_sd, result.error_code);
+            error_code = result.error_code;
+            reply_status(framing, reply, result.error_code);
 
             // * Send the message ID if everything went well
             if (result.error_code == 0) {
-                char msgId[11];
-                sprintf(msgId, "%u", result.msgId);
-                send_string(client_sd, msgId);
+                reply_uint(framing, reply, result.msgId);
 
                 if (result.stored == 1) {
-                    printf("s> MESSAGE %u FROM %s TO %s STORED\n", result.msgId, alias, receiver);
+                    logger_write(LOG_INFO, "s> MESSAGE %u FROM %s TO %s STORED\n", result.msgId, alias, receiver);
                 } else {
-                    printf("s> SEND MESSAGE %u FROM %s TO %s\n", result.msgId, alias, receiver);
+                    logger_write(LOG_INFO, "s> SEND MESSAGE %u FROM %s TO %s\n", result.msgId, alias, receiver);
                 }
             }
 
+            break;
+
+        case STATS:
+            // * Send the counters of the requests and the state of the server
+            error_code = 0;
+            reply_status(framing, reply, error_code);
+            reply_stats(framing, reply);
+            logger_write(LOG_INFO, "s> STATS OK\n");
+
             break;
     }
 
-    // close the socket
-    close(client_sd);
+    // * The latency of CONNECT was recorded before its reply was sent
+    if (operation_code_int != CONNECT) {
+        stats_record(operation_code_int, error_code, now_ns() - start);
+    }
+    reply_end(framing, reply);
 }
 
-int main(int argc, char *argv[])
+/**
+ * @brief Copy a parsed v2 request and queue it for the pipeline workers. Waits while the session already
+ * has PIPELINE_MAX_INFLIGHT requests executing.
+ *
+ * @param session
+ * @param request (its parameters point into the reader of the session)
+ * @return 0 -> Success, -1 -> Error (no memory or a reply could not be written)
+ */
+int dispatch_request(Session *session, Request *request)
 {
-    int port = process_port(argc, argv);
-    // printf("Port: %d\n", port);
-    int sd = create_socket(port);
+    int num_params = OPERATION_PARAMS[request->framing.opcode];
+    size_t lengths[MAX_PARAMS];
+    size_t size = 0;
+    for (int i = 0; i < num_params; i++)
+    {
+        lengths[i] = strlen(request->params[i]) + 1;
+        size += lengths[i];
+    }
 
-    // Get server IP
-    struct sockaddr_in server_address;
-    socklen_t server_address_length = sizeof(server_address);
-    getsockname(sd, (struct sockaddr *)&server_address, &server_address_length);
-    char server_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(server_address.sin_addr), server_ip, INET_ADDRSTRLEN);
+    PipelinedRequest *job = (PipelinedRequest *)malloc(sizeof(PipelinedRequest) + size);
+    if (job == NULL)
+    {
+        return -1;
+    }
+    job->session = session;
+    job->request = *request;
+    job->request.write_mutex = &session->write_mutex;
+    char *field = job->fields;
+    for (int i = 0; i < num_params; i++)
+    {
+        memcpy(field, request->params[i], lengths[i]);
+        job->request.params[i] = field;
+        field += lengths[i];
+    }
 
-    // Register the signal handler
-    signal(SIGINT, stopServer);
+    // * Backpressure: a client cannot queue more than PIPELINE_MAX_INFLIGHT requests
+    pthread_mutex_lock(&session->mutex);
+    while (session->inflight >= PIPELINE_MAX_INFLIGHT && !session->failed)
+    {
+        pthread_cond_wait(&session->done, &session->mutex);
+    }
+    if (session->failed)
+    {
+        pthread_mutex_unlock(&session->mutex);
+        free(job);
+        return -1;
+    }
+    session->inflight++;
+    pthread_mutex_unlock(&session->mutex);
 
-    // If signal is received, stop the server
-    signal(SIGINT, stopServer);
+    queue_push(&pipeline_queue, job);
+    return 0;
+}
 
-    // ! Thread attributes
-    pthread_attr_t attr;                                         // Thread attributes
-    pthread_attr_init(&attr);                                    // Initialize the attribute
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED); // Set the attribute to detached
+/**
+ * @brief Pipeline worker: execute the pipelined requests and write each reply as soon as it is ready,
+ * so the replies of a session may be sent in a different order than its requests (see the request id)
+ *
+ * @param arg (unused)
+ * @return NULL
+ */
+void *pipeline_worker(void *arg)
+{
+    (void)arg;
 
-    // ! Mutex & Condition variables
-    pthread_mutex_init(&mutex, NULL); // Initialize the mutex
-    pthread_cond_init(&cond, NULL);   // Initialize the condition variable
+    while (1)
+    {
+        PipelinedRequest *job = (PipelinedRequest *)queue_pop(&pipeline_queue);
 
+        // ! A NULL request asks the pipeline worker to exit
+        if (job == NULL)
+        {
+            break;
+        }
+        Session *session = job->session;
 
-    // * When initializing the server, we print server information (IP:port)
-    printf("s> init server %s:%d", server_ip, port);
+        LineWriter reply;
+        writer_init(&reply, session->socket);
+        execute_request(&job->request, &reply);
+        int error = send_reply(&job->request, &reply);
+        writer_destroy(&reply);
+        free(job);
 
-    // * Before receiving any request, we print the prompt
-    printf("s>");
+        pthread_mutex_lock(&session->mutex);
+        if (error == -1 && !session->failed)
+        {
+            // ! Wake up the reader of the session, which stops reading requests
+            session->failed = 1;
+            shutdown(session->socket, SHUT_RD);
+        }
+        session->inflight--;
+        pthread_cond_broadcast(&session->done);
+        pthread_mutex_unlock(&session->mutex);
+    }
 
-    // of messages sent/set of messages received and so we dont have to force break the loop
-    while (1)
+    return NULL;
+}
+
+/**
+ * @brief Get the current monotonic time in seconds
+ */
+time_t monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// Session of a client served by the worker pool. Between two requests it is parked in the poller, so an idle
+// session does not hold a worker: a worker only takes it once the client has sent something
+typedef struct ClientSession
+{
+    Request request;                // Request being parsed
+    LineReader reader;              // Bytes received from the client
+    LineWriter reply;               // Reply of a v1 request
+    Session pipeline;               // v2 requests executed by the pipeline workers
+    int registered;                 // 1 -> The socket has been added to the poller
+    int expired;                    // 1 -> Closed without being read (idle for too long, or the server stops)
+    time_t parked_at;               // Last time (monotonic seconds) the session was parked
+    struct ClientSession *prev;     // Previous session in the parked list (parked the earliest first)
+    struct ClientSession *next;     // Next session in the parked list
+} ClientSession;
+
+// ! Sessions waiting for their client in the poller, ordered from the least to the most recently parked
+ClientSession *parked_head = NULL;
+ClientSession *parked_tail = NULL;
+int poller_fd = -1;                 // Epoll instance watching the parked sessions
+int parking_closed = 0;             // 1 -> The server stops: the sessions are closed instead of parked
+pthread_mutex_t parked_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects the parked list and parking_closed
+
+/**
+ * @brief Remove a session from the parked list. The parked mutex must be locked.
+ */
+void parked_list_remove(ClientSession *session)
+{
+    if (session->prev != NULL) {
+        session->prev->next = session->next;
+    } else {
+        parked_head = session->next;
+    }
+    if (session->next != NULL) {
+        session->next->prev = session->prev;
+    } else {
+        parked_tail = session->prev;
+    }
+    session->prev = NULL;
+    session->next = NULL;
+}
+
+/**
+ * @brief Open the session of an accepted client
+ *
+ * @param client_sd
+ * @return NULL if there is no memory. Otherwise, the session (closed with close_session()).
+ */
+ClientSession *open_session(int client_sd)
+{
+    ClientSession *session = (ClientSession *)calloc(1, sizeof(ClientSession));
+    if (session == NULL)
     {
-        // * Open the client socket
-        Request client_request = {0};
-        struct sockaddr_in client_addr = {0};
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_sd = accept(sd, (struct sockaddr *)&client_addr, &client_addr_len);
+        return NULL;
+    }
+    struct sockaddr_in client_addr = {0};
+    socklen_t client_addr_len = sizeof(client_addr);
 
-        if (client_sd == -1)
-        {
-            perror("Error opening the client socket");
-            exit(1);
-        }
+    session->request.socket = client_sd;
+
+    // get the client IP and port
+    getpeername(client_sd, (struct sockaddr *)&client_addr, &client_addr_len);
+    strcpy(session->request.client_IP, inet_ntoa(client_addr.sin_addr));
+    session->request.client_port = ntohs(client_addr.sin_port);
+
+    // print the client IP and port
+    logger_write(LOG_DEBUG, "IP: %s, Port: %d\n", session->request.client_IP, session->request.client_port);
+
+    // ! A client that stops reading its replies cannot hold a worker or a pipeline worker forever
+    if (idle_timeout > 0)
+    {
+        struct timeval timeout = {0};
+        timeout.tv_sec = idle_timeout;
+        setsockopt(client_sd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
+    }
+
+    reader_init(&session->reader, client_sd);
+    session->reader.max_field = MAX_LINE - 1;
+    writer_init(&session->reply, client_sd);
+
+    // ! The requests of a v2 session carry a request id, so they are executed by the pipeline workers
+    session->pipeline.socket = client_sd;
+    pthread_mutex_init(&session->pipeline.write_mutex, NULL);
+    pthread_mutex_init(&session->pipeline.mutex, NULL);
+    pthread_cond_init(&session->pipeline.done, NULL);
+    return session;
+}
+
+/**
+ * @brief Close a session once every reply of its pipelined requests has been written, and free it
+ *
+ * @param session
+ */
+void close_session(ClientSession *session)
+{
+    pthread_mutex_lock(&session->pipeline.mutex);
+    while (session->pipeline.inflight > 0)
+    {
+        pthread_cond_wait(&session->pipeline.done, &session->pipeline.mutex);
+    }
+    pthread_mutex_unlock(&session->pipeline.mutex);
+    pthread_cond_destroy(&session->pipeline.done);
+    pthread_mutex_destroy(&session->pipeline.mutex);
+    pthread_mutex_destroy(&session->pipeline.write_mutex);
+
+    writer_destroy(&session->reply);
+    close(session->request.socket);
+    free(session);
+}
+
+/**
+ * @brief Park a session until its client sends something (the poller hands it to a worker then)
+ *
+ * @param session
+ * @return 0 -> Parked, -1 -> The session must be closed (the server stops, or it cannot be watched)
+ */
+int park_session(ClientSession *session)
+{
+    pthread_mutex_lock(&parked_mutex);
+    if (parking_closed)
+    {
+        pthread_mutex_unlock(&parked_mutex);
+        return -1;
+    }
+
+    session->parked_at = monotonic_seconds();
+    session->prev = parked_tail;
+    session->next = NULL;
+    if (parked_tail != NULL) {
+        parked_tail->next = session;
+    } else {
+        parked_head = session;
+    }
+    parked_tail = session;
+
+    // * One shot: the session is watched again only when a worker parks it again
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = session;
+    int op = session->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(poller_fd, op, session->request.socket, &event) == -1)
+    {
+        parked_list_remove(session);
+        pthread_mutex_unlock(&parked_mutex);
+        return -1;
+    }
+    session->registered = 1;
+    pthread_mutex_unlock(&parked_mutex);
+    return 0;
+}
+
+/**
+ * @brief Queue sessions taken out of the parked list for the workers (without the parked mutex, since the queue
+ * may be full until a worker takes a session, and the workers park sessions)
+ *
+ * @param sessions (linked by next)
+ */
+void wake_sessions(ClientSession *sessions)
+{
+    while (sessions != NULL)
+    {
+        ClientSession *next = sessions->next;
+        sessions->next = NULL;
+        queue_push(&client_queue, sessions);
+        sessions = next;
+    }
+}
 
-        // * Create the request
-        client_request.socket = client_sd;
-        strcpy(client_request.operation, read_string(client_sd));
+/**
+ * @brief Take the sessions parked for idle_timeout seconds or more (or every session when the server stops) out of
+ * the parked list, marked as expired. The parked mutex must be locked.
+ *
+ * @param all (1 -> every session)
+ * @return the sessions, linked by next
+ */
+ClientSession *expire_sessions(int all)
+{
+    ClientSession *expired = NULL;
+    ClientSession **last = &expired;
+    time_t now = monotonic_seconds();
+    while (parked_head != NULL && (all || now - parked_head->parked_at >= idle_timeout))
+    {
+        ClientSession *session = parked_head;
+        parked_list_remove(session);
+        epoll_ctl(poller_fd, EPOLL_CTL_DEL, session->request.socket, NULL);
+        session->expired = 1;
+        *last = session;
+        last = &session->next;
+    }
+    return expired;
+}
 
-        printf("📧 Operation -> \"%s\"\n", client_request.operation);
+/**
+ * @brief Poller thread: hand the parked sessions whose client has sent something to the workers, and the ones
+ * idle for too long, until the stop pipe is written. Then it hands every parked session over, to be closed
+ *
+ * @param arg (unused)
+ * @return NULL
+ */
+void *poller_thread(void *arg)
+{
+    (void)arg;
 
-        // * Print the request
-        // ! We create a thread for each request and execute the function deal_with_request
-        pthread_t thread; // create threads to handle the requests as they come in
+    struct epoll_event events[MAX_EVENTS];
+    int running = 1;
+    while (running)
+    {
+        // ! Wake up every second to close the idle sessions
+        int num_events = epoll_wait(poller_fd, events, MAX_EVENTS, idle_timeout > 0 ? 1000 : -1);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error waiting for the sessions");
+            exit(1);
+        }
 
-        pthread_create(&thread, &attr, (void *)deal_with_request, (void *)&client_request);
+        for (int i = 0; i < num_events; i++)
+        {
+            if (events[i].data.ptr == stop_pipe)
+            {
+                running = 0;
+                continue;
+            }
+            ClientSession *session = (ClientSession *)events[i].data.ptr;
+            pthread_mutex_lock(&parked_mutex);
+            parked_list_remove(session);
+            pthread_mutex_unlock(&parked_mutex);
+            wake_sessions(session);
+        }
 
-        // ! Wait for the thread to finish (child copies the descriptor)
-        pthread_mutex_lock(&mutex); // Lock the mutex
-        while (busy)
+        if (idle_timeout > 0)
         {
-            pthread_cond_wait(&cond, &mutex); // Wait for the condition variable
+            pthread_mutex_lock(&parked_mutex);
+            ClientSession *expired = expire_sessions(0);
+            pthread_mutex_unlock(&parked_mutex);
+            wake_sessions(expired);
         }
-        busy = true;                  // Set the thread as busy
-        pthread_mutex_unlock(&mutex); // Unlock the mutex
     }
 
-    // ! Destroy the mutex and the condition variable
-    pthread_mutex_destroy(&mutex);
-    pthread_cond_destroy(&cond);
+    // * No session is parked from now on: the workers close them
+    pthread_mutex_lock(&parked_mutex);
+    parking_closed = 1;
+    ClientSession *expired = expire_sessions(1);
+    pthread_mutex_unlock(&parked_mutex);
+    wake_sessions(expired);
 
-    close(sd);
+    return NULL;
+}
+
+/**
+ * @brief Serve a session whose client has sent something: read once, then execute every complete request
+ * received (the socket is closed by the caller)
+ *
+ * @param session
+ * @return 1 -> Park the session until its client sends more, 0 -> Close it (the client closed the session,
+ * the request is invalid or a reply could not be written)
+ */
+int serve_session(ClientSession *session)
+{
+    Request *request = &session->request;
+    LineReader *reader = &session->reader;
+
+    // * The client has sent something, so this read does not wait (nothing received -> the client closed it)
+    if (reader_fill(reader) <= 0) {
+        return 0;
+    }
+
+    while (1)
+    {
+        int status = parse_request(reader, request);
+
+        // * The rest of the request has not arrived yet: wait for it parked
+        if (status == 0)
+        {
+            return 1;
+        }
+        if (status == -1) {
+            return 0;
+        }
+
+        if (request->framing.version == PROTOCOL_V2)
+        {
+            int error = dispatch_request(&session->pipeline, request);
+            reader_release(reader);
+            if (error == -1 || idle_timeout == 0) {
+                return 0;
+            }
+            continue;
+        }
+
+        execute_request(request, &session->reply);
+        reader_release(reader);
+        if (writer_flush(&session->reply) == -1 || idle_timeout == 0) {
+            return 0;
+        }
+    }
+}
+
+// ! Sockets of the sessions being served, so the main thread can stop reading them when the server stops
+int *session_sockets = NULL;        // Socket served by each worker, -1 -> Waiting for a client
+int server_stopping = 0;            // 1 -> The sessions taken by the workers are closed without being served
+pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects session_sockets and server_stopping
+
+/**
+ * @brief Worker thread: take the sessions whose client has sent something from the queue, serve their requests
+ * and park them again
+ *
+ * @param arg (index of the worker)
+ * @return NULL
+ */
+void *worker_thread(void *arg)
+{
+    int worker = (int)(intptr_t)arg;
+
+    while (1)
+    {
+        ClientSession *session = (ClientSession *)queue_pop(&client_queue);
+
+        // ! A NULL session asks the worker to exit
+        if (session == NULL)
+        {
+            break;
+        }
+
+        pthread_mutex_lock(&session_mutex);
+        int serve = !server_stopping && !session->expired;
+        session_sockets[worker] = serve ? session->request.socket : -1;
+        pthread_mutex_unlock(&session_mutex);
+
+        int keep = serve ? serve_session(session) : 0;
+
+        // * The socket leaves the list before it is closed, so its number is never shut down once reused
+        pthread_mutex_lock(&session_mutex);
+        session_sockets[worker] = -1;
+        pthread_mutex_unlock(&session_mutex);
+
+        if (!keep || park_session(session) == -1)
+        {
+            close_session(session);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Accept the clients and hand them to a fixed pool of worker threads
+ *
+ * @param sd (listening socket)
+ */
+void run_thread_server(int sd)
+{
+    // ! Bounded queue of sessions with something to read: when it is full the poller waits for the workers
+    if (queue_init(&client_queue, (size_t)num_workers * QUEUE_PER_WORKER) == -1)
+    {
+        printf("Error creating the queue of clients\n");
+        exit(1);
+    }
+
+    // ! Bounded queue of pipelined requests: when it is full the readers of the sessions wait
+    if (queue_init(&pipeline_queue, PIPELINE_QUEUE_SIZE) == -1)
+    {
+        printf("Error creating the queue of pipelined requests\n");
+        exit(1);
+    }
+
+    // ! The poller watches the parked sessions and the stop pipe, written by the signal handler
+    poller_fd = epoll_create1(0);
+    if (poller_fd == -1)
+    {
+        perror("Error creating the epoll instance");
+        exit(1);
+    }
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = stop_pipe;
+    if (epoll_ctl(poller_fd, EPOLL_CTL_ADD, stop_pipe[0], &event) == -1)
+    {
+        perror("Error registering the stop pipe");
+        exit(1);
+    }
+
+    // ! Pre-spawn the workers, and as many pipeline workers (joined when the server stops), and the poller
+    pthread_t *workers = (pthread_t *)malloc(2 * num_workers * sizeof(pthread_t));
+    session_sockets = (int *)malloc(num_workers * sizeof(int));
+    if (workers == NULL || session_sockets == NULL)
+    {
+        perror("Error creating the worker threads");
+        exit(1);
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        session_sockets[i] = -1;
+        if (pthread_create(&workers[i], NULL, worker_thread, (void *)(intptr_t)i) != 0 ||
+            pthread_create(&workers[num_workers + i], NULL, pipeline_worker, NULL) != 0)
+        {
+            perror("Error creating the worker threads");
+            exit(1);
+        }
+    }
+    pthread_t poller;
+    if (pthread_create(&poller, NULL, poller_thread, NULL) != 0)
+    {
+        perror("Error creating the poller thread");
+        exit(1);
+    }
+
+    // ! The acceptor also watches the stop pipe
+    struct pollfd fds[2] = {{.fd = sd, .events = POLLIN}, {.fd = stop_pipe[0], .events = POLLIN}};
+
+    // of messages sent/set of messages received and so we dont have to force break the loop
+    while (1)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error waiting for clients");
+            exit(1);
+        }
+
+        // * Stop accepting clients
+        if (fds[1].revents != 0)
+        {
+            break;
+        }
+
+        // * Open the client socket
+        struct sockaddr_in client_addr = {0};
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_sd = accept(sd, (struct sockaddr *)&client_addr, &client_addr_len);
+
+        if (client_sd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("Error opening the client socket");
+            exit(1);
+        }
+
+        // * The session waits in the poller for its first request, so a slow client does not hold a worker
+        ClientSession *session = open_session(client_sd);
+        if (session == NULL)
+        {
+            close(client_sd);
+        }
+        else if (park_session(session) == -1)
+        {
+            close_session(session);
+        }
+    }
+
+    // ! The sessions being served finish their requests in progress and read no more
+    pthread_mutex_lock(&session_mutex);
+    server_stopping = 1;
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (session_sockets[i] != -1)
+        {
+            shutdown(session_sockets[i], SHUT_RD);
+        }
+    }
+    pthread_mutex_unlock(&session_mutex);
+
+    // * The poller hands the parked sessions to the workers, which close them and then find the request to exit
+    pthread_join(poller, NULL);
+    for (int i = 0; i < num_workers; i++)
+    {
+        queue_push(&client_queue, NULL);
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    // * Every session has waited for its pipelined requests, so the pipeline workers are idle
+    for (int i = 0; i < num_workers; i++)
+    {
+        queue_push(&pipeline_queue, NULL);
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        pthread_join(workers[num_workers + i], NULL);
+    }
+
+    close(poller_fd);
+    free(session_sockets);
+    free(workers);
+    queue_destroy(&pipeline_queue);
+    queue_destroy(&client_queue);
+}
+
+// Structure of a client connection handled by the reactor
+typedef struct Connection
+{
+    Request request;                // Request being parsed
+    LineReader reader;              // Bytes received from the client
+    LineWriter output;              // Replies the socket has not taken yet (written on EPOLLOUT)
+    uint32_t events;                // Events the connection is registered for
+    int closing;                    // 1 -> The connection is closed once its replies are written
+    time_t last_active;             // Last time (monotonic seconds) the client sent something
+    struct Connection *prev;        // Previous connection in the idle list (least recently active first)
+    struct Connection *next;        // Next connection in the idle list
+} Connection;
+
+// List of the open connections, ordered from the least to the most recently active
+typedef struct
+{
+    Connection *head;
+    Connection *tail;
+} ConnectionList;
+
+ConnectionList idle_list = {NULL, NULL};
+
+/**
+ * @brief Remove a connection from the idle list
+ */
+void idle_list_remove(Connection *conn)
+{
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        idle_list.head = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    } else {
+        idle_list.tail = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+}
+
+/**
+ * @brief Mark a connection as active now, moving it to the end of the idle list
+ */
+void idle_list_touch(Connection *conn)
+{
+    if (idle_list.tail != conn) {
+        if (conn->prev != NULL || conn->next != NULL || idle_list.head == conn) {
+            idle_list_remove(conn);
+        }
+        conn->prev = idle_list.tail;
+        conn->next = NULL;
+        if (idle_list.tail != NULL) {
+            idle_list.tail->next = conn;
+        } else {
+            idle_list.head = conn;
+        }
+        idle_list.tail = conn;
+    }
+    conn->last_active = monotonic_seconds();
+}
+
+/**
+ * @brief Put a socket in non-blocking (or blocking) mode
+ *
+ * @param sd
+ * @param non_blocking (true or false)
+ * @return 0 -> Success, -1 -> Error
+ */
+int set_non_blocking(int sd, int non_blocking)
+{
+    int flags = fcntl(sd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return -1;
+    }
+    flags = non_blocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(sd, F_SETFL, flags);
+}
+
+/**
+ * @brief Accept every pending client and register it in the epoll instance
+ *
+ * @param epfd
+ * @param sd (listening socket)
+ */
+void accept_connections(int epfd, int sd)
+{
+    while (1)
+    {
+        struct sockaddr_in client_addr = {0};
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_sd = accept(sd, (struct sockaddr *)&client_addr, &client_addr_len);
+
+        if (client_sd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("Error opening the client socket");
+            }
+            return;
+        }
+
+        Connection *conn = (Connection *)calloc(1, sizeof(Connection));
+        if (conn == NULL || set_non_blocking(client_sd, true) == -1)
+        {
+            perror("Error registering the client socket");
+            free(conn);
+            close(client_sd);
+            continue;
+        }
+        conn->request.socket = client_sd;
+        strcpy(conn->request.client_IP, inet_ntoa(client_addr.sin_addr));
+        conn->request.client_port = ntohs(client_addr.sin_port);
+        conn->request.output = &conn->output;
+        reader_init(&conn->reader, client_sd);
+        conn->reader.max_field = MAX_LINE - 1;
+        writer_init(&conn->output, client_sd);
+        conn->events = EPOLLIN | EPOLLRDHUP;
+        idle_list_touch(conn);
+
+        // print the client IP and port
+        logger_write(LOG_DEBUG, "IP: %s, Port: %d\n", conn->request.client_IP, conn->request.client_port);
+
+        struct epoll_event event = {0};
+        event.events = conn->events;
+        event.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sd, &event) == -1)
+        {
+            perror("Error registering the client socket");
+            idle_list_remove(conn);
+            free(conn);
+            close(client_sd);
+        }
+    }
+}
+
+/**
+ * @brief Close a client connection and remove it from the epoll instance
+ *
+ * @param epfd
+ * @param conn
+ */
+void close_connection(int epfd, Connection *conn)
+{
+    idle_list_remove(conn);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->request.socket, NULL);
+    close(conn->request.socket);
+    writer_destroy(&conn->output);
+    free(conn);
+}
+
+/**
+ * @brief Read everything available from a client and execute its requests as they are completed
+ * The socket stays non-blocking: while the client has not taken the replies, its next requests are not executed
+ * and the connection waits for EPOLLOUT instead of EPOLLIN.
+ *
+ * @param epfd
+ * @param conn
+ */
+void handle_connection(int epfd, Connection *conn)
+{
+    LineWriter reply;
+
+    idle_list_touch(conn);
+
+    while (1)
+    {
+        // * Write the replies left by a previous call first: no request is executed while some are waiting
+        int pending = writer_flush_some(&conn->output);
+        if (pending == -1 || (pending == 0 && conn->closing))
+        {
+            close_connection(epfd, conn);
+            return;
+        }
+        if (pending == 1)
+        {
+            break;
+        }
+
+        // * Several requests of the session may arrive in the same read
+        int status;
+        while ((status = parse_request(&conn->reader, &conn->request)) == 1)
+        {
+            writer_init(&reply, conn->request.socket);
+            execute_request(&conn->request, &reply);
+            reader_release(&conn->reader);
+
+            int error = send_reply(&conn->request, &reply);
+            writer_destroy(&reply);
+
+            if (error == -1)
+            {
+                close_connection(epfd, conn);
+                return;
+            }
+
+            // * The client is not taking its replies (or gets only one): stop executing its requests
+            conn->closing = idle_timeout == 0;
+            if (conn->closing || conn->output.len > 0)
+            {
+                break;
+            }
+        }
+
+        if (status == -1)
+        {
+            close_connection(epfd, conn);
+            return;
+        }
+        if (status == 1)
+        {
+            continue;
+        }
+
+        ssize_t bytes_read = reader_fill(&conn->reader);
+
+        if (bytes_read == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Error reading the string");
+                close_connection(epfd, conn);
+                return;
+            }
+            break;
+        }
+
+        // * The client closed the session
+        if (bytes_read == 0)
+        {
+            close_connection(epfd, conn);
+            return;
+        }
+    }
+
+    // ! Wait for the socket to take the replies, or for the next requests
+    uint32_t events = conn->output.len > 0 ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    if (events != conn->events)
+    {
+        struct epoll_event event = {0};
+        event.events = events;
+        event.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->request.socket, &event) == -1)
+        {
+            perror("Error registering the client socket");
+            close_connection(epfd, conn);
+            return;
+        }
+        conn->events = events;
+    }
+}
+
+/**
+ * @brief Close the sessions that have been idle for more than idle_timeout seconds
+ *
+ * @param epfd
+ */
+void close_idle_connections(int epfd)
+{
+    time_t now = monotonic_seconds();
+    while (idle_list.head != NULL && now - idle_list.head->last_active >= idle_timeout)
+    {
+        close_connection(epfd, idle_list.head);
+    }
+}
+
+/**
+ * @brief Serve every client from a single thread using a non-blocking epoll reactor
+ *
+ * @param sd (listening socket)
+ */
+void run_epoll_server(int sd)
+{
+    int epfd = epoll_create1(0);
+    if (epfd == -1)
+    {
+        perror("Error creating the epoll instance");
+        exit(1);
+    }
+
+    if (set_non_blocking(sd, true) == -1)
+    {
+        perror("Error setting socket options");
+        exit(1);
+    }
+
+    // ! The listening socket is identified by a NULL pointer
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &event) == -1)
+    {
+        perror("Error registering the listening socket");
+        exit(1);
+    }
+
+    // ! The stop pipe, written by the signal handler, is identified by its own address
+    event.events = EPOLLIN;
+    event.data.ptr = stop_pipe;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, stop_pipe[0], &event) == -1)
+    {
+        perror("Error registering the stop pipe");
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int running = 1;
+    while (running)
+    {
+        // ! Wake up every second to close the idle sessions
+        int num_events = epoll_wait(epfd, events, MAX_EVENTS, idle_timeout > 0 ? 1000 : -1);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error waiting for events");
+            exit(1);
+        }
+
+        for (int i = 0; i < num_events; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                accept_connections(epfd, sd);
+            }
+            else if (events[i].data.ptr == stop_pipe)
+            {
+                // * Stop accepting clients once the events already returned are handled
+                running = 0;
+            }
+            else
+            {
+                handle_connection(epfd, (Connection *)events[i].data.ptr);
+            }
+        }
+
+        if (idle_timeout > 0)
+        {
+            close_idle_connections(epfd);
+        }
+    }
+
+    // * The requests are executed as they are read, so nothing is in progress in the open sessions
+    while (idle_list.head != NULL)
+    {
+        close_connection(epfd, idle_list.head);
+    }
+
+    close(epfd);
+}
+
+// ! The snapshot thread waits for the next snapshot on a condition, so the main thread can stop it
+pthread_t snapshot;
+int snapshot_running = 0;           // 1 -> The snapshot thread has been started and must go on
+pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t snapshot_stop = PTHREAD_COND_INITIALIZER;    // Signaled when the server stops
+
+/**
+ * @brief Take a snapshot of the registry every snapshot_interval seconds, so the log replayed on restart stays short
+ *
+ * @param arg (unused)
+ * @return NULL
+ */
+void *snapshot_thread(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += snapshot_interval;
+
+        pthread_mutex_lock(&snapshot_mutex);
+        int error = 0;
+        while (snapshot_running && error != ETIMEDOUT)
+        {
+            error = pthread_cond_timedwait(&snapshot_stop, &snapshot_mutex, &deadline);
+        }
+        int running = snapshot_running;
+        pthread_mutex_unlock(&snapshot_mutex);
+        if (!running)
+        {
+            break;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t generation = list_snapshot(wal_path);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+        if (generation == 0)
+        {
+            logger_write(LOG_INFO, "s> SNAPSHOT FAIL\n");
+        }
+        else
+        {
+            logger_write(LOG_INFO, "s> SNAPSHOT %lu OK (%ld ms)\n", (unsigned long)generation, elapsed);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Stop the server once the clients are no longer served: wait for the threads that use the registry,
+ * display the statistics, close the log and free the registry
+ *
+ * @param stats (statistics thread)
+ */
+void stop_server(pthread_t stats)
+{
+    // * The pending messages being flushed are either delivered or given back to their users
+    pthread_mutex_lock(&flush_mutex);
+    while (active_flushes > 0)
+    {
+        pthread_cond_wait(&flush_done, &flush_mutex);
+    }
+    pthread_mutex_unlock(&flush_mutex);
+
+    // * The ACKs waiting for their batch are queued, and every queued frame is delivered before the pool is closed
+    ack_stop();
+    delivery_stop();
+
+    // * A snapshot in progress is finished
+    pthread_mutex_lock(&snapshot_mutex);
+    int running = snapshot_running;
+    snapshot_running = 0;
+    pthread_cond_signal(&snapshot_stop);
+    pthread_mutex_unlock(&snapshot_mutex);
+    if (running)
+    {
+        pthread_join(snapshot, NULL);
+    }
+
+    // * A display in progress is finished (the handler never writes a 0)
+    signal(SIGUSR1, SIG_IGN);
+    char byte = 0;
+    while (write(stats_pipe[1], &byte, 1) == -1 && errno == EAGAIN)
+    {
+        usleep(1000);
+    }
+    pthread_join(stats, NULL);
+
+    // Write the lines still waiting in the log before anything else
+    logger_stop();
+
+    printf("\n\nClosing the server and deleting the users list...\n\n");
+
+    display_logger_stats();
+
+    display_slab_stats();
+
+    display_delivery_stats();
+
+    display_wal_stats();
+
+    display_spill_stats();
+
+    display_mailbox_stats();
+
+    lock_stats_dump(lock_stats_path);
+
+    wal_close();
+
+    outbound_destroy();
+
+    request_delete_list();
+}
+
+int main(int argc, char *argv[])
+{
+    int port = process_arguments(argc, argv);
+    // printf("Port: %d\n", port);
+    int sd = create_socket(port);
+
+    // Get server IP
+    struct sockaddr_in server_address;
+    socklen_t server_address_length = sizeof(server_address);
+    getsockname(sd, (struct sockaddr *)&server_address, &server_address_length);
+    char server_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(server_address.sin_addr), server_ip, INET_ADDRSTRLEN);
+
+    // Register the signal handler (it only wakes up the main thread, which stops the server)
+    if (pipe(stop_pipe) == -1 || fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK) == -1)
+    {
+        perror("Error creating the stop pipe");
+        exit(1);
+    }
+    signal(SIGINT, stopServer);
+
+    // If signal is received, stop the server
+    signal(SIGINT, stopServer);
+
+    // A client closing its socket must not kill the server while we write to it
+    signal(SIGPIPE, SIG_IGN);
+
+    // Display the statistics when asked to (the handler only wakes up the statistics thread)
+    pthread_t stats;
+    if (pipe(stats_pipe) == -1 || fcntl(stats_pipe[1], F_SETFL, O_NONBLOCK) == -1 ||
+        pthread_create(&stats, NULL, stats_thread, NULL) != 0)
+    {
+        perror("Error creating the statistics thread");
+        exit(1);
+    }
+    signal(SIGUSR1, dumpStats);
+
+    // The mailboxes that do not fit in memory overflow to disk (also while the log is replayed)
+    if (spill_configure(spill_directory, (uint64_t)spill_memory_mb << 20, spill_user_messages) != 0)
+    {
+        printf("Invalid spill directory: %s (it must exist and be writable)\n", spill_directory);
+        exit(1);
+    }
+    quota_configure(quota_messages, (uint64_t)quota_kb << 10, (uint64_t)quota_global_mb << 20);
+
+    // Rebuild the registry from the snapshot and the log before serving anyone, then keep logging to it
+    if (wal_path != NULL)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long users;
+        uint64_t generation;
+        long records = list_recover(wal_path, &users, &generation);
+        if (records == -1 || wal_open(wal_path, generation, wal_durability) == -1)
+        {
+            perror("Error opening the write-ahead log");
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("s> Recovered %ld users from the snapshot and %ld records from %s in %ld ms\n", users, records,
+               wal_path, (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+
+        snapshot_running = snapshot_interval > 0;
+        if (snapshot_running && pthread_create(&snapshot, NULL, snapshot_thread, NULL) != 0)
+        {
+            perror("Error creating the snapshot thread");
+            exit(1);
+        }
+    }
+
+    // Start the threads that deliver the messages to the clients
+    if (delivery_start(DELIVERY_WORKERS) != 0)
+    {
+        perror("Error creating the delivery workers");
+        exit(1);
+    }
+
+    // Start the thread that sends the coalesced ACKs
+    if (ack_start() != 0)
+    {
+        perror("Error creating the ACK thread");
+        exit(1);
+    }
+
+    // * When initializing the server, we print server information (IP:port)
+    printf("s> init server %s:%d", server_ip, port);
+
+    // * Before receiving any request, we print the prompt
+    printf("s>");
+
+    // From now on the requests are logged by the writer thread of the log
+    if (logger_start(log_level) != 0)
+    {
+        perror("Error creating the log thread");
+        exit(1);
+    }
+
+    if (server_mode == MODE_EPOLL)
+    {
+        run_epoll_server(sd);
+    }
+    else
+    {
+        run_thread_server(sd);
+    }
+
+    close(sd);
+
+    stop_server(stats);
 
     return 0;
 }
@@ -0,0 +1,73 @@
+/*
+ * File: queue.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdlib.h>
+
+#include "queue.h"
+
+/**
+ * @brief Initialise an empty queue with room for capacity items.
+ * @return 0 -> Success, -1 -> Error
+ */
+int queue_init(Queue *queue, size_t capacity) {
+    if (capacity == 0) {
+        return -1;
+    }
+    queue->items = (void **)malloc(capacity * sizeof(void *));
+    if (queue->items == NULL) {
+        return -1;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+/**
+ * @brief Append an item at the end of the queue, waiting while the queue is full.
+ */
+void queue_push(Queue *queue, void *item) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Remove the oldest item of the queue, waiting while the queue is empty.
+ * @return the removed item
+ */
+void *queue_pop(Queue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    void *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return item;
+}
+
+/**
+ * @brief Destroy the queue. The queued items are not freed.
+ */
+void queue_destroy(Queue *queue) {
+    free(queue->items);
+    queue->items = NULL;
+    queue->capacity = 0;
+    queue->count = 0;
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
@@ -0,0 +1,46 @@
+/*
+ * File: queue.h
+ * Authors: 100451339 & 100451170
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Bounded multi-producer multi-consumer FIFO queue of pointers
+typedef struct
+{
+    void **items;                   // Circular buffer with the queued items
+    size_t capacity;                // Maximum number of queued items
+    size_t head;                    // Position of the oldest item
+    size_t count;                   // Number of queued items
+    pthread_mutex_t mutex;          // Mutex protecting the queue
+    pthread_cond_t not_empty;       // Signaled when an item is pushed
+    pthread_cond_t not_full;        // Signaled when an item is popped
+} Queue;
+
+/**
+ * @brief Initialise an empty queue with room for capacity items.
+ * @return 0 -> Success, -1 -> Error
+ */
+int queue_init(Queue *queue, size_t capacity);
+
+/**
+ * @brief Append an item at the end of the queue, waiting while the queue is full.
+ */
+void queue_push(Queue *queue, void *item);
+
+/**
+ * @brief Remove the oldest item of the queue, waiting while the queue is empty.
+ * @return the removed item
+ */
+void *queue_pop(Queue *queue);
+
+/**
+ * @brief Destroy the queue. The queued items are not freed.
+ */
+void queue_destroy(Queue *queue);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * File: quota.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+
+#include "quota.h"
+
+QuotaConfig quota_config = {DEFAULT_QUOTA_MESSAGES, (uint64_t)DEFAULT_QUOTA_KB << 10,
+                            (uint64_t)DEFAULT_QUOTA_GLOBAL_MB << 20};
+QuotaStats quota_counters;                                  // Updated atomically by the writers of every shard
+
+/**
+ * @brief Set the limits of the mailboxes (0 -> no limit).
+ */
+void quota_configure(unsigned int recipient_messages, uint64_t recipient_bytes, uint64_t global_bytes) {
+    quota_config.recipient_messages = recipient_messages;
+    quota_config.recipient_bytes = recipient_bytes;
+    quota_config.global_bytes = global_bytes;
+}
+
+/**
+ * @brief Account for messages stored (positive) or removed (negative) and their bytes.
+ */
+void quota_track(int64_t messages, int64_t bytes) {
+    __atomic_fetch_add(&quota_counters.messages, (uint64_t)messages, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&quota_counters.bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Decide whether a message of length bytes fits in a mailbox that holds messages messages of bytes bytes.
+ * The global limit is soft: concurrent senders of different shards may go past it by one message each.
+ * @return 0 -> It fits, 1 -> Refuse it (counted as rejected)
+ */
+uint8_t quota_admit(unsigned int messages, uint64_t bytes, size_t length) {
+    if ((quota_config.recipient_messages > 0 && messages >= quota_config.recipient_messages) ||
+        (quota_config.recipient_bytes > 0 && bytes + length > quota_config.recipient_bytes) ||
+        (quota_config.global_bytes > 0 &&
+         __atomic_load_n(&quota_counters.bytes, __ATOMIC_RELAXED) + length > quota_config.global_bytes)) {
+        __atomic_fetch_add(&quota_counters.rejected, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get a copy of the counters of the mailboxes.
+ */
+QuotaStats quota_stats() {
+    QuotaStats copy;
+    copy.messages = __atomic_load_n(&quota_counters.messages, __ATOMIC_RELAXED);
+    copy.bytes = __atomic_load_n(&quota_counters.bytes, __ATOMIC_RELAXED);
+    copy.rejected = __atomic_load_n(&quota_counters.rejected, __ATOMIC_RELAXED);
+    return copy;
+}
+
+/**
+ * @brief Display the counters of the mailboxes and the largest ones.
+ * @param hot MailboxUsage* (largest mailboxes, the largest first)
+ * @param count number of mailboxes in hot
+ */
+void display_quota_stats(MailboxUsage *hot, int count) {
+    QuotaStats copy = quota_stats();
+    printf("📮 Waiting: %lu messages, %lu of %lu bytes, %lu SENDs refused (mailbox full)\n",
+           (unsigned long)copy.messages, (unsigned long)copy.bytes, (unsigned long)quota_config.global_bytes,
+           (unsigned long)copy.rejected);
+    for (int i = 0; i < count; i++) {
+        printf("   %-20s %10u messages %12lu bytes\n", hot[i].alias, hot[i].messages, (unsigned long)hot[i].bytes);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * File: quota.h
+ * Authors: 100451339 & 100451170
+ *
+ * Limits of the messages waiting for disconnected users, in memory or spilled: per recipient (messages and
+ * bytes) and over all the mailboxes (bytes). A SEND that would go past a limit is refused with
+ * SEND_MAILBOX_FULL instead of being stored. The counters are updated as messages are stored and removed, so
+ * checking a limit never walks a mailbox. Messages restored from the log or a snapshot are never refused.
+ */
+
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEND_MAILBOX_FULL 3                     // Error code of SEND: the mailbox of the receiver is full, retry later
+#define DEFAULT_QUOTA_MESSAGES 100000           // Messages waiting for one recipient when -q is not given
+#define DEFAULT_QUOTA_KB 16384                  // KiB waiting for one recipient when -Q is not given
+#define DEFAULT_QUOTA_GLOBAL_MB 4096            // MiB waiting over all the mailboxes when -G is not given
+#define HOT_MAILBOXES 10                        // Mailboxes listed by the statistics, the largest first
+
+// Limits of the mailboxes (0 -> no limit)
+typedef struct
+{
+    unsigned int recipient_messages;    // Messages waiting for one recipient
+    uint64_t recipient_bytes;           // Bytes of the messages waiting for one recipient
+    uint64_t global_bytes;              // Bytes of the messages waiting over all the mailboxes
+} QuotaConfig;
+
+// Counters of the mailboxes
+typedef struct
+{
+    uint64_t messages;                  // Messages waiting
+    uint64_t bytes;                     // Bytes of the messages waiting
+    uint64_t rejected;                  // SENDs refused because a mailbox was full
+} QuotaStats;
+
+// Usage of the mailbox of one recipient
+typedef struct
+{
+    char alias[256];                    // Alias of the recipient
+    unsigned int messages;              // Messages waiting (including the ones being delivered)
+    uint64_t bytes;                     // Bytes of the messages waiting
+} MailboxUsage;
+
+extern QuotaConfig quota_config;
+
+/**
+ * @brief Set the limits of the mailboxes (0 -> no limit).
+ */
+void quota_configure(unsigned int recipient_messages, uint64_t recipient_bytes, uint64_t global_bytes);
+
+/**
+ * @brief Account for messages stored (positive) or removed (negative) and their bytes.
+ */
+void quota_track(int64_t messages, int64_t bytes);
+
+/**
+ * @brief Decide whether a message of length bytes fits in a mailbox that holds messages messages of bytes bytes.
+ * The global limit is soft: concurrent senders of different shards may go past it by one message each.
+ * @return 0 -> It fits, 1 -> Refuse it (counted as rejected)
+ */
+uint8_t quota_admit(unsigned int messages, uint64_t bytes, size_t length);
+
+/**
+ * @brief Get a copy of the counters of the mailboxes.
+ */
+QuotaStats quota_stats();
+
+/**
+ * @brief Display the counters of the mailboxes and the largest ones.
+ * @param hot MailboxUsage* (largest mailboxes, the largest first)
+ * @param count number of mailboxes in hot
+ */
+void display_quota_stats(MailboxUsage *hot, int count);
+
+#endif
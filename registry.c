@@ -0,0 +1,63 @@
+/*
+ * File: registry.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "registry.h"
+
+/**
+ * @brief Give the block of a thread that ends to the next thread.
+ */
+void registry_release(void *block) {
+    __atomic_store_n(&((ThreadBlock *)block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get a block for the calling thread, reusing the one of a thread that ended or adding a new one zeroed.
+ * The caller keeps it (in a __thread variable) for the rest of the thread.
+ * @return NULL if there is no memory
+ */
+ThreadBlock *registry_acquire(BlockRegistry *registry) {
+    pthread_mutex_lock(&registry->mutex);
+    if (!registry->key_created) {
+        if (pthread_key_create(&registry->key, registry_release) != 0) {
+            pthread_mutex_unlock(&registry->mutex);
+            return NULL;
+        }
+        registry->key_created = 1;
+    }
+
+    ThreadBlock *block = registry->blocks;
+    while (block != NULL && __atomic_load_n(&block->in_use, __ATOMIC_ACQUIRE)) {
+        block = block->next;
+    }
+    if (block == NULL) {
+        // * aligned_alloc() wants a size that is a multiple of the alignment
+        size_t size = (registry->block_size + registry->alignment - 1) / registry->alignment * registry->alignment;
+        block = (ThreadBlock *)aligned_alloc(registry->alignment, size);
+        if (block != NULL) {
+            memset(block, 0, size);
+            block->next = registry->blocks;
+            __atomic_store_n(&registry->blocks, block, __ATOMIC_RELEASE);
+        }
+    }
+    if (block != NULL) {
+        block->in_use = 1;
+    }
+    pthread_mutex_unlock(&registry->mutex);
+
+    if (block != NULL) {
+        pthread_setspecific(registry->key, block);
+    }
+    return block;
+}
+
+/**
+ * @brief Get the first block of a registry, to walk them all through next.
+ */
+ThreadBlock *registry_blocks(BlockRegistry *registry) {
+    return __atomic_load_n(&registry->blocks, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,50 @@
+/*
+ * File: registry.h
+ * Authors: 100451339 & 100451170
+ *
+ * Registry of per-thread blocks: every thread gets a block of its own, so it can write it without locks, and a
+ * reader walks the blocks of all the threads. The block of a thread that ends is reused by the next thread, with
+ * its contents kept; blocks are never freed.
+ */
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Header at the beginning of every block
+typedef struct ThreadBlock
+{
+    int in_use;                         // 1 -> Owned by a running thread, 0 -> Reused by the next thread
+    struct ThreadBlock *next;           // Next block of the registry
+} ThreadBlock;
+
+// Blocks of one kind handed out to the threads
+typedef struct
+{
+    ThreadBlock *blocks;                // Blocks of every thread that has asked for one (atomic)
+    pthread_mutex_t mutex;              // Taken to hand out a block, never to use one
+    pthread_key_t key;                  // Gives the block back when its thread ends
+    int key_created;                    // 1 -> key is valid (protected by mutex)
+    size_t block_size;                  // Size of every block, header included
+    size_t alignment;                   // Alignment of every block
+} BlockRegistry;
+
+// Static initializer of a registry of blocks of the given type (which starts with a ThreadBlock)
+#define BLOCK_REGISTRY_INITIALIZER(type, block_alignment) \
+    { NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0, sizeof(type), (block_alignment) }
+
+/**
+ * @brief Get a block for the calling thread, reusing the one of a thread that ended or adding a new one zeroed.
+ * The caller keeps it (in a __thread variable) for the rest of the thread.
+ * @return NULL if there is no memory
+ */
+ThreadBlock *registry_acquire(BlockRegistry *registry);
+
+/**
+ * @brief Get the first block of a registry, to walk them all through next.
+ */
+ThreadBlock *registry_blocks(BlockRegistry *registry);
+
+#endif
@@ -3,6 +3,11 @@
  * Authors: 100451339 & 100451170
  */
 
+#include <pthread.h>   /* For the write mutex of pipelined sessions */
+
+#include "protocol.h"  /* For the framing of the requests */
+#include "lines.h"     /* For the replies waiting to be written by the reactor */
+
 // Enum to identify the operation to be performed
 typedef enum
 {
@@ -11,18 +16,32 @@ typedef enum
     CONNECT = 2,
     DISCONNECT = 3,
     SEND = 4,
-    CONNECTEDUSERS = 5
+    CONNECTEDUSERS = 5,
+    STATS = 6
 } OPERATION;
 
+// Number of operations
+#define NUM_OPERATIONS 7
+
 // Array to store the names of the operations
-char* OPERATION_NAMES[7] = {"REGISTER", "UNREGISTER", "CONNECT", "DISCONNECT",  "SEND", "CONNECTEDUSERS"};
+char* OPERATION_NAMES[NUM_OPERATIONS] = {"REGISTER", "UNREGISTER", "CONNECT", "DISCONNECT",  "SEND", "CONNECTEDUSERS", "STATS"};
 
 // Array to store the number of parameters that each operation needs
-int OPERATION_PARAMS[7] = {3, 1, 1, 1, 3, 1};
+// (CONNECT receives the alias and the listening port of the client)
+int OPERATION_PARAMS[NUM_OPERATIONS] = {3, 1, 2, 1, 3, 1, 0};
+
+// Maximum number of parameters of any operation
+#define MAX_PARAMS 3
 
 // Structure of the request
 typedef struct
 {
-    int socket; // Socket descriptor
-    char operation[256]; // Operation to be performed
+    int socket;                         // Socket descriptor
+    char *operation;                    // Operation to be performed (points into the LineReader buffer)
+    char *params[MAX_PARAMS];           // Parameters of the operation: 255 characters + '\0' (point into the LineReader buffer)
+    char client_IP[16];                 // IP address of the client "255.255.255.255" + '\0'
+    int client_port;                    // Port of the client
+    Framing framing;                    // Protocol of the connection and framing of the request being served
+    pthread_mutex_t *write_mutex;       // Taken to write to the socket when the requests are pipelined, NULL otherwise
+    LineWriter *output;                 // Replies the socket has not taken yet (epoll reactor), NULL -> Written at once
 } Request;
@@ -4,37 +4,76 @@
  */
 
 #include "servidor.h"
-
-// We'll use semaphores to control the access as readers/writers
-#include <semaphore.h>
+#include "presence.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "lockstats.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// The registry is split in shards by the hash of the alias, each one protected by its own readers/writer lock,
+// so operations on users of different shards do not wait for each other.
+// The status, IP and port of the users are also published in the presence directory (presence.c) while the lock
+// of the shard is held, so CONNECTEDUSERS and the connection status are read without taking any lock.
+// The mutations that must survive a restart are appended to the write-ahead log (wal.c) while the lock is held, and
+// committed once it has been released, so the writers of other shards do not wait for the disk.
+// A snapshot locks every shard only to start a new segment of the log and fork(): the child writes the registry
+// as it was at that point while the parent goes on serving (copy-on-write).
+// Built with LOCK_STATS=1, every wrapper times how long it waits for the locks it takes and how long it holds
+// them (lockstats.c).
 #include <pthread.h>
 
-UserList *user_list = NULL;
+#define REGISTRY_SHARD_BITS 6                           // log2 of the number of shards
+#define REGISTRY_SHARDS (1 << REGISTRY_SHARD_BITS)      // Number of shards of the registry
 
-// The wait() and post() semaphores are atomic -> do not assure order
+typedef struct
+{
+    pthread_rwlock_t lock;                              // Readers/writer lock of the shard
+    UserList *list;                                     // Users whose alias hashes to the shard
+} __attribute__((aligned(64))) RegistryShard;           // One cache line per shard (no false sharing)
 
-sem_t writer_sem;                                       // semaphores for readers and writers
-pthread_mutex_t reader_mut = PTHREAD_MUTEX_INITIALIZER; // mutex for the reader_count variable and its initialization
-int reader_count = 0;                                   // number of readers reading
-uint8_t is_semaphore_initialized = false;                  // semaphore initialization flag
-uint8_t is_list_created = false;                           // linked list creation flag
+RegistryShard shards[REGISTRY_SHARDS];
+pthread_once_t registry_once = PTHREAD_ONCE_INIT;       // Initialization of the shards (only once)
 
-void init_sem()
+/**
+ * @brief Create the shards. Writers are preferred, so a stream of readers cannot starve them.
+ */
+void create_shards()
 {
-    // Initialize the semaphore
-    pthread_mutex_lock(&reader_mut);
-    if (!is_list_created)
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
     {
-        user_list = create_user_list();
-        is_list_created = true;
+        pthread_rwlock_init(&shards[i].lock, &attr);
+        shards[i].list = create_user_list();
     }
+    pthread_rwlockattr_destroy(&attr);
+}
 
-    if (!is_semaphore_initialized)
-    {
-        sem_init(&writer_sem, 0, 1);
-        is_semaphore_initialized = true;
-    }
-    pthread_mutex_unlock(&reader_mut);
+void init_sem()
+{
+    // Initialize the shards if they are not initialized
+    pthread_once(&registry_once, create_shards);
+}
+
+/**
+ * @brief Get the shard of an alias.
+ * The shard is taken from the top bits of the hash: the index of each shard uses the low bits.
+ */
+RegistryShard *shard_of(char *alias)
+{
+    return &shards[hash_alias(alias) >> (64 - REGISTRY_SHARD_BITS)];
+}
+
+/**
+ * @brief Get the list of the shard of an alias (used to load a snapshot).
+ */
+UserList *shard_list(const char *alias)
+{
+    return shard_of((char *)alias)->list;
 }
 
 /**
@@ -44,17 +83,27 @@ void init_sem()
  */
 int list_init()
 {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
-
-    // initialize linked list
-    int error_code = init(user_list);
-
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
+    // Writer gets the locks of all the shards, in order
+    int error_code = 0;
+    LOCK_TIMER_START(timer);
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
+    {
+        pthread_rwlock_wrlock(&shards[i].lock);
+        if (init(shards[i].list) != 0)
+        {
+            error_code = -1;
+        }
+    }
+    LOCK_TIMER_ACQUIRED(timer);
+    presence_clear();
+    for (int i = REGISTRY_SHARDS - 1; i >= 0; i--)
+    {
+        pthread_rwlock_unlock(&shards[i].lock);
+    }
+    LOCK_TIMER_RELEASED(timer, LOCK_INIT);
 
     return error_code;
 }
@@ -69,17 +118,37 @@ int list_init()
  * @return 0 -> Success, 1 -> User already exists, 2 -> Error
  */
 uint8_t list_register_user(char *ip, char *port, char *name, char *alias, char *birth) {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
 
     // Create user in the linked list
-    int error_code = register_user(user_list, ip, port, name, alias, birth);
+    int error_code = register_user(shard->list, ip, port, name, alias, birth);
+    if (error_code == 0 && presence_set(alias, PRESENCE_DISCONNECTED, ip, port) != 0)
+    {
+        unregister_user(shard->list, alias);
+        error_code = 2;
+    }
+    uint64_t lsn = 0;
+    if (error_code == 0)
+    {
+        const char *fields[] = {ip, port, name, alias, birth};
+        lsn = wal_append(WAL_REGISTER, fields, 5);
+    }
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_REGISTER);
+
+    if (wal_commit(lsn) != 0)
+    {
+        error_code = 2;
+    }
 
     return error_code;
 }
@@ -90,18 +159,34 @@ uint8_t list_register_user(char *ip, char *port, char *name, char *alias, char *
  * @return 0 -> Success, 1 -> User not found, 2 -> Error
  */
 uint8_t list_unregister_user(char *alias) {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
-     
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
-    
+
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
+
     // Delete user from the linked list
-    int error_code = unregister_user(user_list, alias);
+    int error_code = unregister_user(shard->list, alias);
+    uint64_t lsn = 0;
+    if (error_code == 0)
+    {
+        presence_set(alias, PRESENCE_UNREGISTERED, NULL, NULL);
+        const char *fields[] = {alias};
+        lsn = wal_append(WAL_UNREGISTER, fields, 1);
+    }
+
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_UNREGISTER);
+
+    if (wal_commit(lsn) != 0)
+    {
+        error_code = 2;
+    }
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
-    
     return error_code;
 }
 
@@ -113,17 +198,25 @@ uint8_t list_unregister_user(char *alias) {
  * @return a struct ConnectionResult with error code 0 -> Success, 1 -> User not found, 2 -> User already connected, 3 -> Error
  */
 ConnectionResult list_connect_user(char *ip, char *port, char *alias) {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
-    
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
+
     // Connect user in the linked list
-    ConnectionResult result = connect_user(user_list, ip, port, alias);
+    ConnectionResult result = connect_user(shard->list, ip, port, alias);
+    if (result.error_code == 0)
+    {
+        presence_set(alias, PRESENCE_CONNECTED, ip, port);
+    }
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_CONNECT);
 
     return result;
 }
@@ -136,209 +229,493 @@ ConnectionResult list_connect_user(char *ip, char *port, char *alias) {
  * @return 0 -> Success, 1 -> User not found, 2 -> User already disconnected, 3 -> Error
  */
 uint8_t list_disconnect_user(char *ip, char *alias) {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
-    
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
+
     // Disconnect user in the linked list
-    int error_code = disconnect_user(user_list, ip, alias);
+    int error_code = disconnect_user(shard->list, ip, alias);
+    if (error_code == 0)
+    {
+        presence_set(alias, PRESENCE_DISCONNECTED, NULL, NULL);
+    }
+
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_DISCONNECT);
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
-    
     return error_code;
 }
 
 /**
  * @brief Search for all connected users in the list.
+ * It reads the presence directory: it never fails because of writers and never blocks them.
  * @param alias char*
  * @return ConnectedUsers struct with error_code: 0 -> Success, 1 -> User not connected, 2 -> User not found, 3 -> Error
  */
 ConnectedUsers list_connected_users(char *alias) {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Acquire the reader mutex
-    pthread_mutex_lock(&reader_mut);
-
-    // Increment the reader count
-    reader_count++;
-
-    // If it's the first reader, try to get the write semaphore
-    if (reader_count == 1)
-    {
-        if (sem_trywait(&writer_sem) != 0)
-        {
-            pthread_mutex_unlock(&reader_mut);
-            sem_post(&writer_sem);
-            ConnectedUsers connected_users_result;
-            // TODO: Cuidao con valgrind (no se si es necesario inicializarlo) -> connected_users_result.alias
-            connected_users_result.size = 0;
-            connected_users_result.error_code = 3;
-            return connected_users_result;
-        }
-    }
-
-    // Release the reader mutex
-    pthread_mutex_unlock(&reader_mut);
-
-    // Search for all connected users in the linked list
-    ConnectedUsers connected_users_result = connected_users(user_list, alias);
-
-    // Acquire the reader mutex
-    pthread_mutex_lock(&reader_mut);
-
-    // Decrement the reader count
-    reader_count--;
-
-    // If it's the last reader, release the write semaphore
-    if (reader_count == 0)
-    {
-        sem_post(&writer_sem);
-    }
-
-    // Release the reader mutex
-    pthread_mutex_unlock(&reader_mut);
-
-    return connected_users_result;
+    return presence_connected_users(alias);
 }
 
 
 /**
  * @brief Send a message from a user to another user.
+ * The locks of both shards are taken in the order of the shards, so two opposite sends cannot deadlock.
  * @param sourceAlias char*
  * @param destAlias char*
  * @param message char*
  * @return 0 -> Success, 1 -> Destination user not found, 2 -> Error
  */
 ReceiverMessage list_send_message(char *sourceAlias, char *destAlias, char *message) {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
-    
+    // Writer tries to get the locks of the shards of both users (once if they are the same)
+    RegistryShard *source_shard = shard_of(sourceAlias);
+    RegistryShard *dest_shard = shard_of(destAlias);
+    RegistryShard *first = source_shard < dest_shard ? source_shard : dest_shard;
+    RegistryShard *second = source_shard < dest_shard ? dest_shard : source_shard;
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&first->lock);
+    if (second != first)
+    {
+        pthread_rwlock_wrlock(&second->lock);
+    }
+    LOCK_TIMER_ACQUIRED(timer);
+
     // Send message in the linked list
-    ReceiverMessage result = send_message(user_list, sourceAlias, destAlias, message);
+    ReceiverMessage result = send_message(source_shard->list, dest_shard->list, sourceAlias, destAlias, message);
+
+    // Only the stored messages are logged: the others are not kept by the server
+    uint64_t lsn = 0;
+    if (result.error_code == 0 && result.stored == 1)
+    {
+        char msgId[11], id[11];
+        sprintf(msgId, "%u", result.msgId);
+        sprintf(id, "%u", result.id);
+        const char *fields[] = {sourceAlias, destAlias, msgId, message, id};
+        lsn = wal_append(WAL_STORE, fields, 5);
+    }
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
+    // Writer releases the locks of the shards
+    if (second != first)
+    {
+        pthread_rwlock_unlock(&second->lock);
+    }
+    pthread_rwlock_unlock(&first->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_SEND);
+
+    if (wal_commit(lsn) != 0)
+    {
+        result.error_code = 2;
+    }
 
     return result;
 }
 
 ConnectionStatus list_get_connection_status(char *alias) {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Acquire the reader mutex
-    pthread_mutex_lock(&reader_mut);
+    // Read the presence directory (no lock)
+    return presence_get(alias);
+}
 
-    // Increment the reader count
-    reader_count++;
+int list_display_user_list()
+{
+    // Initialize the shards if they are not initialized
+    init_sem();
 
-    // If it's the first reader, try to get the write semaphore
-    if (reader_count == 1)
+    // Display the linked list of each shard
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
     {
-        if (sem_trywait(&writer_sem) != 0)
-        {
-            pthread_mutex_unlock(&reader_mut);
-            sem_post(&writer_sem);
-            ConnectionStatus connection_status_result;
-            connection_status_result.error_code = 2;
-            return connection_status_result;
-        }
+        LOCK_TIMER_START(timer);
+        pthread_rwlock_rdlock(&shards[i].lock);
+        LOCK_TIMER_ACQUIRED(timer);
+        display_users(shards[i].list);
+        pthread_rwlock_unlock(&shards[i].lock);
+        LOCK_TIMER_RELEASED(timer, LOCK_DISPLAY);
     }
 
-    // Release the reader mutex
-    pthread_mutex_unlock(&reader_mut);
+    return 0;
+}
+
+int list_display_pending_messages_list(char* alias)
+{
+    // Initialize the shards if they are not initialized
+    init_sem();
 
-    // Search for all connected users in the linked list
-    ConnectionStatus connection_status_result = get_connection_status(user_list, alias);
+    // Reader gets the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_rdlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
 
-    // Acquire the reader mutex
-    pthread_mutex_lock(&reader_mut);
+    // Display the linked list
+    display_pending_messages(shard->list, alias);
+
+    // Reader releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_DISPLAY);
 
-    // Decrement the reader count
-    reader_count--;
+    return 0;
+}
 
-    // If it's the last reader, release the write semaphore
-    if (reader_count == 0)
+void request_delete_list()
+{
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
     {
-        sem_post(&writer_sem);
+        if (shards[i].list == NULL) {
+            continue;
+        }
+        LOCK_TIMER_START(timer);
+        pthread_rwlock_wrlock(&shards[i].lock);
+        LOCK_TIMER_ACQUIRED(timer);
+        delete_user_list(shards[i].list);
+        free(shards[i].list);
+        shards[i].list = NULL;
+        pthread_rwlock_unlock(&shards[i].lock);
+        LOCK_TIMER_RELEASED(timer, LOCK_DELETE_LIST);
     }
+    presence_destroy();
+}
 
-    // Release the reader mutex
-    pthread_mutex_unlock(&reader_mut);
+/**
+ * @brief Find the largest mailboxes (by bytes waiting), the largest first.
+ * It takes the read lock of every shard in turn, so it must not be called from a signal handler.
+ * @param hot MailboxUsage* (room for max mailboxes)
+ * @param max int
+ * @return the number of mailboxes found
+ * @note This is a READER function.
+ */
+int list_hot_mailboxes(MailboxUsage *hot, int max)
+{
+    // Initialize the shards if they are not initialized
+    init_sem();
 
-    return connection_status_result;
+    int count = 0;
+    for (int i = 0; i < REGISTRY_SHARDS && max > 0; i++)
+    {
+        LOCK_TIMER_START(timer);
+        pthread_rwlock_rdlock(&shards[i].lock);
+        LOCK_TIMER_ACQUIRED(timer);
+        for (UserEntry *user = shards[i].list->head; user != NULL; user = user->next)
+        {
+            MailboxUsage usage;
+            mailbox_usage(user, &usage.messages, &usage.bytes);
+            if (usage.messages == 0 || (count == max && usage.bytes <= hot[count - 1].bytes))
+            {
+                continue;
+            }
+
+            // Insert it in order, dropping the smallest one if there is no room
+            int pos = count < max ? count++ : max - 1;
+            while (pos > 0 && hot[pos - 1].bytes < usage.bytes)
+            {
+                hot[pos] = hot[pos - 1];
+                pos--;
+            }
+            strcpy(usage.alias, user->alias->str);
+            hot[pos] = usage;
+        }
+        pthread_rwlock_unlock(&shards[i].lock);
+        LOCK_TIMER_RELEASED(timer, LOCK_HOT_MAILBOXES);
+    }
+    return count;
 }
 
-int list_display_user_list()
+/**
+ * @brief Count the users of the registry.
+ * @return the number of registered users
+ * @note This is a READER function.
+ */
+long list_count_users()
 {
-    // Initialize the semaphore if it is not initialized
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
+    long users = 0;
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
+    {
+        LOCK_TIMER_START(timer);
+        pthread_rwlock_rdlock(&shards[i].lock);
+        LOCK_TIMER_ACQUIRED(timer);
+        users += shards[i].list->size;
+        pthread_rwlock_unlock(&shards[i].lock);
+        LOCK_TIMER_RELEASED(timer, LOCK_COUNT_USERS);
+    }
+    return users;
+}
 
-    // Display the linked list
-    display_users(user_list);
+/**
+ * @brief Remove the oldest count messages of a list detached by a CONNECT, once they have been delivered, and
+ * record their identifiers. The lock of the shard of the user orders the records with the messages stored for the
+ * user, and keeps a snapshot from seeing the messages removed but not the records.
+ * @param alias char*
+ * @param detached MessageList*
+ * @param count unsigned int
+ * @param delivered MessageEntry** (the removed entries, to be deleted by the caller)
+ * @param error_code uint8_t* (0 -> Success, 2 -> Error logging the delivery: the messages are removed anyway)
+ * @return the number of messages removed
+ */
+unsigned int list_pop_delivered(char *alias, MessageList *detached, unsigned int count, MessageEntry **delivered,
+                                uint8_t *error_code) {
+    // Initialize the shards if they are not initialized
+    init_sem();
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
 
-    return 0;
+    unsigned int popped = 0;
+    while (popped < count && (delivered[popped] = pop_pending_message(detached)) != NULL) {
+        popped++;
+    }
+    // * One record per run of consecutive identifiers: a list given back after a failed delivery is followed by
+    // the messages stored meanwhile (nothing is logged, nor waited for, if the list was already empty)
+    uint64_t lsn = 0;
+    int failed = 0;
+    for (unsigned int start = 0, end; start < popped; start = end)
+    {
+        end = start + 1;
+        while (end < popped && delivered[end]->id == delivered[end - 1]->id + 1)
+        {
+            end++;
+        }
+        char first_str[11], count_str[11];
+        sprintf(first_str, "%u", delivered[start]->id);
+        sprintf(count_str, "%u", end - start);
+        const char *fields[] = {alias, first_str, count_str};
+        uint64_t record = wal_append(WAL_DELIVERED, fields, 3);
+        if (record == WAL_ERROR)
+        {
+            failed = 1;
+        }
+        else
+        {
+            lsn = record;
+        }
+    }
+
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_POP_DELIVERED);
+
+    *error_code = wal_commit(lsn) != 0 || failed ? 2 : 0;
+
+    return popped;
 }
 
-int list_display_pending_messages_list(char* alias)
-{
-    // Initialize the semaphore if it is not initialized
+/**
+ * @brief Forget a list detached by a CONNECT once all its messages have been delivered, so it can be freed.
+ * @param alias char*
+ * @param detached MessageList*
+ */
+void list_finish_delivery(char *alias, MessageList *detached) {
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
 
-    // Display the linked list
-    display_pending_messages(user_list, alias);
+    finish_delivery(shard->list, alias, detached);
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_FINISH_DELIVERY);
+}
 
-    return 0;
+/**
+ * @brief Apply a record of the log to the registry.
+ * The log is replayed before the server accepts any client, so the shards are not locked.
+ */
+void apply_record(uint8_t type, char **fields, int count) {
+    switch (type)
+    {
+    case WAL_REGISTER:
+        if (count == 5)
+        {
+            list_register_user(fields[0], fields[1], fields[2], fields[3], fields[4]);
+        }
+        break;
+    case WAL_UNREGISTER:
+        if (count == 1)
+        {
+            list_unregister_user(fields[0]);
+        }
+        break;
+    case WAL_STORE:
+        if (count == 5)
+        {
+            restore_message(shard_of(fields[0])->list, shard_of(fields[1])->list, fields[0], fields[1],
+                            (unsigned int)strtoul(fields[2], NULL, 10), (unsigned int)strtoul(fields[4], NULL, 10),
+                            fields[3]);
+        }
+        break;
+    case WAL_DELIVERED:
+        if (count == 3)
+        {
+            drop_delivered_messages(shard_of(fields[0])->list, fields[0], (unsigned int)strtoul(fields[1], NULL, 10),
+                                    (unsigned int)strtoul(fields[2], NULL, 10));
+        }
+        break;
+    default:
+        break;
+    }
 }
 
-void request_delete_list()
-{
-    if (user_list == NULL) {
-        return;
+/**
+ * @brief Rebuild the registry from the last snapshot and the segments of the write-ahead log after it.
+ * It must be called before the log is opened and before any client is served.
+ * @param path const char* (path of the log; the snapshot is "<path>.snapshot")
+ * @param users long* (users loaded from the snapshot)
+ * @param generation uint64_t* (generation of the next segment of the log)
+ * @return the number of records applied, -1 -> Error
+ */
+long list_recover(const char *path, long *users, uint64_t *generation) {
+    // Initialize the shards if they are not initialized
+    init_sem();
+
+    char snapshot[4200];
+    snprintf(snapshot, sizeof(snapshot), "%s.snapshot", path);
+    uint64_t first;
+    *users = snapshot_load(snapshot, shard_list, &first);
+    if (*users == -1) {
+        return -1;
     }
-    delete_user_list(user_list);
-    free(user_list);
+
+    return wal_replay(path, first, apply_record, generation);
 }
 
-uint8_t list_delete_message(char* alias, unsigned int num) {
-    // Initialize the semaphore if it is not initialized
+/**
+ * @brief Take a snapshot of the registry and delete the segments of the log it replaces.
+ * Every shard is locked only while a new segment of the log is started and the server forks: the child writes the
+ * snapshot from its copy of the registry and the parent waits for it without any lock.
+ * @param path const char* (path of the log; the snapshot is "<path>.snapshot")
+ * @return the generation of the first segment after the snapshot, 0 -> Error
+ */
+uint64_t list_snapshot(const char *path) {
+    // Initialize the shards if they are not initialized
     init_sem();
 
-    // Writer tries to get the write semaphore
-    sem_wait(&writer_sem);
+    char snapshot[4200];
+    snprintf(snapshot, sizeof(snapshot), "%s.snapshot", path);
 
-    // Display the linked list
-    uint8_t error_code = delete_message(user_list, alias, num);
+    // Writer gets the locks of all the shards, in order: no change can be appended to the log meanwhile
+    LOCK_TIMER_START(timer);
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
+    {
+        pthread_rwlock_wrlock(&shards[i].lock);
+    }
+    LOCK_TIMER_ACQUIRED(timer);
+    uint64_t generation = wal_rotate();
+    pid_t pid = generation == 0 ? -1 : fork();
+    if (pid == 0)
+    {
+        UserList *lists[REGISTRY_SHARDS];
+        for (int i = 0; i < REGISTRY_SHARDS; i++)
+        {
+            lists[i] = shards[i].list;
+        }
+        _exit(snapshot_write(snapshot, lists, REGISTRY_SHARDS, generation) == 0 ? 0 : 1);
+    }
+    for (int i = REGISTRY_SHARDS - 1; i >= 0; i--)
+    {
+        pthread_rwlock_unlock(&shards[i].lock);
+    }
+    LOCK_TIMER_RELEASED(timer, LOCK_SNAPSHOT);
+    if (pid == -1)
+    {
+        return 0;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            return 0;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return 0;
+    }
+
+    wal_remove_segments(generation);
+    return generation;
+}
+
+/**
+ * @brief Give back to a user the pending messages that could not be delivered after a CONNECT.
+ * @param alias char*
+ * @param detached MessageList* (consumed)
+ * @return 0 -> Success, 1 -> User not found (the messages are dropped), 2 -> Error
+ */
+uint8_t list_reattach_pending_messages(char *alias, MessageList *detached) {
+    // Initialize the shards if they are not initialized
+    init_sem();
 
-    // Writer releases the write semaphore
-    sem_post(&writer_sem);
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
+
+    // Put the messages back in the linked list
+    uint8_t error_code = reattach_pending_messages(shard->list, alias, detached);
+
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_REATTACH);
 
     return error_code;
 }
 
+/**
+ * @brief Detach the pending messages of a connected user, to deliver them without holding the lock.
+ * @param alias char*
+ * @return NULL if the user does not exist, is not connected or has no pending messages. Otherwise, the detached list.
+ */
+MessageList *list_detach_pending_messages(char *alias) {
+    // Initialize the shards if they are not initialized
+    init_sem();
+
+    // Writer tries to get the lock of the shard
+    RegistryShard *shard = shard_of(alias);
+    LOCK_TIMER_START(timer);
+    pthread_rwlock_wrlock(&shard->lock);
+    LOCK_TIMER_ACQUIRED(timer);
+
+    // Detach the messages from the linked list
+    MessageList *detached = detach_pending_messages(shard->list, alias);
+
+    // Writer releases the lock of the shard
+    pthread_rwlock_unlock(&shard->lock);
+    LOCK_TIMER_RELEASED(timer, LOCK_DETACH);
+
+    return detached;
+}
+
 void print_connected_users(ConnectedUsers connected_users_result) {
     printf("\nConnected users (size: %d, error code: %d):\n", connected_users_result.size, connected_users_result.error_code);
+    char *alias = connected_users_result.aliases;
     for (unsigned int i = 0; i < connected_users_result.size; i++) {
-        printf("\t👤 Alias: %s\n", connected_users_result.alias[i]);
+        printf("\t👤 Alias: %s\n", alias);
+        alias += strlen(alias) + 1;
     }
     printf("\n");
 }
@@ -102,12 +102,72 @@ int list_display_pending_messages_list(char* alias);
 void request_delete_list();
 
 /**
- * @brief Delete a message from the user list with the given alias and number.
- * 
+ * @brief Find the largest mailboxes (by bytes waiting), the largest first.
+ * It takes the read lock of every shard in turn, so it must not be called from a signal handler.
+ * @param hot MailboxUsage* (room for max mailboxes)
+ * @param max int
+ * @return the number of mailboxes found
+ * @note This is a READER function.
+ */
+int list_hot_mailboxes(MailboxUsage *hot, int max);
+
+/**
+ * @brief Count the users of the registry.
+ * @return the number of registered users
+ * @note This is a READER function.
+ */
+long list_count_users();
+
+/**
+ * @brief Remove the oldest count messages of a list detached by a CONNECT, once they have been delivered, and
+ * record it in the log.
+ * @param alias char*
+ * @param detached MessageList*
+ * @param count unsigned int
+ * @param delivered MessageEntry** (the removed entries, to be deleted by the caller)
+ * @param error_code uint8_t* (0 -> Success, 2 -> Error logging the delivery: the messages are removed anyway)
+ * @return the number of messages removed
+ */
+unsigned int list_pop_delivered(char *alias, MessageList *detached, unsigned int count, MessageEntry **delivered,
+                                uint8_t *error_code);
+
+/**
+ * @brief Forget a list detached by a CONNECT once all its messages have been delivered, so it can be freed.
+ * @param alias char*
+ * @param detached MessageList*
+ */
+void list_finish_delivery(char *alias, MessageList *detached);
+
+/**
+ * @brief Rebuild the registry from the last snapshot and the segments of the write-ahead log after it.
+ * It must be called before the log is opened and before any client is served.
+ * @param path const char* (path of the log; the snapshot is "<path>.snapshot")
+ * @param users long* (users loaded from the snapshot)
+ * @param generation uint64_t* (generation of the next segment of the log)
+ * @return the number of records applied, -1 -> Error
+ */
+long list_recover(const char *path, long *users, uint64_t *generation);
+
+/**
+ * @brief Take a snapshot of the registry and delete the segments of the log it replaces.
+ * @param path const char* (path of the log; the snapshot is "<path>.snapshot")
+ * @return the generation of the first segment after the snapshot, 0 -> Error
+ */
+uint64_t list_snapshot(const char *path);
+
+/**
+ * @brief Give back to a user the pending messages that could not be delivered after a CONNECT.
+ * @param alias char*
+ * @param detached MessageList* (consumed)
+ * @return 0 -> Success, 1 -> User not found (the messages are dropped), 2 -> Error
+ */
+uint8_t list_reattach_pending_messages(char *alias, MessageList *detached);
+
+/**
+ * @brief Detach the pending messages of a connected user, to deliver them without holding the lock.
  * @param alias char*
- * @param num unsigned int
- * @return error code 0 -> Success, 1 -> Error 
+ * @return NULL if the user does not exist, is not connected or has no pending messages. Otherwise, the detached list.
  */
-uint8_t list_delete_message(char *alias, unsigned int num);
+MessageList *list_detach_pending_messages(char *alias);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,217 @@
+/*
+ * File: slab.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+// Objects of a pool cached by a thread, so most allocations and frees do not lock the pool
+typedef struct
+{
+    SlabPool *pool;                     // Pool of the objects, NULL if the cache is not used
+    size_t count;                       // Number of cached objects
+    void *objects[SLAB_CACHE_SIZE];     // Cached objects
+} ThreadCache;
+
+__thread ThreadCache thread_caches[SLAB_MAX_POOLS];
+
+int slab_huge_pages = 0;                // Back the slabs with huge pages
+pthread_key_t slab_thread_key;          // Key whose destructor gives the thread caches back
+pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Give count objects of a thread cache back to its pool. The pool must be locked.
+ */
+void release_objects(ThreadCache *cache, size_t count) {
+    SlabPool *pool = cache->pool;
+    while (count > 0 && cache->count > 0) {
+        void *object = cache->objects[--cache->count];
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+        pool->free_count++;
+        count--;
+    }
+}
+
+/**
+ * @brief Destructor of the thread key: give every cached object back to its pool when the thread ends.
+ */
+void release_thread_caches(void *arg) {
+    (void)arg;
+    for (int i = 0; i < SLAB_MAX_POOLS; i++) {
+        ThreadCache *cache = &thread_caches[i];
+        if (cache->pool != NULL) {
+            pthread_mutex_lock(&cache->pool->mutex);
+            release_objects(cache, cache->count);
+            pthread_mutex_unlock(&cache->pool->mutex);
+            cache->pool = NULL;
+        }
+    }
+}
+
+void create_slab_key() {
+    pthread_key_create(&slab_thread_key, release_thread_caches);
+}
+
+/**
+ * @brief Get the cache of the calling thread for a pool.
+ * @return NULL if the thread already caches SLAB_MAX_POOLS other pools.
+ */
+ThreadCache *get_thread_cache(SlabPool *pool) {
+    for (int i = 0; i < SLAB_MAX_POOLS; i++) {
+        if (thread_caches[i].pool == pool) {
+            return &thread_caches[i];
+        }
+        if (thread_caches[i].pool == NULL) {
+            // First use of the pool by this thread: make sure the cache is given back when the thread ends
+            pthread_once(&slab_key_once, create_slab_key);
+            pthread_setspecific(slab_thread_key, thread_caches);
+            thread_caches[i].pool = pool;
+            thread_caches[i].count = 0;
+            return &thread_caches[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Map a new slab, with huge pages if they are enabled.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the slab.
+ */
+Slab *map_slab() {
+    void *memory = MAP_FAILED;
+    if (slab_huge_pages) {
+        memory = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        // No huge pages reserved: ask for transparent huge pages instead
+        if (slab_huge_pages) {
+            madvise(memory, SLAB_SIZE, MADV_HUGEPAGE);
+        }
+    }
+    Slab *slab = (Slab *)memory;
+    slab->next = NULL;
+    slab->carved = (sizeof(Slab) + 15) & ~(size_t)15;
+    return slab;
+}
+
+/**
+ * @brief Take an object from the free list of the pool or carve it from its slabs. The pool must be locked.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the object.
+ */
+void *take_object(SlabPool *pool) {
+    if (pool->free_list != NULL) {
+        void *object = pool->free_list;
+        pool->free_list = *(void **)object;
+        pool->free_count--;
+        return object;
+    }
+
+    if (pool->slabs == NULL || pool->slabs->carved + pool->object_size > SLAB_SIZE) {
+        Slab *slab = map_slab();
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_count++;
+    }
+
+    // Objects are carved lazily, so the pages of a slab are only touched when they are used
+    void *object = (char *)pool->slabs + pool->slabs->carved;
+    pool->slabs->carved += pool->object_size;
+    pool->carved_count++;
+    return object;
+}
+
+/**
+ * @brief Back the slabs created from now on with huge pages (falls back to normal pages if they are not available).
+ */
+void slab_set_huge_pages(int enabled) {
+    slab_huge_pages = enabled;
+}
+
+/**
+ * @brief Allocate an object of the pool. The memory is not initialised.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the object.
+ */
+void *slab_alloc(SlabPool *pool) {
+    ThreadCache *cache = get_thread_cache(pool);
+
+    if (cache == NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        void *object = take_object(pool);
+        pthread_mutex_unlock(&pool->mutex);
+        return object;
+    }
+
+    // Refill the cache with a batch of objects under a single lock
+    if (cache->count == 0) {
+        pthread_mutex_lock(&pool->mutex);
+        while (cache->count < SLAB_BATCH) {
+            void *object = take_object(pool);
+            if (object == NULL) {
+                break;
+            }
+            cache->objects[cache->count++] = object;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        if (cache->count == 0) {
+            return NULL;
+        }
+    }
+
+    return cache->objects[--cache->count];
+}
+
+/**
+ * @brief Give an object back to its pool. Does nothing if object is NULL.
+ */
+void slab_free(SlabPool *pool, void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    ThreadCache *cache = get_thread_cache(pool);
+
+    if (cache == NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+        pool->free_count++;
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+
+    // Give a batch back to the pool under a single lock when the cache is full
+    if (cache->count == SLAB_CACHE_SIZE) {
+        pthread_mutex_lock(&pool->mutex);
+        release_objects(cache, SLAB_BATCH);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    cache->objects[cache->count++] = object;
+}
+
+/**
+ * @brief Get the statistics of a pool.
+ */
+SlabStats slab_stats(SlabPool *pool) {
+    SlabStats stats;
+    pthread_mutex_lock(&pool->mutex);
+    stats.name = pool->name;
+    stats.object_size = pool->object_size;
+    stats.slabs = pool->slab_count;
+    stats.bytes = pool->slab_count * (size_t)SLAB_SIZE;
+    stats.objects_in_use = pool->carved_count - pool->free_count;
+    stats.objects_free = pool->free_count;
+    pthread_mutex_unlock(&pool->mutex);
+    return stats;
+}
@@ -0,0 +1,76 @@
+/*
+ * File: slab.h
+ * Authors: 100451339 & 100451170
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SLAB_SIZE (2 * 1024 * 1024)     // Bytes of every slab (the size of a huge page)
+#define SLAB_CACHE_SIZE 64              // Objects kept in the cache of every thread per pool
+#define SLAB_BATCH 32                   // Objects moved at once between a thread cache and its pool
+#define SLAB_MAX_POOLS 8                // Maximum number of pools with a thread cache
+
+// Header at the beginning of every slab
+typedef struct Slab
+{
+    struct Slab *next;                  // Next slab of the pool
+    size_t carved;                      // Bytes of the slab already handed out as objects
+} Slab;
+
+// Pool of fixed-size objects carved from slabs that are never returned to the system
+typedef struct
+{
+    const char *name;                   // Name of the pool, for the statistics
+    size_t object_size;                 // Size of every object (rounded up to 16 bytes)
+    pthread_mutex_t mutex;              // Mutex protecting the pool (not the thread caches)
+    void *free_list;                    // Freed objects, linked through their first word
+    size_t free_count;                  // Number of objects in free_list
+    Slab *slabs;                        // Slabs of the pool, the first one is being carved
+    size_t slab_count;                  // Number of slabs in use
+    size_t carved_count;                // Number of objects ever carved from the slabs
+} SlabPool;
+
+// Statistics of a pool
+typedef struct
+{
+    const char *name;                   // Name of the pool
+    size_t object_size;                 // Size of every object
+    size_t slabs;                       // Number of slabs in use
+    size_t bytes;                       // Bytes reserved by the slabs
+    size_t objects_in_use;              // Objects allocated or kept in a thread cache
+    size_t objects_free;                // Objects in the free list of the pool
+} SlabStats;
+
+// Static initializer of a pool of objects of the given size
+#define SLAB_POOL_INITIALIZER_SIZE(pool_name, size) \
+    { (pool_name), ((size) + 15) & ~(size_t)15, PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0 }
+
+// Static initializer of a pool of objects of the given type
+#define SLAB_POOL_INITIALIZER(pool_name, type) SLAB_POOL_INITIALIZER_SIZE(pool_name, sizeof(type))
+
+/**
+ * @brief Back the slabs created from now on with huge pages (falls back to normal pages if they are not available).
+ */
+void slab_set_huge_pages(int enabled);
+
+/**
+ * @brief Allocate an object of the pool. The memory is not initialised.
+ * @return NULL if there is no memory. Otherwise, return a pointer to the object.
+ */
+void *slab_alloc(SlabPool *pool);
+
+/**
+ * @brief Give an object back to its pool. Does nothing if object is NULL.
+ */
+void slab_free(SlabPool *pool, void *object);
+
+/**
+ * @brief Get the statistics of a pool.
+ */
+SlabStats slab_stats(SlabPool *pool);
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * File: snapshot.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "presence.h"
+
+// Buffered writer of a snapshot
+typedef struct
+{
+    int fd;                         // File of the snapshot
+    uint64_t offset;                // Bytes written so far (including the buffered ones)
+    size_t len;                     // Bytes buffered
+    char *data;                     // Buffer of SNAPSHOT_BUFFER_SIZE bytes
+    int error;                      // 1 -> A write failed
+} SnapshotWriter;
+
+/**
+ * @brief Write the buffered bytes to the file.
+ */
+void snapshot_flush(SnapshotWriter *writer) {
+    size_t written = 0;
+    while (!writer->error && written < writer->len) {
+        ssize_t n = write(writer->fd, writer->data + written, writer->len - written);
+        if (n == -1) {
+            writer->error = 1;
+            break;
+        }
+        written += (size_t)n;
+    }
+    writer->len = 0;
+}
+
+/**
+ * @brief Append len bytes to the snapshot.
+ */
+void snapshot_put(SnapshotWriter *writer, const void *data, size_t len) {
+    if (writer->len + len > SNAPSHOT_BUFFER_SIZE) {
+        snapshot_flush(writer);
+    }
+    memcpy(writer->data + writer->len, data, len);
+    writer->len += len;
+    writer->offset += len;
+}
+
+/**
+ * @brief Append zeros up to the next multiple of 8 bytes, where the next record starts.
+ */
+void snapshot_align(SnapshotWriter *writer) {
+    static const char zeros[8] = {0};
+    size_t padding = (8 - writer->offset % 8) % 8;
+    snapshot_put(writer, zeros, padding);
+}
+
+/**
+ * @brief Append a pending message.
+ */
+void snapshot_put_message(void *context, const char *source, unsigned int msgId, unsigned int id,
+                          const char *message) {
+    SnapshotWriter *writer = (SnapshotWriter *)context;
+    SnapshotMessage record;
+    record.msgId = msgId;
+    record.id = id;
+    record.source_length = (uint16_t)strlen(source);
+    record.length = (uint16_t)strlen(message);
+    snapshot_put(writer, &record, sizeof(record));
+    snapshot_put(writer, source, record.source_length + 1);
+    snapshot_put(writer, message, record.length + 1);
+    snapshot_align(writer);
+}
+
+/**
+ * @brief Append the messages of a list that are still pending, the ones in memory and then the spilled ones.
+ */
+void snapshot_put_messages(SnapshotWriter *writer, MessageList *messages) {
+    for (unsigned int num = messages->first; num != messages->next; num++) {
+        MessageEntry *current = get_pending_message(messages, num);
+        if (current != NULL) {
+            snapshot_put_message(writer, current->source->str, current->msgId, current->id, current->message);
+        }
+    }
+    if (messages->spill != NULL) {
+        uint64_t offset = messages->spill->head;
+        if (spill_read(messages->spill, &offset, messages->spill->count, snapshot_put_message, writer) !=
+            (int)messages->spill->count) {
+            writer->error = 1;
+        }
+    }
+}
+
+/**
+ * @brief Write a snapshot of the lists to path. The lists must not change meanwhile (the caller is the child of
+ * a fork(), or holds their locks).
+ * @return 0 -> Success, -1 -> Error
+ */
+int snapshot_write(const char *path, UserList **lists, int count, uint64_t generation) {
+    char temporary[4200];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    SnapshotWriter writer = {0};
+    writer.data = (char *)malloc(SNAPSHOT_BUFFER_SIZE);
+    SnapshotSection *sections = (SnapshotSection *)calloc(count, sizeof(SnapshotSection));
+    writer.fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer.data == NULL || sections == NULL || writer.fd == -1) {
+        free(writer.data);
+        free(sections);
+        if (writer.fd != -1) {
+            close(writer.fd);
+        }
+        return -1;
+    }
+
+    // * The header and the sections are written at the end, when they are known
+    SnapshotHeader header = {0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.generation = generation;
+    header.lists = (uint32_t)count;
+    snapshot_put(&writer, &header, sizeof(header));
+    snapshot_put(&writer, sections, count * sizeof(SnapshotSection));
+    snapshot_align(&writer);
+
+    for (int i = 0; i < count; i++) {
+        sections[i].offset = writer.offset;
+        for (UserEntry *user = lists[i]->head; user != NULL; user = user->next) {
+            // The messages being delivered are still pending: they go before the ones received since
+            uint32_t messages = pending_message_count(user->pendingMessages);
+            for (MessageList *inflight = user->inflight; inflight != NULL; inflight = inflight->next_inflight) {
+                messages += pending_message_count(inflight);
+            }
+
+            SnapshotUser record = {0};
+            record.alias_length = user->alias->length;
+            record.name_length = (uint16_t)strlen(user->name);
+            record.messages = messages;
+            record.messageId = user->messageId;
+            record.storedId = user->storedId;
+            memcpy(record.ip, user->ip, sizeof(record.ip));
+            memcpy(record.port, user->port, sizeof(record.port));
+            memcpy(record.birth, user->birth, sizeof(record.birth));
+            snapshot_put(&writer, &record, sizeof(record));
+            snapshot_put(&writer, user->alias->str, record.alias_length + 1);
+            snapshot_put(&writer, user->name, record.name_length + 1);
+            snapshot_align(&writer);
+
+            for (MessageList *inflight = user->inflight; inflight != NULL; inflight = inflight->next_inflight) {
+                snapshot_put_messages(&writer, inflight);
+            }
+            snapshot_put_messages(&writer, user->pendingMessages);
+
+            sections[i].users++;
+            header.users++;
+            header.messages += messages;
+        }
+    }
+    snapshot_flush(&writer);
+
+    header.size = writer.offset;
+    if (!writer.error &&
+        (pwrite(writer.fd, &header, sizeof(header), 0) != sizeof(header) ||
+         pwrite(writer.fd, sections, count * sizeof(SnapshotSection), sizeof(header)) !=
+             (ssize_t)(count * sizeof(SnapshotSection)) ||
+         fsync(writer.fd) != 0)) {
+        writer.error = 1;
+    }
+    close(writer.fd);
+    free(writer.data);
+    free(sections);
+
+    // * The snapshot replaces the previous one only once it is complete
+    if (writer.error || rename(temporary, path) != 0) {
+        unlink(temporary);
+        return -1;
+    }
+    char directory[4200];
+    snprintf(directory, sizeof(directory), "%s", path);
+    int dir_fd = open(dirname(directory), O_RDONLY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the record at offset if the len bytes after it are in the snapshot.
+ * @return NULL if the record is out of the snapshot
+ */
+const char *snapshot_record(const char *data, uint64_t size, uint64_t offset, uint64_t len) {
+    if (offset > size || len > size - offset) {
+        return NULL;
+    }
+    return data + offset;
+}
+
+/**
+ * @brief Get the offset of the record after one of len bytes that starts at offset.
+ */
+uint64_t snapshot_next(uint64_t offset, uint64_t len) {
+    return (offset + len + 7) & ~(uint64_t)7;
+}
+
+/**
+ * @brief Load a snapshot into the lists of the registry, which must be empty. The users are added to
+ * list_of(alias) and published in the presence directory.
+ * @param generation first segment of the log that must be replayed after the snapshot (0 if there is none)
+ * @return the number of users loaded, -1 -> Error (the snapshot is not valid)
+ */
+long snapshot_load(const char *path, UserList *(*list_of)(const char *alias), uint64_t *generation) {
+    *generation = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    uint64_t size = (uint64_t)info.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    const SnapshotSection *sections =
+        (const SnapshotSection *)snapshot_record(data, size, sizeof(SnapshotHeader),
+                                                 (uint64_t)header->lists * sizeof(SnapshotSection));
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->size != size ||
+        sections == NULL) {
+        munmap((void *)data, size);
+        return -1;
+    }
+
+    // * First the users, so the senders of the messages exist when the messages are added
+    long users = 0;
+    int valid = 1;
+    for (uint32_t i = 0; i < header->lists && valid; i++) {
+        uint64_t offset = sections[i].offset;
+        UserList *list = NULL;
+        for (uint64_t u = 0; u < sections[i].users && valid; u++) {
+            const SnapshotUser *record = (const SnapshotUser *)snapshot_record(data, size, offset, sizeof(SnapshotUser));
+            const char *alias = record == NULL ? NULL :
+                snapshot_record(data, size, offset + sizeof(SnapshotUser),
+                                (uint64_t)record->alias_length + record->name_length + 2);
+            if (alias == NULL || alias[record->alias_length] != '\0' ||
+                alias[record->alias_length + 1 + record->name_length] != '\0') {
+                valid = 0;
+                break;
+            }
+            const char *name = alias + record->alias_length + 1;
+
+            // The users of a section belong to the same list: its index is sized once
+            if (list == NULL) {
+                list = list_of(alias);
+                reserve_users(list, list->size + sections[i].users);
+            }
+            UserEntry *user = restore_user(list, record->ip, record->port, name, alias, record->birth,
+                                           record->messageId);
+            if (user == NULL ||
+                presence_set((char *)alias, PRESENCE_DISCONNECTED, (char *)record->ip, (char *)record->port) != 0) {
+                valid = 0;
+                break;
+            }
+            user->storedId = record->storedId;
+            users++;
+
+            // Skip the messages of the user
+            offset = snapshot_next(offset, sizeof(SnapshotUser) + record->alias_length + record->name_length + 2);
+            for (uint32_t m = 0; m < record->messages; m++) {
+                const SnapshotMessage *message =
+                    (const SnapshotMessage *)snapshot_record(data, size, offset, sizeof(SnapshotMessage));
+                if (message == NULL) {
+                    valid = 0;
+                    break;
+                }
+                offset = snapshot_next(offset, sizeof(SnapshotMessage) + message->source_length + message->length + 2);
+            }
+        }
+    }
+
+    // * Then the pending messages of every user
+    for (uint32_t i = 0; i < header->lists && valid; i++) {
+        uint64_t offset = sections[i].offset;
+        for (uint64_t u = 0; u < sections[i].users && valid; u++) {
+            const SnapshotUser *record = (const SnapshotUser *)(data + offset);
+            const char *alias = data + offset + sizeof(SnapshotUser);
+            offset = snapshot_next(offset, sizeof(SnapshotUser) + record->alias_length + record->name_length + 2);
+            if (record->messages == 0) {
+                continue;
+            }
+            UserEntry *user = search(list_of(alias), (char *)alias);
+
+            Alias *source = NULL;       // Alias of the sender of the previous message
+            for (uint32_t m = 0; m < record->messages; m++) {
+                const SnapshotMessage *message = (const SnapshotMessage *)(data + offset);
+                const char *source_str = snapshot_record(data, size, offset + sizeof(SnapshotMessage),
+                                                         (uint64_t)message->source_length + message->length + 2);
+                if (user == NULL || source_str == NULL || source_str[message->source_length] != '\0' ||
+                    source_str[message->source_length + 1 + message->length] != '\0') {
+                    valid = 0;
+                    break;
+                }
+                const char *text = source_str + message->source_length + 1;
+                offset = snapshot_next(offset, sizeof(SnapshotMessage) + message->source_length + message->length + 2);
+
+                // Consecutive messages usually come from the same sender; a sender that no longer exists gets
+                // an alias of its own
+                if (source == NULL || strcmp(source->str, source_str) != 0) {
+                    if (source != NULL) {
+                        alias_unref(source);
+                    }
+                    UserEntry *sender = search(list_of(source_str), (char *)source_str);
+                    source = sender != NULL ? sender->alias : create_alias(source_str);
+                    if (source == NULL) {
+                        valid = 0;
+                        break;
+                    }
+                    if (sender != NULL) {
+                        alias_ref(source);
+                    }
+                }
+                if (enqueue_message(user->pendingMessages, source, message->msgId, message->id, (char *)text) != 0) {
+                    valid = 0;
+                    break;
+                }
+            }
+            if (source != NULL) {
+                alias_unref(source);
+            }
+        }
+    }
+
+    *generation = header->generation;
+    munmap((void *)data, size);
+    return valid ? users : -1;
+}
@@ -0,0 +1,82 @@
+/*
+ * File: snapshot.h
+ * Authors: 100451339 & 100451170
+ *
+ * Snapshot of the registry: a flat file of fixed-size headers and strings, located by offsets, that is mapped
+ * with mmap() and read in place when the server starts. Every record starts at a multiple of 8 bytes.
+ *
+ *   file:     SnapshotHeader | SnapshotSection[lists] | users of list 0 | users of list 1 | ...
+ *   user:     SnapshotUser | alias '\0' | name '\0' | its pending messages, oldest first
+ *   message:  SnapshotMessage | source alias '\0' | message '\0'
+ *
+ * The file is written to "<path>.tmp" and renamed when it is complete, so a snapshot is either whole or absent.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "LinkedList.h"
+
+#define SNAPSHOT_MAGIC "REGSNAP2"           // First bytes of a snapshot
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)      // Bytes written with each write()
+
+// Header of a snapshot
+typedef struct
+{
+    char magic[8];                  // SNAPSHOT_MAGIC
+    uint64_t generation;            // First segment of the log that is not included in the snapshot
+    uint64_t size;                  // Bytes of the file
+    uint64_t users;                 // Number of users
+    uint64_t messages;              // Number of pending messages
+    uint32_t lists;                 // Number of sections (one per shard of the registry)
+    uint32_t reserved;
+} SnapshotHeader;
+
+// Users of one list of the registry
+typedef struct
+{
+    uint64_t offset;                // Offset of the first user
+    uint64_t users;                 // Number of users
+} SnapshotSection;
+
+// User, followed by its alias, its name and its pending messages
+typedef struct
+{
+    uint16_t alias_length;          // Length of the alias
+    uint16_t name_length;           // Length of the name
+    uint32_t messages;              // Number of pending messages after the user
+    uint32_t messageId;             // Last ID of the message sent by the user
+    uint32_t storedId;              // Identifier of the last message stored for the user
+    char ip[16];                    // IP address of the user
+    char port[6];                   // Port of the user
+    char birth[11];                 // Birth of the user
+    char padding[3];
+} SnapshotUser;
+
+// Pending message, followed by the alias of its sender and its text
+typedef struct
+{
+    uint32_t msgId;                 // Message ID sent by the sending user
+    uint32_t id;                    // Identifier of the message in the mailbox of the user
+    uint16_t source_length;         // Length of the alias of the sender
+    uint16_t length;                // Length of the message
+} SnapshotMessage;
+
+/**
+ * @brief Write a snapshot of the lists to path. The lists must not change meanwhile (the caller is the child of
+ * a fork(), or holds their locks).
+ * @return 0 -> Success, -1 -> Error
+ */
+int snapshot_write(const char *path, UserList **lists, int count, uint64_t generation);
+
+/**
+ * @brief Load a snapshot into the lists of the registry, which must be empty. The users are added to
+ * list_of(alias) and published in the presence directory.
+ * @param generation first segment of the log that must be replayed after the snapshot (0 if there is none)
+ * @return the number of users loaded, -1 -> Error (the snapshot is not valid)
+ */
+long snapshot_load(const char *path, UserList *(*list_of)(const char *alias), uint64_t *generation);
+
+#endif
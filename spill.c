@@ -0,0 +1,199 @@
+/*
+ * File: spill.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spill.h"
+
+SpillConfig spill_config = {DEFAULT_SPILL_DIRECTORY, (uint64_t)DEFAULT_SPILL_MEMORY_MB << 20,
+                            DEFAULT_SPILL_USER_MESSAGES};
+SpillStats spill_counters;                                  // Updated atomically by the writers of every shard
+
+/**
+ * @brief Set the directory of the spill files and the limits that decide when a message is spilled.
+ * @return 0 -> Success, -1 -> Error (the directory cannot be written)
+ */
+int spill_configure(const char *directory, uint64_t memory_budget, unsigned int user_messages) {
+    if (strlen(directory) >= sizeof(spill_config.directory) || access(directory, W_OK | X_OK) != 0) {
+        return -1;
+    }
+    strcpy(spill_config.directory, directory);
+    spill_config.memory_budget = memory_budget;
+    spill_config.user_messages = user_messages;
+    return 0;
+}
+
+/**
+ * @brief Account for bytes of pending messages added to (positive) or removed from (negative) memory.
+ */
+void spill_track_memory(int64_t bytes) {
+    __atomic_fetch_add(&spill_counters.memory, (uint64_t)bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Decide whether the next message of a mailbox that holds messages messages in memory must be spilled.
+ * A mailbox always keeps its oldest message in memory, so it can be delivered without reading the disk.
+ * @return 1 -> Spill it, 0 -> Keep it in memory
+ */
+int spill_needed(unsigned int messages) {
+    if (messages == 0) {
+        return 0;
+    }
+    return messages >= spill_config.user_messages ||
+           __atomic_load_n(&spill_counters.memory, __ATOMIC_RELAXED) >= spill_config.memory_budget;
+}
+
+/**
+ * @brief Create an empty spill file in the spill directory.
+ * @return NULL if the file cannot be created. Otherwise, return a pointer to the spill file.
+ */
+SpillFile *spill_create() {
+    SpillFile *file = (SpillFile *)malloc(sizeof(SpillFile));
+    if (file == NULL) {
+        return NULL;
+    }
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/mailbox-XXXXXX", spill_config.directory);
+    file->fd = mkstemp(path);
+    if (file->fd == -1) {
+        free(file);
+        return NULL;
+    }
+    // * Nobody opens it by name: it is deleted when it is closed, or when the server dies
+    unlink(path);
+    file->head = 0;
+    file->tail = 0;
+    file->count = 0;
+    __atomic_fetch_add(&spill_counters.files, 1, __ATOMIC_RELAXED);
+    return file;
+}
+
+/**
+ * @brief Append a message to a spill file.
+ * @return 0 -> Success, 1 -> Error (nothing is appended)
+ */
+uint8_t spill_append(SpillFile *file, const char *source, unsigned int msgId, unsigned int id, const char *message,
+                     size_t length) {
+    char record[sizeof(SpillRecord) + 2 * 256];
+    SpillRecord header;
+    header.msgId = msgId;
+    header.id = id;
+    header.source_length = (uint16_t)strnlen(source, 255);
+    header.length = (uint16_t)length;
+
+    size_t size = 0;
+    memcpy(record, &header, sizeof(header));
+    size += sizeof(header);
+    memcpy(record + size, source, header.source_length);
+    size += header.source_length;
+    record[size++] = '\0';
+    memcpy(record + size, message, header.length);
+    size += header.length;
+    record[size++] = '\0';
+
+    if (pwrite(file->fd, record, size, (off_t)file->tail) != (ssize_t)size) {
+        return 1;
+    }
+    file->tail += size;
+    file->count++;
+    __atomic_fetch_add(&spill_counters.messages, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&spill_counters.bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&spill_counters.spilled, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Read up to max messages of a spill file from *offset on, calling visit for each one, and move *offset
+ * after them. The file is not changed, so a snapshot can read it while the owner goes on.
+ * @return the number of messages read, -1 -> Error
+ */
+int spill_read(SpillFile *file, uint64_t *offset, unsigned int max,
+               void (*visit)(void *context, const char *source, unsigned int msgId, unsigned int id,
+                             const char *message),
+               void *context) {
+    char buffer[SPILL_READ_SIZE];
+    unsigned int count = 0;
+    while (count < max && *offset < file->tail) {
+        size_t want = file->tail - *offset < SPILL_READ_SIZE ? (size_t)(file->tail - *offset) : SPILL_READ_SIZE;
+        ssize_t got = pread(file->fd, buffer, want, (off_t)*offset);
+        if (got <= 0) {
+            return -1;
+        }
+
+        // * Every whole record of the buffer (a record is much smaller than the buffer)
+        size_t pos = 0;
+        while (count < max && pos + sizeof(SpillRecord) <= (size_t)got) {
+            SpillRecord header;
+            memcpy(&header, buffer + pos, sizeof(header));
+            size_t size = sizeof(header) + header.source_length + header.length + 2;
+            if (pos + size > (size_t)got) {
+                break;
+            }
+            const char *source = buffer + pos + sizeof(header);
+            visit(context, source, header.msgId, header.id, source + header.source_length + 1);
+            pos += size;
+            count++;
+        }
+        if (pos == 0) {
+            return -1;
+        }
+        *offset += pos;
+    }
+    return (int)count;
+}
+
+/**
+ * @brief Forget the count oldest messages of a spill file, once they have been read with spill_read() from its head.
+ */
+void spill_consume(SpillFile *file, uint64_t head, unsigned int count) {
+    __atomic_fetch_sub(&spill_counters.messages, count, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&spill_counters.bytes, head - file->head, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&spill_counters.refilled, count, __ATOMIC_RELAXED);
+    file->head = head;
+    file->count -= count;
+}
+
+/**
+ * @brief Close a spill file and free it.
+ */
+void spill_destroy(SpillFile *file) {
+    if (file == NULL) {
+        return;
+    }
+    __atomic_fetch_sub(&spill_counters.messages, file->count, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&spill_counters.bytes, file->tail - file->head, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&spill_counters.files, 1, __ATOMIC_RELAXED);
+    close(file->fd);
+    free(file);
+}
+
+/**
+ * @brief Get a copy of the counters of the spill files.
+ */
+SpillStats spill_stats() {
+    SpillStats copy;
+    copy.memory = __atomic_load_n(&spill_counters.memory, __ATOMIC_RELAXED);
+    copy.files = __atomic_load_n(&spill_counters.files, __ATOMIC_RELAXED);
+    copy.messages = __atomic_load_n(&spill_counters.messages, __ATOMIC_RELAXED);
+    copy.bytes = __atomic_load_n(&spill_counters.bytes, __ATOMIC_RELAXED);
+    copy.spilled = __atomic_load_n(&spill_counters.spilled, __ATOMIC_RELAXED);
+    copy.refilled = __atomic_load_n(&spill_counters.refilled, __ATOMIC_RELAXED);
+    return copy;
+}
+
+/**
+ * @brief Display the counters of the spill files.
+ */
+void display_spill_stats() {
+    SpillStats copy = spill_stats();
+    printf("💾 Mailboxes: %lu of %lu bytes of memory, %lu on disk with %lu messages (%lu bytes), "
+           "%lu spilled, %lu read back\n",
+           (unsigned long)copy.memory, (unsigned long)spill_config.memory_budget, (unsigned long)copy.files,
+           (unsigned long)copy.messages, (unsigned long)copy.bytes,
+           (unsigned long)copy.spilled, (unsigned long)copy.refilled);
+}
@@ -0,0 +1,128 @@
+/*
+ * File: spill.h
+ * Authors: 100451339 & 100451170
+ *
+ * Second tier of the mailboxes: once a mailbox holds too many messages in memory, or the pending messages of all
+ * the mailboxes take more memory than the budget, the new messages of the mailbox are appended to a file of its
+ * own and read back in order, a batch at a time, when the ones in memory have been delivered.
+ *
+ *   record:   SpillRecord | source alias '\0' | message '\0'
+ *
+ * The files are unlinked as soon as they are created: they hold no state of their own (the log and the snapshots
+ * have every pending message) and disappear with the server. A snapshot reads them through the descriptors it
+ * inherits, which stay valid when the parent closes them.
+ */
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_SPILL_DIRECTORY "/tmp"          // Directory of the spill files when -S is not given
+#define DEFAULT_SPILL_MEMORY_MB 256             // Memory budget of the pending messages (MiB) when -M is not given
+#define DEFAULT_SPILL_USER_MESSAGES 1024        // Messages of a mailbox kept in memory when -N is not given
+#define SPILL_READ_SIZE 65536                   // Bytes read from a spill file at once
+#define SPILL_REFILL_MESSAGES 256               // Messages moved back to memory at once
+
+// Spilled messages of a mailbox, oldest first
+typedef struct
+{
+    int fd;                         // File of the messages (already unlinked)
+    uint64_t head;                  // Offset of the oldest spilled message
+    uint64_t tail;                  // Offset where the next message is appended
+    unsigned int count;             // Number of spilled messages
+} SpillFile;
+
+// Header of a spilled message
+typedef struct
+{
+    uint32_t msgId;                 // Message ID sent by the sending user
+    uint32_t id;                    // Identifier of the message in the mailbox of the receiver
+    uint16_t source_length;         // Length of the alias of the sender
+    uint16_t length;                // Length of the message
+} SpillRecord;
+
+// Limits that decide when a message is spilled
+typedef struct
+{
+    char directory[4096];           // Directory of the spill files
+    uint64_t memory_budget;         // Bytes of pending messages kept in memory over all the mailboxes
+    unsigned int user_messages;     // Messages of a mailbox kept in memory
+} SpillConfig;
+
+// Counters of the spill files
+typedef struct
+{
+    uint64_t memory;                // Bytes of the pending messages kept in memory
+    uint64_t files;                 // Spill files open
+    uint64_t messages;              // Messages in the spill files
+    uint64_t bytes;                 // Bytes of the messages in the spill files
+    uint64_t spilled;               // Messages ever written to a spill file
+    uint64_t refilled;              // Messages ever read back from a spill file
+} SpillStats;
+
+extern SpillConfig spill_config;
+
+/**
+ * @brief Set the directory of the spill files and the limits that decide when a message is spilled.
+ * @return 0 -> Success, -1 -> Error (the directory cannot be written)
+ */
+int spill_configure(const char *directory, uint64_t memory_budget, unsigned int user_messages);
+
+/**
+ * @brief Account for bytes of pending messages added to (positive) or removed from (negative) memory.
+ */
+void spill_track_memory(int64_t bytes);
+
+/**
+ * @brief Decide whether the next message of a mailbox that holds messages messages in memory must be spilled.
+ * A mailbox always keeps its oldest message in memory, so it can be delivered without reading the disk.
+ * @return 1 -> Spill it, 0 -> Keep it in memory
+ */
+int spill_needed(unsigned int messages);
+
+/**
+ * @brief Create an empty spill file in the spill directory.
+ * @return NULL if the file cannot be created. Otherwise, return a pointer to the spill file.
+ */
+SpillFile *spill_create();
+
+/**
+ * @brief Append a message to a spill file.
+ * @return 0 -> Success, 1 -> Error (nothing is appended)
+ */
+uint8_t spill_append(SpillFile *file, const char *source, unsigned int msgId, unsigned int id, const char *message,
+                     size_t length);
+
+/**
+ * @brief Read up to max messages of a spill file from *offset on, calling visit for each one, and move *offset
+ * after them. The file is not changed, so a snapshot can read it while the owner goes on.
+ * @return the number of messages read, -1 -> Error
+ */
+int spill_read(SpillFile *file, uint64_t *offset, unsigned int max,
+               void (*visit)(void *context, const char *source, unsigned int msgId, unsigned int id,
+                             const char *message),
+               void *context);
+
+/**
+ * @brief Forget the count oldest messages of a spill file, once they have been read with spill_read() from its head.
+ */
+void spill_consume(SpillFile *file, uint64_t head, unsigned int count);
+
+/**
+ * @brief Close a spill file and free it.
+ */
+void spill_destroy(SpillFile *file);
+
+/**
+ * @brief Get a copy of the counters of the spill files.
+ */
+SpillStats spill_stats();
+
+/**
+ * @brief Display the counters of the spill files.
+ */
+void display_spill_stats();
+
+#endif
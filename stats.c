@@ -0,0 +1,128 @@
+/*
+ * File: stats.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <string.h>
+
+#include "stats.h"
+
+BlockRegistry stats_registry = BLOCK_REGISTRY_INITIALIZER(ThreadStats, 64);    // Blocks of every thread that has recorded
+__thread ThreadStats *stats_local = NULL;                                       // Block of the calling thread
+
+/**
+ * @brief Get the block of the calling thread. The block of a thread that ends keeps its counters.
+ * @return NULL if there is no memory
+ */
+ThreadStats *stats_block() {
+    if (stats_local == NULL) {
+        stats_local = (ThreadStats *)registry_acquire(&stats_registry);
+    }
+    return stats_local;
+}
+
+/**
+ * @brief Get the bucket of a latency: the power of two below it and the next STATS_SUB_BUCKET_BITS bits.
+ */
+int stats_bucket(uint64_t ns) {
+    if (ns < STATS_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (int)((ns >> (exponent - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1));
+    return (exponent - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/**
+ * @brief Get the largest latency of a bucket (see stats_bucket()).
+ */
+uint64_t stats_bucket_limit(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int exponent = bucket / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+    uint64_t sub = (uint64_t)(bucket % STATS_SUB_BUCKETS);
+    uint64_t low = (1ULL << exponent) + (sub << (exponent - STATS_SUB_BUCKET_BITS));
+    return low + (1ULL << (exponent - STATS_SUB_BUCKET_BITS)) - 1;
+}
+
+/**
+ * @brief Record a request of the calling thread.
+ * @param operation opcode of the request (0 to STATS_OPERATIONS - 1)
+ * @param error_code error code of its reply
+ * @param latency_ns time it took
+ */
+void stats_record(int operation, uint8_t error_code, uint64_t latency_ns) {
+    ThreadStats *block = stats_block();
+    if (block == NULL || operation < 0 || operation >= STATS_OPERATIONS) {
+        return;
+    }
+    OperationStats *counters = &block->operations[operation];
+    int error = error_code < STATS_ERROR_CODES ? error_code : STATS_ERROR_CODES - 1;
+    int bucket = stats_bucket(latency_ns);
+
+    // Only this thread writes the block: the stores are atomic so a reader never sees a torn counter
+    __atomic_store_n(&counters->count, counters->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters->errors[error], counters->errors[error] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters->latency_ns, counters->latency_ns + latency_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters->buckets[bucket], counters->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    if (latency_ns > counters->max_ns) {
+        __atomic_store_n(&counters->max_ns, latency_ns, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Add up the counters of every thread.
+ * @param merged OperationStats[STATS_OPERATIONS]
+ */
+void stats_merge(OperationStats *merged) {
+    memset(merged, 0, STATS_OPERATIONS * sizeof(OperationStats));
+    for (ThreadBlock *next = registry_blocks(&stats_registry); next != NULL; next = next->next) {
+        ThreadStats *block = (ThreadStats *)next;
+        for (int i = 0; i < STATS_OPERATIONS; i++) {
+            OperationStats *from = &block->operations[i];
+            OperationStats *to = &merged[i];
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            for (int e = 0; e < STATS_ERROR_CODES; e++) {
+                to->errors[e] += __atomic_load_n(&from->errors[e], __ATOMIC_RELAXED);
+            }
+            to->latency_ns += __atomic_load_n(&from->latency_ns, __ATOMIC_RELAXED);
+            uint64_t max_ns = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+            if (max_ns > to->max_ns) {
+                to->max_ns = max_ns;
+            }
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                to->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Get the latency below which a fraction of the requests of an operation took (the upper bound of the
+ * bucket where it falls).
+ * @return the latency in nanoseconds, 0 if there are no requests
+ */
+uint64_t stats_percentile(const OperationStats *operation, double fraction) {
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        total += operation->buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    // Rank of the request (1-based) that the percentile falls on
+    uint64_t rank = (uint64_t)(fraction * total + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += operation->buckets[b];
+        if (seen >= rank) {
+            uint64_t limit = stats_bucket_limit(b);
+            return limit < operation->max_ns ? limit : operation->max_ns;
+        }
+    }
+    return operation->max_ns;
+}
@@ -0,0 +1,62 @@
+/*
+ * File: stats.h
+ * Authors: 100451339 & 100451170
+ *
+ * Counters and latency histograms of the requests. Every thread records into its own block, so recording is a
+ * few increments of memory no other thread writes; a reader adds up the blocks of all the threads.
+ * The latencies are kept in logarithmic buckets: STATS_SUB_BUCKETS per power of two, so a percentile is exact
+ * to within 1 / STATS_SUB_BUCKETS of its value.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "registry.h"
+
+#define STATS_OPERATIONS 7              // Operations with counters (the opcodes of the requests)
+#define STATS_ERROR_CODES 8             // Error codes counted one by one (the last one also counts the higher ones)
+#define STATS_SUB_BUCKET_BITS 2         // log2 of the buckets per power of two
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+// Counters of one operation
+typedef struct
+{
+    uint64_t count;                             // Requests
+    uint64_t errors[STATS_ERROR_CODES];         // Requests by the error code of their reply
+    uint64_t latency_ns;                        // Sum of the latencies
+    uint64_t max_ns;                            // Longest latency
+    uint64_t buckets[STATS_BUCKETS];            // Requests by latency (see stats_bucket())
+} OperationStats;
+
+// Counters of the operations executed by one thread
+typedef struct
+{
+    ThreadBlock block;                          // Header of the block in the registry (must be first)
+    OperationStats operations[STATS_OPERATIONS];
+} ThreadStats;
+
+/**
+ * @brief Record a request of the calling thread.
+ * @param operation opcode of the request (0 to STATS_OPERATIONS - 1)
+ * @param error_code error code of its reply
+ * @param latency_ns time it took
+ */
+void stats_record(int operation, uint8_t error_code, uint64_t latency_ns);
+
+/**
+ * @brief Add up the counters of every thread.
+ * @param merged OperationStats[STATS_OPERATIONS]
+ */
+void stats_merge(OperationStats *merged);
+
+/**
+ * @brief Get the latency below which a fraction of the requests of an operation took (the upper bound of the
+ * bucket where it falls).
+ * @return the latency in nanoseconds, 0 if there are no requests
+ */
+uint64_t stats_percentile(const OperationStats *operation, double fraction);
+
+#endif
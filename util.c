@@ -0,0 +1,32 @@
+/*
+ * File: util.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <time.h>
+
+#include "util.h"
+
+/**
+ * @brief Get the current monotonic time in nanoseconds.
+ */
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Hash the listener of a client (64-bit FNV-1a of "ip:port"), to find it in the tables keyed by listener.
+ */
+uint64_t listener_hash(const char *ip, const char *port) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = ip; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    hash = (hash ^ ':') * 1099511628211ULL;
+    for (const char *c = port; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return hash;
+}
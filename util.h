@@ -0,0 +1,23 @@
+/*
+ * File: util.h
+ * Authors: 100451339 & 100451170
+ *
+ * Helpers shared by the modules of the server.
+ */
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+
+/**
+ * @brief Get the current monotonic time in nanoseconds.
+ */
+uint64_t now_ns();
+
+/**
+ * @brief Hash the listener of a client (64-bit FNV-1a of "ip:port"), to find it in the tables keyed by listener.
+ */
+uint64_t listener_hash(const char *ip, const char *port);
+
+#endif
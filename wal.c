@@ -0,0 +1,508 @@
+/*
+ * File: wal.c
+ * Authors: 100451339 & 100451170
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "logger.h"
+
+int wal_fd = -1;                                        // Segment of the log being written, -1 -> Nothing is logged
+WAL_MODE wal_mode = WAL_NONE;
+char wal_base_path[4096];                               // Path of the log, without the generation
+uint64_t wal_generation = 0;                            // Generation of the segment being written
+
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex protecting the buffers and the positions
+pthread_cond_t wal_flushed = PTHREAD_COND_INITIALIZER;  // Signaled when a flush ends
+pthread_cond_t wal_wakeup;                              // Wakes up the background thread early
+pthread_t wal_thread;                                   // Background thread (none and batched)
+int wal_stopping = 0;                                   // 1 -> The background thread must end
+
+char *wal_buffer = NULL;            // Records appended and not written yet
+size_t wal_len = 0;                 // Bytes of wal_buffer in use
+size_t wal_capacity = 0;            // Bytes allocated for wal_buffer
+char *wal_spare = NULL;             // Buffer being written by the flush in progress (swapped with wal_buffer)
+size_t wal_spare_capacity = 0;      // Bytes allocated for wal_spare
+
+uint64_t appended_lsn = 0;          // Position of the end of the last appended record
+uint64_t durable_lsn = 0;           // Position up to which the log has been written (and synced, unless none)
+int flushing = 0;                   // 1 -> A thread is writing wal_spare
+int wal_failed = 0;                 // 1 -> A write to the log failed: the records are no longer durable
+
+WalStats wal_counters = {0};        // Counters of the log (protected by wal_mutex)
+
+uint32_t crc_table[256];
+pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fill the table of the CRC-32 (polynomial 0xEDB88320).
+ */
+void create_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+/**
+ * @brief Get the CRC-32 of len bytes.
+ */
+uint32_t wal_crc32(const char *data, size_t len) {
+    pthread_once(&crc_once, create_crc_table);
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Parse a durability mode ("none", "batched" or "per-op").
+ * @return the mode, -1 if the name is not valid
+ */
+int wal_parse_mode(const char *name) {
+    if (strcmp(name, "none") == 0) {
+        return WAL_NONE;
+    }
+    if (strcmp(name, "batched") == 0) {
+        return WAL_BATCHED;
+    }
+    if (strcmp(name, "per-op") == 0) {
+        return WAL_PER_OP;
+    }
+    return -1;
+}
+
+/**
+ * @brief Get the path of a segment of the log.
+ */
+void segment_path(char *segment, size_t size, const char *path, uint64_t generation) {
+    snprintf(segment, size, "%s.%lu", path, (unsigned long)generation);
+}
+
+/**
+ * @brief Delete the segments of the log in path before generation (from the newest one down to the first missing).
+ */
+void wal_remove_segments_of(const char *path, uint64_t generation) {
+    char segment[4200];
+    while (generation > 0) {
+        generation--;
+        segment_path(segment, sizeof(segment), path, generation);
+        if (unlink(segment) != 0) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Apply the records of a segment in order, calling apply for each one, and cut off a torn tail.
+ * @return the number of records applied, -1 -> Error
+ */
+long replay_segment(const char *path, void (*apply)(uint8_t type, char **fields, int count)) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)info.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    // The fields are handed out in place: the mapping is private, so the file is not changed
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    long records = 0;
+    size_t offset = 0;
+    while (size - offset >= WAL_HEADER_SIZE) {
+        uint32_t length;
+        uint32_t crc;
+        memcpy(&length, data + offset, sizeof(length));
+        memcpy(&crc, data + offset + 4, sizeof(crc));
+        char *payload = data + offset + WAL_HEADER_SIZE;
+        if (length < 2 || length > WAL_MAX_RECORD || size - offset - WAL_HEADER_SIZE < length ||
+            payload[length - 1] != '\0' || wal_crc32(payload, length) != crc) {
+            break;
+        }
+
+        char *fields[WAL_MAX_FIELDS];
+        int count = 0;
+        char *field = payload + 1;
+        while (field < payload + length && count < WAL_MAX_FIELDS) {
+            fields[count++] = field;
+            field += strlen(field) + 1;
+        }
+        if (field < payload + length) {
+            break;
+        }
+
+        apply((uint8_t)payload[0], fields, count);
+        records++;
+        offset += WAL_HEADER_SIZE + length;
+    }
+
+    munmap(data, size);
+    if (offset < size) {
+        logger_write(LOG_WARN, "s> Cutting off %zu bytes of incomplete records at the end of the log\n", size - offset);
+        if (ftruncate(fd, (off_t)offset) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return records;
+}
+
+/**
+ * @brief Apply the records of the segments of a log from generation first on, in order, calling apply for each
+ * one, and cut off a torn tail. The segments before first are deleted.
+ * @param next generation of the first segment that does not exist
+ * @return the number of records applied, -1 -> Error
+ */
+long wal_replay(const char *path, uint64_t first, void (*apply)(uint8_t type, char **fields, int count),
+                uint64_t *next) {
+    wal_remove_segments_of(path, first);
+
+    long records = 0;
+    uint64_t generation = first;
+    char segment[4200];
+    for (;; generation++) {
+        segment_path(segment, sizeof(segment), path, generation);
+        if (access(segment, F_OK) != 0) {
+            break;
+        }
+        long applied = replay_segment(segment, apply);
+        if (applied == -1) {
+            return -1;
+        }
+        records += applied;
+    }
+
+    *next = generation;
+    return records;
+}
+
+/**
+ * @brief Write the records appended so far (and sync them if sync is 1). The mutex must be locked and no flush
+ * may be in progress; it is unlocked while writing, so other threads keep appending to the other buffer.
+ * @return 0 -> Success, -1 -> Error
+ */
+int flush_locked(int sync) {
+    flushing = 1;
+    char *data = wal_buffer;
+    size_t data_capacity = wal_capacity;
+    size_t len = wal_len;
+    uint64_t target = appended_lsn;
+    wal_buffer = wal_spare;
+    wal_capacity = wal_spare_capacity;
+    wal_len = 0;
+    wal_spare = data;
+    wal_spare_capacity = data_capacity;
+    // After a failed write nothing else is written, so the file keeps being a valid prefix of the log
+    int error = wal_failed ? -1 : 0;
+    pthread_mutex_unlock(&wal_mutex);
+
+    uint64_t writes = 0;
+    size_t written = 0;
+    int write_errno = 0;
+    while (error == 0 && written < len) {
+        ssize_t n = write(wal_fd, data + written, len - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = -1;
+            write_errno = errno;
+            break;
+        }
+        written += (size_t)n;
+        writes++;
+    }
+    if (error == 0 && sync && fdatasync(wal_fd) == -1) {
+        error = -1;
+        write_errno = errno;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    wal_counters.writes += writes;
+    wal_counters.syncs += sync && len > 0;
+    if (error == 0) {
+        durable_lsn = target;
+    } else if (!wal_failed) {
+        wal_failed = 1;
+        logger_write(LOG_ERROR, "s> Error writing the log: %s\n", strerror(write_errno));
+    }
+    flushing = 0;
+    pthread_cond_broadcast(&wal_flushed);
+    return error;
+}
+
+/**
+ * @brief Background thread: write (none) or write and sync (batched) the log every WAL_BATCH_INTERVAL_MS
+ * @return NULL
+ */
+void *wal_writer(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&wal_mutex);
+    while (!wal_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += WAL_BATCH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wal_wakeup, &wal_mutex, &deadline);
+
+        if (!flushing && appended_lsn > durable_lsn) {
+            flush_locked(wal_mode == WAL_BATCHED);
+        }
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    return NULL;
+}
+
+/**
+ * @brief Open a new segment of the log for appending and start its background thread.
+ * Until the log is opened, nothing is logged.
+ * @return 0 -> Success, -1 -> Error
+ */
+int wal_open(const char *path, uint64_t generation, WAL_MODE mode) {
+    char segment[4200];
+    segment_path(segment, sizeof(segment), path, generation);
+    int fd = open(segment, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    snprintf(wal_base_path, sizeof(wal_base_path), "%s", path);
+    wal_generation = generation;
+    wal_fd = fd;
+    wal_mode = mode;
+    wal_stopping = 0;
+    pthread_mutex_unlock(&wal_mutex);
+
+    // ! With per-op durability every commit writes the log itself: no background thread
+    if (mode == WAL_PER_OP) {
+        return 0;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal_wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&wal_thread, NULL, wal_writer, NULL) != 0) {
+        wal_fd = -1;
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Append a record to the log buffer. It must be called while the registry lock of the change is held.
+ * @return the position the log reaches with the record (to wait for it with wal_commit()), 0 if nothing is logged
+ * (the log is not open), WAL_ERROR -> Error (the record is too long or there is no memory)
+ */
+uint64_t wal_append(uint8_t type, const char **fields, int count) {
+    if (wal_fd == -1) {
+        return 0;
+    }
+
+    size_t lengths[WAL_MAX_FIELDS];
+    uint32_t length = 1;
+    for (int i = 0; i < count; i++) {
+        lengths[i] = strlen(fields[i]) + 1;
+        length += lengths[i];
+    }
+    if (length > WAL_MAX_RECORD) {
+        logger_write(LOG_ERROR, "s> Error logging a record of %u bytes\n", length);
+        return WAL_ERROR;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    size_t needed = wal_len + WAL_HEADER_SIZE + length;
+    if (needed > wal_capacity) {
+        size_t capacity = wal_capacity == 0 ? 65536 : wal_capacity * 2;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(wal_buffer, capacity);
+        if (buffer == NULL) {
+            pthread_mutex_unlock(&wal_mutex);
+            logger_write(LOG_ERROR, "s> Error logging a record: no memory\n");
+            return WAL_ERROR;
+        }
+        wal_buffer = buffer;
+        wal_capacity = capacity;
+    }
+
+    // * The payload is built in place, then its header is written in front of it
+    char *record = wal_buffer + wal_len;
+    char *payload = record + WAL_HEADER_SIZE;
+    payload[0] = (char)type;
+    size_t offset = 1;
+    for (int i = 0; i < count; i++) {
+        memcpy(payload + offset, fields[i], lengths[i]);
+        offset += lengths[i];
+    }
+    uint32_t crc = wal_crc32(payload, length);
+    memcpy(record, &length, sizeof(length));
+    memcpy(record + 4, &crc, sizeof(crc));
+
+    wal_len = needed;
+    appended_lsn += WAL_HEADER_SIZE + length;
+    uint64_t lsn = appended_lsn;
+    wal_counters.records++;
+    wal_counters.bytes += WAL_HEADER_SIZE + length;
+    if (wal_mode != WAL_PER_OP && wal_len >= WAL_BUFFER_LIMIT) {
+        pthread_cond_signal(&wal_wakeup);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+
+    return lsn;
+}
+
+/**
+ * @brief Make the log durable up to position lsn, as the durability mode requires. Call it without any lock.
+ * With per-op durability, the first waiting thread writes and syncs every record appended so far while the others
+ * wait for it, so concurrent writers share one fsync (group commit).
+ * @return 0 -> Success, -1 -> Error writing the log (or lsn is WAL_ERROR)
+ */
+int wal_commit(uint64_t lsn) {
+    if (lsn == WAL_ERROR) {
+        return -1;
+    }
+    if (lsn == 0 || wal_mode != WAL_PER_OP) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    while (durable_lsn < lsn && !wal_failed) {
+        if (flushing) {
+            pthread_cond_wait(&wal_flushed, &wal_mutex);
+        } else {
+            flush_locked(1);
+        }
+    }
+    int error = durable_lsn < lsn ? -1 : 0;
+    pthread_mutex_unlock(&wal_mutex);
+
+    return error;
+}
+
+/**
+ * @brief Write and sync the records appended so far and go on in a new segment. No record may be appended
+ * meanwhile: the caller holds every lock of the registry.
+ * @return the generation of the new segment, 0 -> Error (or the log is not open)
+ */
+uint64_t wal_rotate() {
+    if (wal_fd == -1) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    while (flushing) {
+        pthread_cond_wait(&wal_flushed, &wal_mutex);
+    }
+    // The mutex is locked again when the flush ends, so no other flush can start before the switch
+    if (flush_locked(1) != 0) {
+        pthread_mutex_unlock(&wal_mutex);
+        return 0;
+    }
+
+    char segment[4200];
+    segment_path(segment, sizeof(segment), wal_base_path, wal_generation + 1);
+    int fd = open(segment, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        pthread_mutex_unlock(&wal_mutex);
+        return 0;
+    }
+    close(wal_fd);
+    wal_fd = fd;
+    wal_generation++;
+    uint64_t generation = wal_generation;
+    pthread_mutex_unlock(&wal_mutex);
+
+    return generation;
+}
+
+/**
+ * @brief Delete the segments of the log before generation, once a snapshot has replaced them.
+ */
+void wal_remove_segments(uint64_t generation) {
+    wal_remove_segments_of(wal_base_path, generation);
+}
+
+/**
+ * @brief Write and sync everything appended so far and close the log.
+ */
+void wal_close() {
+    if (wal_fd == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    if (wal_mode != WAL_PER_OP) {
+        wal_stopping = 1;
+        pthread_cond_signal(&wal_wakeup);
+        pthread_mutex_unlock(&wal_mutex);
+        pthread_join(wal_thread, NULL);
+        pthread_mutex_lock(&wal_mutex);
+    }
+    while (flushing) {
+        pthread_cond_wait(&wal_flushed, &wal_mutex);
+    }
+    flush_locked(1);
+    close(wal_fd);
+    wal_fd = -1;
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+/**
+ * @brief Get a copy of the counters of the log.
+ */
+WalStats wal_stats() {
+    pthread_mutex_lock(&wal_mutex);
+    WalStats copy = wal_counters;
+    pthread_mutex_unlock(&wal_mutex);
+    return copy;
+}
+
+/**
+ * @brief Display the counters of the log.
+ */
+void display_wal_stats() {
+    if (wal_fd == -1) {
+        return;
+    }
+    WalStats copy = wal_stats();
+    printf("s> WAL: %lu records, %lu bytes, %lu writes, %lu syncs\n",
+           (unsigned long)copy.records, (unsigned long)copy.bytes, (unsigned long)copy.writes,
+           (unsigned long)copy.syncs);
+}
@@ -0,0 +1,118 @@
+/*
+ * File: wal.h
+ * Authors: 100451339 & 100451170
+ *
+ * Write-ahead log of the mutations of the registry. Every record is appended to an in-memory buffer while the
+ * lock of the shard that is changed is held, so the log has the same order as the registry, and it is written
+ * to the file by whoever commits it. The log is split in segments "<path>.<generation>": a snapshot of the
+ * registry taken when segment g starts replaces every segment before g.
+ *
+ *   record:   payload length (4 bytes) | CRC-32 of the payload (4 bytes) | payload
+ *   payload:  type (1 byte) | fields, each one ending in '\0'
+ *
+ * On startup the records of the segments after the snapshot are applied again in order; a torn or corrupted
+ * tail (a crash in the middle of a write) is cut off.
+ */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAL_HEADER_SIZE 8               // Bytes of the header of a record
+#define WAL_MAX_FIELDS 5                // Maximum number of fields of a record
+#define WAL_MAX_RECORD 2048             // Maximum bytes of the payload of a record
+#define WAL_BATCH_INTERVAL_MS 5         // Time between two writes of the background thread (none and batched)
+#define WAL_BUFFER_LIMIT (1 << 20)      // Buffered bytes after which the background thread is woken up early
+#define WAL_ERROR UINT64_MAX            // Returned by wal_append() when the record could not be logged
+
+// Durability of the mutations, chosen with -d
+typedef enum
+{
+    WAL_NONE = 0,       // Written to the file in the background, never synced: lost if the machine crashes
+    WAL_BATCHED = 1,    // Written and synced in the background every WAL_BATCH_INTERVAL_MS
+    WAL_PER_OP = 2      // Synced before the reply (group commit: concurrent writers share one fsync)
+} WAL_MODE;
+
+// Types of the records
+typedef enum
+{
+    WAL_REGISTER = 1,   // ip, port, name, alias, birth
+    WAL_UNREGISTER = 2, // alias
+    WAL_STORE = 3,      // source alias, destination alias, msgId, message, id (message stored for a disconnected user)
+    WAL_DELIVERED = 4   // alias, first id, count (the pending messages first id .. first id + count - 1 were delivered)
+} WAL_RECORD;
+
+// Counters of the log
+typedef struct
+{
+    uint64_t records;                   // Records appended
+    uint64_t bytes;                     // Bytes appended
+    uint64_t writes;                    // Calls to write()
+    uint64_t syncs;                     // Calls to fdatasync()
+} WalStats;
+
+/**
+ * @brief Parse a durability mode ("none", "batched" or "per-op").
+ * @return the mode, -1 if the name is not valid
+ */
+int wal_parse_mode(const char *name);
+
+/**
+ * @brief Apply the records of the segments of a log from generation first on, in order, calling apply for each
+ * one, and cut off a torn tail. The segments before first are deleted.
+ * @param next generation of the first segment that does not exist
+ * @return the number of records applied, -1 -> Error
+ */
+long wal_replay(const char *path, uint64_t first, void (*apply)(uint8_t type, char **fields, int count),
+                uint64_t *next);
+
+/**
+ * @brief Open a new segment of the log for appending and start its background thread.
+ * Until the log is opened, nothing is logged.
+ * @return 0 -> Success, -1 -> Error
+ */
+int wal_open(const char *path, uint64_t generation, WAL_MODE mode);
+
+/**
+ * @brief Write and sync the records appended so far and go on in a new segment. No record may be appended
+ * meanwhile: the caller holds every lock of the registry.
+ * @return the generation of the new segment, 0 -> Error (or the log is not open)
+ */
+uint64_t wal_rotate();
+
+/**
+ * @brief Delete the segments of the log before generation, once a snapshot has replaced them.
+ */
+void wal_remove_segments(uint64_t generation);
+
+/**
+ * @brief Append a record to the log buffer. It must be called while the registry lock of the change is held.
+ * @return the position the log reaches with the record (to wait for it with wal_commit()), 0 if nothing is logged
+ * (the log is not open), WAL_ERROR -> Error (the record is too long or there is no memory)
+ */
+uint64_t wal_append(uint8_t type, const char **fields, int count);
+
+/**
+ * @brief Make the log durable up to position lsn, as the durability mode requires. Call it without any lock.
+ * @return 0 -> Success, -1 -> Error writing the log (or lsn is WAL_ERROR)
+ */
+int wal_commit(uint64_t lsn);
+
+/**
+ * @brief Write and sync everything appended so far and close the log.
+ */
+void wal_close();
+
+/**
+ * @brief Get a copy of the counters of the log.
+ */
+WalStats wal_stats();
+
+/**
+ * @brief Display the counters of the log.
+ */
+void display_wal_stats();
+
+#endif
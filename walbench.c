@@ -0,0 +1,157 @@
+/*
+ * File: walbench.c
+ * Authors: 100451339 & 100451170
+ *
+ * Benchmark of the throughput of SEND with each durability of the write-ahead log (the receivers are disconnected,
+ * so every message is stored and logged), and of a restart from a snapshot of a large registry.
+ * Usage: ./walbench [directory of the log] [users of the restart]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "servidor.h"
+#include "wal.h"
+#include "util.h"
+
+#define BENCH_USERS 1024            // Senders (connected) and receivers (disconnected)
+#define BENCH_SECONDS 1             // Duration of each measurement
+#define MAX_THREADS 16              // Largest number of sending threads
+#define DEFAULT_RESTART_USERS 1000000   // Users of the restart when no argument is given
+#define RESTART_MAILBOXES 10        // One user of every RESTART_MAILBOXES has a pending message
+
+char aliases[2 * BENCH_USERS][16];  // Senders first, then receivers
+volatile int running;               // 0 -> The sending threads must stop
+unsigned long sent[MAX_THREADS];    // Messages sent by each thread
+
+/**
+ * @brief Send messages from random senders to random receivers until running is 0
+ */
+void *send_worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned int seed = 12345 + id;
+    unsigned long count = 0;
+    while (running) {
+        seed = seed * 1103515245 + 12345;
+        unsigned int source = (seed >> 8) % BENCH_USERS;
+        seed = seed * 1103515245 + 12345;
+        unsigned int dest = BENCH_USERS + (seed >> 8) % BENCH_USERS;
+        list_send_message(aliases[source], aliases[dest], "hello, this message is stored and logged");
+        count++;
+    }
+    sent[id] = count;
+    return NULL;
+}
+
+/**
+ * @brief Measure the SEND throughput with a log of the given durability and threads sending threads
+ */
+void bench_mode(const char *path, WAL_MODE mode, const char *name, int threads) {
+    list_init();
+    if (wal_open(path, 0, mode) != 0) {
+        perror("Error opening the log");
+        exit(1);
+    }
+    for (int i = 0; i < 2 * BENCH_USERS; i++) {
+        list_register_user("127.0.0.1", "5000", aliases[i], aliases[i], "01/01/2000");
+        if (i < BENCH_USERS) {
+            list_connect_user("127.0.0.1", "5000", aliases[i]);
+        }
+    }
+    WalStats before = wal_stats();
+
+    pthread_t tids[MAX_THREADS];
+    running = 1;
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, send_worker, (void *)(intptr_t)i);
+    }
+    sleep(BENCH_SECONDS);
+    running = 0;
+    unsigned long total = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total += sent[i];
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+    WalStats after = wal_stats();
+    wal_close();
+    wal_remove_segments(1);
+
+    unsigned long syncs = (unsigned long)(after.syncs - before.syncs);
+    printf("%10s %10d %16.0f %12lu %16.1f\n", name, threads, total / seconds, syncs,
+           syncs > 0 ? (double)total / syncs : 0.0);
+}
+
+/**
+ * @brief Measure a snapshot of a registry of users users and the restart from it
+ */
+void bench_restart(const char *path, unsigned int users) {
+    list_init();
+    if (wal_open(path, 0, WAL_NONE) != 0) {
+        perror("Error opening the log");
+        exit(1);
+    }
+    char alias[16];
+    char sender[16] = "user0";
+    for (unsigned int i = 0; i < users; i++) {
+        sprintf(alias, "user%u", i);
+        list_register_user("127.0.0.1", "5000", alias, alias, "01/01/2000");
+    }
+    list_connect_user("127.0.0.1", "5000", sender);
+    for (unsigned int i = 1; i < users; i += RESTART_MAILBOXES) {
+        sprintf(alias, "user%u", i);
+        list_send_message(sender, alias, "hello, this message waits in a snapshot");
+    }
+
+    uint64_t start = now_ns();
+    uint64_t generation = list_snapshot(path);
+    double snapshot_ms = (double)(now_ns() - start) / 1e6;
+    wal_close();
+    if (generation == 0) {
+        printf("Error taking the snapshot\n");
+        exit(1);
+    }
+
+    list_init();
+    long loaded;
+    start = now_ns();
+    long records = list_recover(path, &loaded, &generation);
+    double restart_ms = (double)(now_ns() - start) / 1e6;
+
+    printf("\n%10s %16s %16s %16s\n", "users", "snapshot ms", "restart ms", "log records");
+    printf("%10ld %16.1f %16.1f %16ld\n", loaded, snapshot_ms, restart_ms, records);
+
+    char snapshot[4200];
+    snprintf(snapshot, sizeof(snapshot), "%s.snapshot", path);
+    unlink(snapshot);
+    wal_remove_segments(generation);
+}
+
+int main(int argc, char *argv[]) {
+    const char *directory = argc > 1 ? argv[1] : ".";
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/walbench.log", directory);
+
+    for (int i = 0; i < 2 * BENCH_USERS; i++) {
+        sprintf(aliases[i], "user%d", i);
+    }
+
+    const char *names[] = {"none", "batched", "per-op"};
+    printf("%10s %10s %16s %12s %16s\n", "durability", "threads", "sends/s", "fsyncs", "sends/fsync");
+    for (int mode = WAL_NONE; mode <= WAL_PER_OP; mode++) {
+        for (int threads = 1; threads <= MAX_THREADS; threads *= 4) {
+            bench_mode(path, (WAL_MODE)mode, names[mode], threads);
+        }
+    }
+
+    unsigned int users = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : DEFAULT_RESTART_USERS;
+    bench_restart(path, users);
+
+    request_delete_list();
+    return 0;
+}